@@ -30,7 +30,20 @@ std::vector<std::pair<int, int>> parseString(const std::string& s) {
     return result;
 }
 
-Server::Server(): squid(){
+// Starts from the data owner's key and database files when both are configured, otherwise from the example DB
+static Squid CreateSquid(){
+    const Json::Value& config = drogon::app().getCustomConfig();
+    std::string key_file = config.get("key_file", "").asString();
+    std::string db_file = config.get("db_file", "").asString();
+    bool map_db = config.get("map_db", false).asBool();
+
+    if (key_file.empty() || db_file.empty()){
+        return Squid();
+    }
+    return Squid(key_file, db_file, map_db);
+}
+
+Server::Server(): squid(CreateSquid()){
     api_keys = std::unordered_set<std::string>{MasterApiKey};
 };
 
@@ -331,6 +344,86 @@ void Server::getHeadersAPI(const HttpRequestPtr &req,
     callback(resp);
 }
 
+// Swaps in a new encrypted database without restarting; db defaults to the configured db_file
+void Server::reloadDBAPI(const HttpRequestPtr &req,
+                   std::function<void (const HttpResponsePtr &)> &&callback,
+                   std::string db,
+                   std::string map,
+                   const std::string &apikey)
+{
+    LOG_DEBUG<<"Running reload DB with "<< db <<" from user with API Key: " << apikey;
+
+    Json::Value ret;
+
+    if (apikey != MasterApiKey){
+        ret["result"]="failed";
+        auto resp=HttpResponse::newHttpJsonResponse(ret);
+        callback(resp);
+        return;
+    }
+
+    const Json::Value& config = drogon::app().getCustomConfig();
+    if (db.empty()){
+        db = config.get("db_file", "").asString();
+    }
+    if (db.empty()){
+        ret["result"]="no database file given or configured";
+        auto resp=HttpResponse::newHttpJsonResponse(ret);
+        callback(resp);
+        return;
+    }
+
+    bool map_db;
+    if (map.empty()){
+        map_db = config.get("map_db", false).asBool();
+    }
+    else if (map == "0"){
+        map_db = false;
+    }
+    else if (map == "1"){
+        map_db = true;
+    }
+    else{
+        ret["result"]="map failed to parse";
+        auto resp=HttpResponse::newHttpJsonResponse(ret);
+        callback(resp);
+        return;
+    }
+
+    // Loading takes a while, so it runs in the background and is followed through /reloadStatus
+    ret["result"] = squid.StartReload(db, map_db) ? "started" : "reload already in progress";
+    auto resp=HttpResponse::newHttpJsonResponse(ret);
+    callback(resp);
+}
+
+void Server::reloadStatusAPI(const HttpRequestPtr &req,
+                   std::function<void (const HttpResponsePtr &)> &&callback,
+                   const std::string &apikey) const
+{
+    LOG_DEBUG<<"Running reload status with API Key: " << apikey;
+
+    Json::Value ret;
+
+    if (apikey != MasterApiKey){
+        ret["result"]="failed";
+        auto resp=HttpResponse::newHttpJsonResponse(ret);
+        callback(resp);
+        return;
+    }
+
+    DBReloadStats stats = squid.GetReloadStats();
+    ret["result"] = stats.in_progress ? "in progress" : (stats.error.empty() ? "done" : "failed");
+    ret["error"] = stats.error;
+    ret["reloads"] = (Json::UInt64)stats.reloads;
+    ret["load_seconds"] = stats.load.seconds;
+    ret["bytes_read"] = (Json::UInt64)stats.load.bytes_read;
+    ret["swap_seconds"] = stats.swap_seconds;
+    ret["draining_queries"] = (Json::UInt64)stats.draining_queries;
+    ret["drain_seconds"] = stats.drain_seconds;
+    auto resp=HttpResponse::newHttpJsonResponse(ret);
+    callback(resp);
+}
+
 void Server::AddKSK(helib::PubKey& client_pk, string id){
     auto ksk = client_pk.genPublicKeySwitchingKey(squid.GetSK());
     key_switch_store.emplace(id, ksk);
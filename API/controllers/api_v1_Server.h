@@ -27,6 +27,8 @@ class Server : public drogon::HttpController<Server>
     METHOD_ADD(Server::mafQueryAPI,"/mafQuery?query={1}&conj={2}&target={3}&key={4}", Get);
     METHOD_ADD(Server::PRSQueryAPI,"/PRSQuery?params={1}&key={2}", Get);
     METHOD_ADD(Server::getHeadersAPI,"/headers?key={1}", Get);
+    METHOD_ADD(Server::reloadDBAPI,"/reloadDB?db={1}&map={2}&key={3}", Post);
+    METHOD_ADD(Server::reloadStatusAPI,"/reloadStatus?key={1}", Get);
     METHOD_LIST_END
 
     Server();
@@ -61,6 +63,14 @@ class Server : public drogon::HttpController<Server>
     void getHeadersAPI(const HttpRequestPtr &req,
                  std::function<void (const HttpResponsePtr &)> &&callback,
                  const std::string &apikey) const;
+    void reloadDBAPI(const HttpRequestPtr &req,
+                 std::function<void (const HttpResponsePtr &)> &&callback,
+                 std::string db,
+                 std::string map,
+                 const std::string &apikey);
+    void reloadStatusAPI(const HttpRequestPtr &req,
+                 std::function<void (const HttpResponsePtr &)> &&callback,
+                 const std::string &apikey) const;
     
     void AddKSK(helib::PubKey& client_pk, string id);
 
@@ -102,6 +102,48 @@ Squid::Squid(): context(helib::ContextBuilder<helib::BGV>()
 
     helib::addSome1DMatrices(secret_key);
 
+    Setup();
+
+    SetServerToExample();
+    PrintContext();
+}
+
+// Key files start with the BGV parameters (m, p, r, qbits) of the data owner, followed by the context
+static helib::Context ReadKeyFileContext(std::istream& str){
+    long params[4];
+    str.read(reinterpret_cast<char*>(params), sizeof(params));
+    if (!str){
+        throw invalid_argument("ERROR: key file is truncated");
+    }
+    return helib::Context::readFrom(str);
+}
+
+static std::ifstream OpenKeyFile(const string& key_file){
+    std::ifstream file(key_file, std::ios::binary);
+    if (!file.is_open()){
+        throw invalid_argument("ERROR: cannot open key file: " + key_file);
+    }
+    return file;
+}
+
+Squid::~Squid(){
+    if (reload_thread.joinable()){
+        reload_thread.join();
+    }
+}
+
+Squid::Squid(const string& key_file, const string& db_file, bool map_db): Squid(OpenKeyFile(key_file), db_file, map_db){
+}
+
+Squid::Squid(std::istream&& key_stream, const string& db_file, bool map_db): context(ReadKeyFileContext(key_stream)),
+                                                                             secret_key(helib::SecKey::readFrom(key_stream, context)){
+    Setup();
+
+    PrintDBLoadStats(map_db ? MapDB(db_file) : LoadDB(db_file));
+    PrintContext();
+}
+
+void Squid::Setup(){
     const helib::EncryptedArray& ea = context.getEA();
     num_slots = ea.size();
     plaintext_modulus = context.getP();
@@ -110,21 +152,208 @@ Squid::Squid(): context(helib::ContextBuilder<helib::BGV>()
     neg_three_over_two = get_inverse(-3,2,plaintext_modulus);
     neg_one_over_two = get_inverse(-1,2,plaintext_modulus);
 
-    db_set = false;
-    helib::Ptxt<helib::BGV> ptxt(context);
     public_key_ptr = new helib::PubKey(secret_key);
 
-    SetServerToExample();
-    PrintContext();
+    // Capacity one multiplication of fresh ciphertexts takes, which product trees are planned with
+    helib::Ctxt fresh(*public_key_ptr);
+    public_key_ptr->Encrypt(fresh, NTL::ZZX(1));
+    helib::Ctxt product = fresh;
+    product.multiplyBy(fresh);
+    product_bits = fresh.bitCapacity() - product.bitCapacity();
+}
+
+shared_ptr<const SquidDB> Squid::CurrentDB() const{
+    lock_guard<mutex> lock(db_handle_mutex);
+    return db;
+}
+
+shared_ptr<const SquidDB> Squid::QueryDB() const{
+    shared_ptr<const SquidDB> current = CurrentDB();
+    if (!current){
+        throw invalid_argument("ERROR: DB needs to be set to run query");
+    }
+    return current;
+}
+
+// Every database is freed through here, so a reload can wait for the one it swapped out to go
+shared_ptr<SquidDB> Squid::NewDB(){
+    return shared_ptr<SquidDB>(new SquidDB(), [this](SquidDB* retired){
+        delete retired;
+        {
+            lock_guard<mutex> lock(db_handle_mutex);
+        }
+        released_cv.notify_all();
+    });
+}
+
+shared_ptr<const SquidDB> Squid::Publish(shared_ptr<SquidDB> next){
+    lock_guard<mutex> lock(db_handle_mutex);
+    shared_ptr<const SquidDB> previous = move(db);
+    db = move(next);
+    return previous;
+}
+
+// Every worker process mapping the same file shares one copy of it in the page cache
+DBLoadStats Squid::ReadDB(SquidDB& next, const string& db_file, bool map_db) const{
+    auto start = chrono::steady_clock::now();
+
+    DBFileHeader header;
+    DBLoadStats stats;
+    if (map_db){
+        const DBFileMapping& mapping = next.encrypted_db.Map(db_file, *public_key_ptr, num_slots);
+        header = mapping.Header();
+        next.column_headers = mapping.ColumnHeaders();
+        stats.bytes_read = mapping.MappedBytes();
+    }
+    else{
+        vector<vector<helib::Ctxt>> columns;
+        vector<helib::Ctxt> continuous_db;
+        stats = ReadDBFile(db_file, *public_key_ptr, num_slots, header, columns, continuous_db, next.column_headers);
+        next.encrypted_db.Assign(move(columns));
+    }
+
+    // The API queries read every slot of a column as one patient's genotype, so they cannot answer over either
+    if (header.snps_per_slot != 1){
+        throw invalid_argument("ERROR: " + db_file + " packs " + to_string(header.snps_per_slot) +
+                               " SNPs per slot, which the API does not unpack");
+    }
+    if (!header.deleted_rows.empty()){
+        throw invalid_argument("ERROR: " + db_file + " has " + to_string(header.deleted_rows.size()) +
+                               " deleted rows still in its ciphertexts; compact it on the server first");
+    }
+
+    next.num_rows = header.num_rows;
+    next.num_cols = header.num_cols;
+    next.num_compressed_rows = header.num_compressed_rows;
+
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+void Squid::SaveDB(const string& db_file) const{
+    shared_ptr<const SquidDB> current = CurrentDB();
+    if (!current){
+        throw invalid_argument("ERROR: DB needs to be set to be saved");
+    }
+
+    DBFileHeader header;
+    header.num_slots = num_slots;
+    header.num_rows = current->num_rows;
+    header.num_cols = current->encrypted_db.size();
+    header.num_compressed_rows = current->num_compressed_rows;
+
+    DBFileWriter writer(db_file, header, current->column_headers);
+    current->encrypted_db.WriteTo(writer);
+    writer.Finish();
+}
+
+DBLoadStats Squid::LoadDB(const string& db_file){
+    shared_ptr<SquidDB> next = NewDB();
+    DBLoadStats stats = ReadDB(*next, db_file, false);
+    Publish(move(next));
+    return stats;
+}
+
+DBLoadStats Squid::MapDB(const string& db_file){
+    shared_ptr<SquidDB> next = NewDB();
+    DBLoadStats stats = ReadDB(*next, db_file, true);
+    Publish(move(next));
+    return stats;
+}
+
+bool Squid::StartReload(const string& db_file, bool map_db){
+    // Held until the new thread is in place, so concurrent callers cannot both take over reload_thread
+    lock_guard<mutex> start_lock(reload_start_mutex);
+    {
+        lock_guard<mutex> lock(reload_stats_mutex);
+        if (reload_stats.in_progress){
+            return false;
+        }
+        reload_stats.in_progress = true;
+    }
+
+    // Joined without reload_stats_mutex held, as the previous thread still reads the stats to print them
+    if (reload_thread.joinable()){
+        reload_thread.join();
+    }
+    reload_thread = thread([this, db_file, map_db](){
+        try{
+            ReloadDB(db_file, map_db);
+        }
+        catch (...){
+            // Recorded in the reload stats printed below
+        }
+        PrintDBReloadStats(GetReloadStats());
+    });
+    return true;
+}
+
+DBReloadStats Squid::ReloadDB(const string& db_file, bool map_db){
+    lock_guard<mutex> reload_lock(reload_mutex);
+    {
+        lock_guard<mutex> lock(reload_stats_mutex);
+        reload_stats.in_progress = true;
+    }
+
+    DBReloadStats stats;
+    try{
+        shared_ptr<SquidDB> next = NewDB();
+        stats.load = ReadDB(*next, db_file, map_db);
+
+        auto swap_start = chrono::steady_clock::now();
+        shared_ptr<const SquidDB> previous = Publish(move(next));
+        auto swapped = chrono::steady_clock::now();
+        stats.swap_seconds = chrono::duration<double>(swapped - swap_start).count();
+
+        if (previous){
+            // Once swapped out, the only owners of the old database besides previous are the queries in flight
+            stats.draining_queries = previous.use_count() - 1;
+            weak_ptr<const SquidDB> retired = previous;
+            previous.reset();
+
+            unique_lock<mutex> lock(db_handle_mutex);
+            released_cv.wait(lock, [&retired]{ return retired.expired(); });
+        }
+        stats.drain_seconds = chrono::duration<double>(chrono::steady_clock::now() - swapped).count();
+    }
+    catch (const exception& e){
+        stats.error = e.what();
+    }
+
+    lock_guard<mutex> lock(reload_stats_mutex);
+    stats.reloads = reload_stats.reloads + (stats.error.empty() ? 1 : 0);
+    reload_stats = stats;
+    if (!stats.error.empty()){
+        throw runtime_error("ERROR: reloading " + db_file + " failed: " + stats.error);
+    }
+    return stats;
 }
 
-void Squid::GenData(int _num_rows, int _num_cols){
-    num_rows = _num_rows;
-    num_cols = _num_cols;
+DBReloadStats Squid::GetReloadStats() const{
+    lock_guard<mutex> lock(reload_stats_mutex);
+    return reload_stats;
+}
 
-    num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
+void PrintDBReloadStats(const DBReloadStats& stats){
+    if (!stats.error.empty()){
+        cout << "Reload failed: " << stats.error << endl;
+        return;
+    }
+    PrintDBLoadStats(stats.load);
+    cout << "Reload " << stats.reloads << " swapped in within " << stats.swap_seconds << " s, "
+         << stats.draining_queries << " queries drained from the old database in " << stats.drain_seconds << " s" << endl;
+}
+
+void Squid::GenData(int num_rows, int num_cols){
+    shared_ptr<SquidDB> next = NewDB();
+    next->column_headers = column_headers;
+    next->num_rows = num_rows;
+    next->num_cols = num_cols;
 
-    encrypted_db = vector<vector<helib::Ctxt>>();
+    int num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
+    next->num_compressed_rows = num_compressed_rows;
+
+    vector<vector<helib::Ctxt>> columns = vector<vector<helib::Ctxt>>();
     for(int i = 0; i < num_cols; i++){
         vector<helib::Ctxt> cipher_vector = vector<helib::Ctxt>();
         for (int j = 0; j < num_compressed_rows; j++){
@@ -136,10 +365,10 @@ void Squid::GenData(int _num_rows, int _num_cols){
 
             cipher_vector.push_back(ctxt);
         }
-        encrypted_db.push_back(cipher_vector);
+        columns.push_back(move(cipher_vector));
     }
-
-    db_set = true;
+    next->encrypted_db.Assign(move(columns));
+    Publish(move(next));
 }
 
 const helib::Context& Squid::GetContext() const{
@@ -147,7 +376,8 @@ const helib::Context& Squid::GetContext() const{
 }
 
 int Squid::GetNumRows() const{
-    return num_rows;
+    shared_ptr<const SquidDB> current = CurrentDB();
+    return current ? current->num_rows : 0;
 }
 
 const helib::SecKey& Squid::GetSK() const{
@@ -157,22 +387,29 @@ const helib::SecKey& Squid::GetSK() const{
 
 
 
-const vector<string>& Squid::GetColumnHeaders() const{
-    return column_headers;
+vector<string> Squid::GetColumnHeaders() const{
+    shared_ptr<const SquidDB> current = CurrentDB();
+    return current ? current->column_headers : column_headers;
 }
 
 
-void Squid::SetData(vector<vector<unsigned long>> &db){
-    num_cols = db.size();
+void Squid::SetData(vector<vector<unsigned long>> &plain_db){
+    int num_cols = plain_db.size();
     if (num_cols == 0){
         throw invalid_argument("ERROR: DB has zero columns! THIS DOES NOT WORK!");
     }
     cout << __LINE__ << endl;
-    num_rows = db[0].size();
+    int num_rows = plain_db[0].size();
 
-    num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
+    int num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
 
-    encrypted_db = vector<vector<helib::Ctxt>>();
+    shared_ptr<SquidDB> next = NewDB();
+    next->column_headers = column_headers;
+    next->num_rows = num_rows;
+    next->num_cols = num_cols;
+    next->num_compressed_rows = num_compressed_rows;
+
+    vector<vector<helib::Ctxt>> columns = vector<vector<helib::Ctxt>>();
     
     for(int i = 0; i < num_cols; i++){
             cout << __LINE__ << endl;
@@ -188,7 +425,7 @@ void Squid::SetData(vector<vector<unsigned long>> &db){
 
             int entries_left = min(num_slots, num_rows - (j * num_slots));
             for (int k = 0; k < entries_left; k++){
-                ptxt[k] = db[i][j*num_slots + k];
+                ptxt[k] = plain_db[i][j*num_slots + k];
             }
 
             helib::Ctxt ctxt(*public_key_ptr);
@@ -198,9 +435,10 @@ void Squid::SetData(vector<vector<unsigned long>> &db){
 
             cipher_vector.push_back(ctxt);
         }
-        encrypted_db.push_back(cipher_vector);
+        columns.push_back(move(cipher_vector));
     }
-    db_set = true;
+    next->encrypted_db.Assign(move(columns));
+    Publish(move(next));
 }
 
 void Squid::SetColumnHeaders(vector<string> &headers){
@@ -211,10 +449,10 @@ void Squid::SetColumnHeaders(vector<string> &headers){
 }
 
 helib::Ctxt Squid::CountingQuery(bool conjunctive, vector<pair<int, int>>& query) const{
-    if (!db_set){
-        throw invalid_argument("ERROR: DB needs to be set to run query");
-    }
-    vector<vector<helib::Ctxt>> cols = filter(query);
+    shared_ptr<const SquidDB> current = QueryDB();
+    int num_compressed_rows = current->num_compressed_rows;
+
+    vector<vector<helib::Ctxt>> cols = filter(*current, query);
 
     int num_columns = cols[0].size();
 
@@ -252,7 +490,10 @@ helib::Ctxt Squid::CountingQuery(bool conjunctive, vector<pair<int, int>>& query
 }
 
 pair<helib::Ctxt, helib::Ctxt> Squid::MAFQuery(int snp, bool conjunctive, vector<pair<int, int>> &query) const{
-    vector<vector<helib::Ctxt>> cols = filter(query);
+    shared_ptr<const SquidDB> current = QueryDB();
+    int num_compressed_rows = current->num_compressed_rows;
+
+    vector<vector<helib::Ctxt>> cols = filter(*current, query);
     int num_columns = cols[0].size();
 
     vector<helib::Ctxt> filter_results;
@@ -278,9 +519,10 @@ pair<helib::Ctxt, helib::Ctxt> Squid::MAFQuery(int snp, bool conjunctive, vector
     }
 
     vector<helib::Ctxt> indv_MAF = vector<helib::Ctxt>();
+    ColumnStore::ColumnRef snp_column = current->encrypted_db[snp];
 
     for (int i = 0; i < num_compressed_rows; i++){
-        helib::Ctxt clone = encrypted_db[snp][i];
+        helib::Ctxt clone = snp_column[i];
         clone *= filter_results[i];
         indv_MAF.push_back(clone);
     }
@@ -296,31 +538,42 @@ pair<helib::Ctxt, helib::Ctxt> Squid::MAFQuery(int snp, bool conjunctive, vector
 }
 
 vector<helib::Ctxt> Squid::PRSQuery(vector<pair<int, int>>& prs_params) const{
+    shared_ptr<const SquidDB> current = QueryDB();
+    int num_compressed_rows = current->num_compressed_rows;
 
-    vector<helib::Ctxt> scores;
+    vector<vector<helib::Ctxt>> indvs_scores = vector<vector<helib::Ctxt>>(num_compressed_rows);
 
-    for(int j = 0; j < num_compressed_rows; j++){
-        vector<helib::Ctxt> indvs_scores;
-        for(pair<int, int> i : prs_params){
-            helib::Ctxt temp = encrypted_db[i.first][j];
+    // Walk one column at a time so each column is pinned only once
+    for(pair<int, int> i : prs_params){
+        ColumnStore::ColumnRef column = current->encrypted_db[i.first];
+        for(int j = 0; j < num_compressed_rows; j++){
+            helib::Ctxt temp = column[j];
 
             temp.multByConstant(NTL::ZZX(i.second));
-            indvs_scores.push_back(temp);
+            indvs_scores[j].push_back(temp);
         }
-        helib::Ctxt score = AddMany(indvs_scores);
+    }
+
+    vector<helib::Ctxt> scores;
+    for(int j = 0; j < num_compressed_rows; j++){
+        helib::Ctxt score = AddMany(indvs_scores[j]);
         scores.push_back(score);
     }
     return scores;
 }
 
 vector<pair<helib::Ctxt, helib::Ctxt>> Squid::ChiSquareQuery(int disease_column, int number_of_chi){
+    shared_ptr<const SquidDB> current = QueryDB();
+    int num_compressed_rows = current->num_compressed_rows;
+
     vector<pair<helib::Ctxt, helib::Ctxt>> chi_square_results = vector<pair<helib::Ctxt, helib::Ctxt>>();
 
     helib::Ctxt n11(*public_key_ptr);
     helib::Ctxt c1(*public_key_ptr);
 
     // r1
-    helib::Ctxt r1 = AddManySafe(encrypted_db[disease_column]);
+    ColumnStore::ColumnRef disease = current->encrypted_db[disease_column];
+    helib::Ctxt r1 = AddManySafe(*disease);
     SquashCtxtWithMask(r1,0);
     CtxtExpand(r1);
     r1.multByConstant(NTL::ZZX(2));
@@ -329,20 +582,21 @@ vector<pair<helib::Ctxt, helib::Ctxt>> Squid::ChiSquareQuery(int disease_column,
 
     // Y
     for (int c = 0; c < number_of_chi; c++){
+        ColumnStore::ColumnRef column = current->encrypted_db[c];
         vector<helib::Ctxt> ytS = vector<helib::Ctxt>();
         for (int r = 0; r < num_compressed_rows; r++){
-            helib::Ctxt s = encrypted_db[c][r];
-            s.multiplyBy(encrypted_db[disease_column][r]);
+            helib::Ctxt s = column[r];
+            s.multiplyBy(disease[r]);
             ytS.push_back(s);
         }
         helib::Ctxt sum = AddManySafe(ytS);
         n11.addCtxt(SquashCtxtWithMask(sum, c));
-        sum = AddManySafe(encrypted_db[c]);
+        sum = AddManySafe(*column);
         c1.addCtxt(SquashCtxtWithMask(sum,c));
     }
 
     // D
-    helib::Ctxt d = Encrypt(2 * num_rows);
+    helib::Ctxt d = Encrypt(2 * current->num_rows);
 
     //chisquare
 
@@ -373,11 +627,10 @@ vector<pair<helib::Ctxt, helib::Ctxt>> Squid::ChiSquareQuery(int disease_column,
 }
 
 vector<pair<helib::Ctxt, helib::Ctxt>> Squid::ChiSquareQuery(bool conjunctive, vector<pair<int, int>>& query, int disease_column, int number_of_chi){
-    if (!db_set){
-        throw invalid_argument("ERROR: DB needs to be set to run query");
-    }
+    shared_ptr<const SquidDB> current = QueryDB();
+    int num_compressed_rows = current->num_compressed_rows;
 
-    vector<vector<helib::Ctxt>> cols = filter(query);
+    vector<vector<helib::Ctxt>> cols = filter(*current, query);
 
     int num_columns = cols[0].size();
 
@@ -420,7 +673,7 @@ vector<pair<helib::Ctxt, helib::Ctxt>> Squid::ChiSquareQuery(bool conjunctive, v
 
     vector<pair<helib::Ctxt, helib::Ctxt>> chi_square_results = vector<pair<helib::Ctxt, helib::Ctxt>>();
 
-    for (int i = 0; i < num_cols - 1; i++){
+    for (int i = 0; i < current->num_cols - 1; i++){
         for (int j = 0; j < num_compressed_rows; j++){
 
         }
@@ -440,38 +693,17 @@ void Squid::AddOneMod2(helib::Ctxt& a) const{
 }
 
 helib::Ctxt Squid::MultiplyMany(vector<helib::Ctxt>& v) const{
-    int num_entries = v.size();
-    int depth = ceil(log2(num_entries));
-
-    for (int d = 0; d < depth; d++){
-        int jump_factor = pow(2, d);
-        int skip_factor = 2 * jump_factor;
-
-        for (int i = 0; i < num_entries; i+= skip_factor){
-            v[i].multiplyBy(v[i + jump_factor]);
-        }
-     }
-     return v[0];
+    // Products here are multiplied and rotated further, so each one is relinearized as it is made
+    return MultiplyTree(v, product_bits, false);
 }
 
 
 
 helib::Ctxt Squid::AddMany(vector<helib::Ctxt>& v) const{
-    int num_entries = v.size();
-    int depth = ceil(log2(num_entries));
-
-    for (int d = 0; d < depth; d++){
-        int jump_factor = pow(2, d);
-        int skip_factor = 2 * jump_factor;
-
-        for (int i = 0; i < num_entries; i+= skip_factor){
-            v[i] += v[i + jump_factor];
-        }
-     }
-     return v[0];
+    return SumMany(v, *public_key_ptr);
 }
 
-helib::Ctxt Squid::AddManySafe(vector<helib::Ctxt>& v) const{
+helib::Ctxt Squid::AddManySafe(const vector<helib::Ctxt>& v) const{
 
     helib::Ctxt result(*public_key_ptr);
 
@@ -494,59 +726,13 @@ helib::Ctxt Squid::SquashCtxt(helib::Ctxt& ciphertext, int num_data_elements) co
 }
 
 helib::Ctxt Squid::SquashCtxtLogTime(helib::Ctxt& ciphertext) const{
-    const helib::EncryptedArray& ea = context.getEA();
-
-    int depth = floor(log2(num_slots));
-
-    //cout << "Depth: " <<  depth << endl;
-
-    helib::Ptxt<helib::BGV> mask(context);
-    helib::Ptxt<helib::BGV> inverse_mask(context);
-
-    int largest_power_of_two_less_than_or_equal_two_slotsize = 1 << depth;
-    for (int i = 0; i < num_slots; i++){
-        if (i < largest_power_of_two_less_than_or_equal_two_slotsize){
-            mask[i] = 1;
-            inverse_mask[i] = 0;
-        }
-        else{
-            mask[i] = 0;
-            inverse_mask[i] = 1;
-        }
-    }
-    //cout << "far_end:" << endl;
-    helib::Ctxt far_end = ciphertext;
-    far_end.multByConstant(inverse_mask);
-
-    //print_vector(Decrypt(far_end), num_slots);
-
-    ea.rotate(far_end, -largest_power_of_two_less_than_or_equal_two_slotsize);
-
-    ciphertext.multByConstant(mask);
-    ciphertext += far_end;
-
-    //print_vector(Decrypt(ciphertext), 10);
-
-
-    for (int d = depth - 1; d >= 0; d--){
-        int shift = 1 << d;
-        helib::Ctxt clone = ciphertext;
-        ea.rotate(clone, (-shift));
-        ciphertext += clone;
-        //cout << "Printing mid way through with depth:" << d << endl;
-        //print_vector(Decrypt(ciphertext), 10);
-    }
-
+    SumSlots(context.getEA(), ciphertext);
     return ciphertext;
 }
 
 helib::Ctxt Squid::SquashCtxtWithMask(helib::Ctxt& ciphertext, int index) const{
-    ciphertext = SquashCtxtLogTime(ciphertext);
-    //cout << "Running squash with mask" << endl;
-    //print_vector(Decrypt(ciphertext), 10);
-    const helib::EncryptedArray& ea = context.getEA();
-
-    ea.rotate(ciphertext, index);
+    // Every slot holds the total, so it only has to be masked to the one asked for
+    SumSlots(context.getEA(), ciphertext);
 
     helib::Ptxt<helib::BGV> mask(context);
     mask[index] = 1;
@@ -557,27 +743,8 @@ helib::Ctxt Squid::SquashCtxtWithMask(helib::Ctxt& ciphertext, int index) const{
 }
 
 void Squid::CtxtExpand(helib::Ctxt &ciphertext) const{
-    const helib::EncryptedArray& ea = context.getEA();
-
-    int depth = floor(log2(num_slots));
-
-    helib::Ptxt<helib::BGV> mask(context);
-
-    int largest_power_of_two_less_than_or_equal_two_slotsize = 1 << depth;
-    for (int i = 0; i < num_slots - largest_power_of_two_less_than_or_equal_two_slotsize; i++){
-        mask[i] = 1;
-    }
-    for (int d = 0; d < depth; d++){
-        int shift = 1 << d;
-        helib::Ctxt clone = ciphertext;
-        ea.rotate(clone, (shift));
-        ciphertext += clone;
-    }
-
-    helib::Ctxt clone = ciphertext;
-    clone.multByConstant(mask);
-    ea.rotate(clone, largest_power_of_two_less_than_or_equal_two_slotsize);
-    ciphertext += clone;
+    // The other slots are zero, so the total of every slot is slot 0 and ends up in each of them
+    SumSlots(context.getEA(), ciphertext);
 }
 
 helib::Ctxt Squid::EQTest(unsigned long a, const helib::Ctxt& b) const{
@@ -635,14 +802,19 @@ helib::Ctxt Squid::EQTest(unsigned long a, const helib::Ctxt& b) const{
     }
 }
 
-vector<vector<helib::Ctxt>> Squid::filter(vector<pair<int, int>>& query) const{
+vector<vector<helib::Ctxt>> Squid::filter(const SquidDB& current, vector<pair<int, int>>& query) const{
     vector<vector<helib::Ctxt>> feature_cols;
 
-    for(int j = 0; j < num_compressed_rows; j++){
+    vector<ColumnStore::ColumnRef> query_cols;
+    for(pair<int, int> i : query){
+        query_cols.push_back(current.encrypted_db[i.first]);
+    }
+
+    for(int j = 0; j < current.num_compressed_rows; j++){
         vector<helib::Ctxt> indv_vector;
-        for(pair<int, int> i : query){
+        for(size_t k = 0; k < query.size(); k++){
 
-            indv_vector.push_back(EQTest(i.second, encrypted_db[i.first][j]));
+            indv_vector.push_back(EQTest(query[k].second, query_cols[k][j]));
         }
         feature_cols.push_back(indv_vector);
     }
@@ -706,7 +878,7 @@ helib::Ctxt Squid::Encrypt(vector<unsigned long> a) const{
 }
 
 helib::Ctxt Squid::GetAnyElement() const{
-    return encrypted_db[0][0];
+    return QueryDB()->encrypted_db[0][0];
 }
 
 void Squid::PrintContext() const{
@@ -717,6 +889,17 @@ void Squid::PrintContext() const{
 }
 
 string Squid::PrintEncryptedDB(bool with_headers) const{
+    shared_ptr<const SquidDB> current = QueryDB();
+    int num_rows = current->num_rows;
+    int num_cols = current->num_cols;
+    int num_compressed_rows = current->num_compressed_rows;
+    const vector<string>& column_headers = current->column_headers;
+
+    vector<ColumnStore::ColumnRef> cols;
+    for (int i = 0; i < num_cols; i++){
+        cols.push_back(current->encrypted_db[i]);
+    }
+
     string s = "";
         if (with_headers){
         vector<int> string_length_count = vector<int>();
@@ -733,7 +916,7 @@ string Squid::PrintEncryptedDB(bool with_headers) const{
 
             vector<vector<long>> temp_storage = vector<vector<long>>();
             for (int i = 0; i < num_cols; i++){
-                temp_storage.push_back(Decrypt(encrypted_db[i][j]));
+                temp_storage.push_back(Decrypt(cols[i][j]));
             }
             for (int jj = 0; jj < min(num_slots, num_rows - (j * num_slots)); jj++){
 
@@ -764,7 +947,7 @@ string Squid::PrintEncryptedDB(bool with_headers) const{
 
             vector<vector<long>> temp_storage = vector<vector<long>>();
             for (int i = 0; i < num_cols; i++){
-                temp_storage.push_back(Decrypt(encrypted_db[i][j]));
+                temp_storage.push_back(Decrypt(cols[i][j]));
             }
             for (int jj = 0; jj < min(num_slots, num_rows - (j * num_slots)); jj++){
 
@@ -865,7 +1048,7 @@ inline long estimateCtxtSize(const helib::Context& context, long offset)
 }
 
 int Squid::StorageOfOneElement(){
-    if (!db_set){
+    if (!CurrentDB()){
         throw invalid_argument("ERROR: DB needs to be set to get storage cost");
     }
     return estimateCtxtSize(context, 0);
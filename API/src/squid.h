@@ -5,22 +5,74 @@
 #include <string>
 #include <sstream>
 #include <map>
-
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "db_file.hpp"
+#include "column_store.hpp"
+#include "product_tree.hpp"
+#include "sum_tree.hpp"
+#include "slot_sum.hpp"
 
 using namespace std;
 
+// Encrypted database a query runs against. It is never changed once published: loading a new database builds
+// the next one and swaps the handle, while queries already running keep the one they started on alive.
+struct SquidDB
+{
+    ColumnStore encrypted_db;
+    vector<string> column_headers;
+
+    int num_rows = 0;
+    int num_cols = 0;
+    int num_compressed_rows = 0;
+};
+
+// Last hot reload of the encrypted database
+struct DBReloadStats
+{
+    uint64_t reloads = 0;
+    bool in_progress = false;
+    DBLoadStats load;               // reading the new database, while queries kept running on the old one
+    double swap_seconds = 0;        // time the handle was locked to swap the databases
+    uint64_t draining_queries = 0;  // queries still running on the old database when it was swapped out
+    double drain_seconds = 0;       // from the swap until the last of them finished and the old database was freed
+    string error;                   // why the last reload failed, empty if it succeeded
+};
+
+void PrintDBReloadStats(const DBReloadStats& stats);
 
 class Squid
 {
   public:
     Squid();
+    Squid(const string& key_file, const string& db_file, bool map_db = false);
+    ~Squid();
+
+    Squid(const Squid&) = delete;
+    Squid& operator=(const Squid&) = delete;
 
     void GenData(int _num_rows, int _num_cols);
-    void SetData(vector<vector<unsigned long>> &db);
+    void SetData(vector<vector<unsigned long>> &plain_db);
     void SetColumnHeaders(vector<string> &headers);
 
     void SetServerToExample();
 
+    void SaveDB(const string& db_file) const;
+    DBLoadStats LoadDB(const string& db_file);
+    DBLoadStats MapDB(const string& db_file);
+
+    // Loads db_file, which has to be encrypted under this server's keys, on a background thread and swaps it in
+    // once it is ready. Queries keep being served from the current database meanwhile and those in flight at the
+    // swap finish on it. Returns false without doing anything while another reload is in progress.
+    bool StartReload(const string& db_file, bool map_db = false);
+    // Same, on the calling thread
+    DBReloadStats ReloadDB(const string& db_file, bool map_db = false);
+    DBReloadStats GetReloadStats() const;
+
     helib::Ctxt CountingQuery(bool conjunctive, vector<pair<int, int>>& query) const;
     pair<helib::Ctxt, helib::Ctxt> MAFQuery(int snp, bool conjunctive, vector<pair<int, int>> &query) const;
     vector<helib::Ctxt> PRSQuery(vector<pair<int, int>>& prs_params) const;
@@ -36,19 +88,31 @@ class Squid
     const helib::Context& GetContext() const;
     const helib::SecKey& GetSK() const;
 
-    const vector<string>& GetColumnHeaders() const;
+    vector<string> GetColumnHeaders() const;
 
 
   private:
+    Squid(std::istream&& key_stream, const string& db_file, bool map_db);
+    void Setup();
+
+    // Database queries run against, null until one is set. Queries hold on to it for as long as they run.
+    shared_ptr<const SquidDB> CurrentDB() const;
+    // Same for a query, which fails without one
+    shared_ptr<const SquidDB> QueryDB() const;
+    shared_ptr<SquidDB> NewDB();
+    DBLoadStats ReadDB(SquidDB& next, const string& db_file, bool map_db) const;
+    // Swaps next in and returns the database it replaced
+    shared_ptr<const SquidDB> Publish(shared_ptr<SquidDB> next);
+
     void AddOneMod2(helib::Ctxt& a) const;
     helib::Ctxt MultiplyMany(vector<helib::Ctxt>& v) const;
     helib::Ctxt AddMany(vector<helib::Ctxt>& v) const;
-    helib::Ctxt AddManySafe(vector<helib::Ctxt>& v) const;
+    helib::Ctxt AddManySafe(const vector<helib::Ctxt>& v) const;
     helib::Ctxt SquashCtxt(helib::Ctxt& ciphertext, int num_data_entries = 10) const;
     helib::Ctxt SquashCtxtLogTime(helib::Ctxt& ciphertext) const;
     helib::Ctxt SquashCtxtWithMask(helib::Ctxt& ciphertext, int index) const;
     helib::Ctxt EQTest(unsigned long a, const helib::Ctxt& b) const;
-    vector<vector<helib::Ctxt>> filter(vector<pair<int, int>>& query) const;
+    vector<vector<helib::Ctxt>> filter(const SquidDB& current, vector<pair<int, int>>& query) const;
     void CtxtExpand(helib::Ctxt &ciphertext) const;
 
 
@@ -63,22 +127,30 @@ class Squid
     helib::SecKey secret_key;
     helib::PubKey* public_key_ptr;
     
-    bool db_set;
-    
-    int num_rows;
-    int num_cols;
-    int num_compressed_rows;
     int num_slots;
     
-    vector<vector<helib::Ctxt>> encrypted_db; 
     std::map<std::string, std::pair<std::vector<helib::DoubleCRT>,std::vector<helib::DoubleCRT>>> key_switch_store;
 
+    // Headers the next SetData or GenData publishes with its columns
     vector<string> column_headers;
+
+    // Declared before db, which notifies released_cv when a database it swapped out is freed
+    mutable mutex db_handle_mutex;
+    condition_variable released_cv;
+    shared_ptr<const SquidDB> db;
+
+    mutex reload_mutex;             // serializes reloads
+    mutex reload_start_mutex;       // serializes StartReload callers, which own reload_thread
+    mutable mutex reload_stats_mutex;
+    DBReloadStats reload_stats;
+    thread reload_thread;
     
     int one_over_two;
     int neg_three_over_two;
     int neg_one_over_two;
 
     int plaintext_modulus;
+    // Capacity one multiplication takes, measured once on fresh ciphertexts
+    long product_bits;
 };
 
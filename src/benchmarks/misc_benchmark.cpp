@@ -1,10 +1,14 @@
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <thread>
 
 #include <benchmark/benchmark.h>
 
 #include "../server.hpp"
+#include "../bgzf.hpp"
 
 static Server *serverInstance;
 
@@ -143,15 +147,19 @@ static void BM_SwithPublicKeySwitch(benchmark::State &state)
     }
 }
 
+// SNPs and threads, with one task per thread
 static void BM_ParallelSimilarityQuery(benchmark::State &state)
 {
-    helib::Ctxt d = serverInstance->Encrypt(0);
+    serverInstance->GenData(1, state.range(0));
+    serverInstance->SetQueryThreads(state.range(1));
+
+    vector<helib::Ctxt> d = vector<helib::Ctxt>(state.range(0), serverInstance->Encrypt(0));
     uint32_t targetSnp = 0;
     uint32_t threshold = 100;
 
     for (auto _ : state)
     {
-        auto result = serverInstance->SimilarityQueryP(targetSnp, d, threshold, state.range(1), state.range(0));
+        auto result = serverInstance->SimilarityQueryP(targetSnp, d, threshold, state.range(1));
 
         state.PauseTiming();
         if (!result.first.isCorrect() || !result.second.isCorrect())
@@ -164,8 +172,11 @@ static void BM_ParallelSimilarityQuery(benchmark::State &state)
     }
 }
 
+// SNPs and threads, with one task per thread
 static void BM_ParallelPRSQuery(benchmark::State &state)
 {
+    serverInstance->SetQueryThreads(state.range(1));
+
     vector<pair<uint32_t, int32_t>> query = vector<pair<uint32_t, int32_t>>();
     for (uint32_t i = 0; i < state.range(0); i++)
     {
@@ -186,12 +197,11 @@ static void BM_ParallelPRSQuery(benchmark::State &state)
     }
 }
 
+// Predicates, threads and compressed rows
 static void BM_ParallelMAFQuery(benchmark::State &state)
 {
-    if (state.range(0) > serverInstance->GetCols())
-    {
-        serverInstance->GenData(1, state.range(0));
-    }
+    serverInstance->GenData(state.range(2) * serverInstance->GetSlotSize(), max<int64_t>(16, state.range(0)));
+    serverInstance->SetQueryThreads(state.range(1));
 
     vector<pair<uint32_t, uint32_t>> query = vector<pair<uint32_t, uint32_t>>();
     for (uint32_t i = 0; i < state.range(0); i++)
@@ -200,10 +210,10 @@ static void BM_ParallelMAFQuery(benchmark::State &state)
     }
     for (auto _ : state)
     {
-        auto result = serverInstance->MAFQueryP(0, query, state.range(1));
+        auto result = serverInstance->MAFQueryP(0, query);
 
         state.PauseTiming();
-        if (!result.first.isCorrect() || !result.second.isCorrect())
+        if (!result.isCorrect())
         {
             std::cout << "ERROR EXCEEDED" << std::endl;
         }
@@ -211,14 +221,16 @@ static void BM_ParallelMAFQuery(benchmark::State &state)
 
         benchmark::DoNotOptimize(result);
     }
+    state.counters["Rows/s"] = benchmark::Counter(state.range(2) * serverInstance->GetSlotSize(),
+                                                  benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["Steals"] = serverInstance->GetExecutorStats().steals;
 }
 
+// Predicates, threads and compressed rows
 static void BM_ParallelCountQuery(benchmark::State &state)
 {
-    if (state.range(0) > serverInstance->GetCols())
-    {
-        serverInstance->GenData(1, state.range(0));
-    }
+    serverInstance->GenData(state.range(2) * serverInstance->GetSlotSize(), max<int64_t>(16, state.range(0)));
+    serverInstance->SetQueryThreads(state.range(1));
 
     vector<pair<uint32_t, uint32_t>> query = vector<pair<uint32_t, uint32_t>>();
     for (uint32_t i = 0; i < state.range(0); i++)
@@ -227,7 +239,7 @@ static void BM_ParallelCountQuery(benchmark::State &state)
     }
     for (auto _ : state)
     {
-        auto result = serverInstance->CountQueryP(query, state.range(1));
+        auto result = serverInstance->CountQueryP(query);
 
         state.PauseTiming();
         if (!result.isCorrect())
@@ -238,6 +250,130 @@ static void BM_ParallelCountQuery(benchmark::State &state)
 
         benchmark::DoNotOptimize(result);
     }
+    state.counters["Rows/s"] = benchmark::Counter(state.range(2) * serverInstance->GetSlotSize(),
+                                                  benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["Steals"] = serverInstance->GetExecutorStats().steals;
+}
+
+// Operands and lazy relinearization; without it every multiplication is relinearized, as MultiplyMany did
+static void BM_ProductTree(benchmark::State &state)
+{
+    vector<helib::Ctxt> values;
+    for (int64_t k = 0; k < state.range(0); k++)
+    {
+        values.push_back(serverInstance->Encrypt(1));
+    }
+
+    ProductTreeStats stats;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        vector<helib::Ctxt> operands = values;
+        state.ResumeTiming();
+
+        auto result = MultiplyTree(operands, serverInstance->GetProductBits(), state.range(1), &stats);
+
+        state.PauseTiming();
+        if (!result.isCorrect())
+        {
+            std::cout << "ERROR EXCEEDED" << std::endl;
+        }
+        state.ResumeTiming();
+
+        benchmark::DoNotOptimize(result);
+    }
+    state.counters["Depth"] = stats.depth;
+    state.counters["KeySwitches"] = stats.key_switches;
+    state.counters["BitsLeft"] = stats.bit_capacity;
+}
+
+// Ciphertexts and threads
+static void BM_SumMany(benchmark::State &state)
+{
+    serverInstance->SetQueryThreads(state.range(1));
+    vector<helib::Ctxt> values = vector<helib::Ctxt>(state.range(0), serverInstance->Encrypt(1));
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        vector<helib::Ctxt> operands = values;
+        state.ResumeTiming();
+
+        auto result = SumMany(operands, serverInstance->GetMeta().data->publicKey);
+        benchmark::DoNotOptimize(result);
+    }
+    state.counters["Ctxts/s"] = benchmark::Counter(state.range(0), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Largest radix of a hoisted step, 1 for doubling alone
+static void BM_SumSlots(benchmark::State &state)
+{
+    const helib::EncryptedArray &ea = serverInstance->GetMeta().data->context.getEA();
+    helib::Ctxt ctxt = serverInstance->Encrypt(1);
+
+    SlotSumStats stats;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        helib::Ctxt clone = ctxt;
+        state.ResumeTiming();
+
+        SumSlots(ea, clone, state.range(0), &stats);
+
+        state.PauseTiming();
+        if (!clone.isCorrect())
+        {
+            std::cout << "ERROR EXCEEDED" << std::endl;
+        }
+        state.ResumeTiming();
+
+        benchmark::DoNotOptimize(clone);
+    }
+    state.counters["Rotations"] = stats.rotations;
+    state.counters["HoistedSteps"] = stats.hoisted_steps;
+    state.counters["PlainRotations"] = stats.plain_rotations;
+    state.counters["KeySwitches"] = stats.key_switches;
+}
+
+// The slot sum SquashCtxtLogTime made before SumSlots, kept as the baseline for BM_SumSlots: the slots past the
+// largest power of two folded back onto the front, then log2 of that many rotations of the whole slot array
+static void BM_SumSlotsBaseline(benchmark::State &state)
+{
+    const helib::EncryptedArray &ea = serverInstance->GetMeta().data->context.getEA();
+    helib::Ctxt ctxt = serverInstance->Encrypt(1);
+
+    long num_slots = ea.size();
+    long depth = floor(log2(num_slots));
+    long power_of_two = 1L << depth;
+    helib::Ptxt<helib::BGV> mask(serverInstance->GetMeta().data->context);
+    helib::Ptxt<helib::BGV> inverse_mask(serverInstance->GetMeta().data->context);
+    for (long i = 0; i < num_slots; i++)
+    {
+        mask[i] = i < power_of_two ? 1 : 0;
+        inverse_mask[i] = i < power_of_two ? 0 : 1;
+    }
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        helib::Ctxt clone = ctxt;
+        state.ResumeTiming();
+
+        helib::Ctxt far_end = clone;
+        far_end.multByConstant(inverse_mask);
+        ea.rotate(far_end, -power_of_two);
+        clone.multByConstant(mask);
+        clone += far_end;
+        for (long d = depth - 1; d >= 0; d--)
+        {
+            helib::Ctxt shifted = clone;
+            ea.rotate(shifted, -(1L << d));
+            clone += shifted;
+        }
+
+        benchmark::DoNotOptimize(clone);
+    }
+    state.counters["Rotations"] = depth + 1;
 }
 
 static void BM_UpdateOneValue(benchmark::State &state)
@@ -256,6 +392,38 @@ static void BM_UpdateOneValue(benchmark::State &state)
         serverInstance->UpdateOneValue(0, 0, 0);
     }
 }
+// Bursts of burst updates against a zero pool of the given capacity, refilled between bursts
+static void BM_UpdateOneValuePooled(benchmark::State &state)
+{
+    uint32_t burst = state.range(0);
+    uint32_t capacity = state.range(1);
+    serverInstance->GenData(1, 1);
+    serverInstance->SetZeroPool(capacity, 1);
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        while (serverInstance->GetZeroPoolStats().depth < capacity)
+        {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        state.ResumeTiming();
+
+        for (uint32_t i = 0; i < burst; i++)
+        {
+            serverInstance->UpdateOneValue(0, 0, 0);
+        }
+    }
+
+    ZeroPoolStats stats = serverInstance->GetZeroPoolStats();
+    state.counters["HitRate"] = (double)stats.hits / max<uint64_t>(1, stats.hits + stats.misses);
+    state.counters["RefillPerSecond"] = stats.refill_per_second;
+    state.counters["p50"] = stats.latency_p50;
+    state.counters["p95"] = stats.latency_p95;
+    state.counters["p99"] = stats.latency_p99;
+
+    serverInstance->SetZeroPool(0);
+}
 static void BM_UpdateOneRow(benchmark::State &state)
 {
     int db_snps = state.range(0);
@@ -271,6 +439,70 @@ static void BM_UpdateOneRow(benchmark::State &state)
     {
         serverInstance->UpdateOneRow(0, vals);
     }
+
+    state.counters["Cells/s"] = benchmark::Counter((double)db_snps * state.iterations(), benchmark::Counter::kIsRate);
+}
+// Same as BM_UpdateOneRow, but rows updates of one compressed row go through the delta buffer and are merged at the end
+static void BM_UpdateOneRowBuffered(benchmark::State &state)
+{
+    int db_snps = state.range(0);
+    uint32_t rows = state.range(1);
+    serverInstance->GenData(rows, db_snps);
+    serverInstance->SetUpdateBuffering(60000);
+
+    vector<uint32_t> vals = vector<uint32_t>(db_snps);
+    for (int i = 0; i < db_snps; i++)
+    {
+        vals[i] = 0;
+    }
+
+    for (auto _ : state)
+    {
+        for (uint32_t row = 0; row < rows; row++)
+        {
+            serverInstance->UpdateOneRow(row, vals);
+        }
+        serverInstance->MergeDeltas();
+    }
+
+    state.counters["Cells/s"] = benchmark::Counter((double)db_snps * rows * state.iterations(), benchmark::Counter::kIsRate);
+    serverInstance->SetUpdateBuffering(0);
+}
+
+// Updates logged to a write-ahead log from several writers, each waiting until its update is synced. The updates
+// made at the same time share one sync, right away with a group commit interval of 0 and every interval otherwise.
+static void BM_UpdateOneValueWAL(benchmark::State &state)
+{
+    uint32_t group_commit_ms = state.range(0);
+    uint32_t updates = state.range(1);
+    uint32_t writers = state.range(2);
+    serverInstance->GenData(updates, 1);
+    serverInstance->EnableWAL("bench_wal.log", "bench_checkpoint.bin", group_commit_ms);
+
+    for (auto _ : state)
+    {
+        vector<thread> threads;
+        for (uint32_t w = 0; w < writers; w++)
+        {
+            threads.emplace_back([&, w]
+                                 {
+                for (uint32_t row = w; row < updates; row += writers)
+                {
+                    serverInstance->UpdateOneValue(row, 0, 0);
+                } });
+        }
+        for (thread &writer : threads)
+        {
+            writer.join();
+        }
+    }
+
+    WALStats stats = serverInstance->GetWALStats();
+    state.counters["Updates/s"] = benchmark::Counter((double)updates * state.iterations(), benchmark::Counter::kIsRate);
+    state.counters["RecordsPerSync"] = stats.records_per_sync;
+    serverInstance->DisableWAL();
+    std::remove("bench_wal.log");
+    std::remove("bench_checkpoint.bin");
 }
 
 static void BM_InsertRow(benchmark::State &state)
@@ -289,6 +521,28 @@ static void BM_InsertRow(benchmark::State &state)
         serverInstance->InsertOneRow(vals);
     }
 }
+// Compaction of a db_snps column DB of four compressed rows with every other row deleted
+static void BM_Compact(benchmark::State &state)
+{
+    int db_snps = state.range(0);
+    uint32_t num_rows = 4 * serverInstance->GetSlotSize();
+
+    CompactionStats stats;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        serverInstance->GenData(num_rows, db_snps);
+        for (uint32_t row = 0; row < num_rows; row += 2)
+        {
+            serverInstance->DeleteRow(row);
+        }
+        state.ResumeTiming();
+
+        stats = serverInstance->Compact();
+    }
+
+    state.counters["ReclaimedCiphertexts"] = stats.reclaimed_ciphertexts;
+}
 static void BM_DeleteRowAddition(benchmark::State &state)
 {
     int db_snps = state.range(0);
@@ -322,6 +576,196 @@ static void BM_DeleteRowMultiplication(benchmark::State &state)
     }
 }
 
+static void BM_ColumnPrefetch(benchmark::State &state)
+{
+    uint32_t num_columns = state.range(0);
+    uint32_t depth = state.range(1);
+
+    // Serve the columns from a mapped file so every query has to fault them in
+    serverInstance->GenData(1, num_columns);
+    serverInstance->SaveKeys("prefetch_keys.bin");
+    serverInstance->SaveDB("prefetch_db.bin");
+
+    Server mapped("prefetch_keys.bin", false);
+    mapped.MapDB("prefetch_db.bin");
+    mapped.SetPrefetchDepth(depth);
+
+    vector<pair<uint32_t, int32_t>> query = vector<pair<uint32_t, int32_t>>();
+    for (uint32_t i = 0; i < num_columns; i++)
+    {
+        query.push_back(pair(i, 1));
+    }
+
+    for (auto _ : state)
+    {
+        auto result = mapped.PRSQuery(query);
+        benchmark::DoNotOptimize(result);
+    }
+
+    ColumnCacheStats stats = mapped.GetCacheStats();
+    if (stats.prefetch_load_seconds > 0)
+    {
+        state.counters["Overlap efficiency"] = 1 - stats.prefetch_stall_seconds / stats.prefetch_load_seconds;
+    }
+    state.counters["Columns"] = num_columns;
+
+    std::remove("prefetch_keys.bin");
+    std::remove("prefetch_db.bin");
+}
+
+// PRS queries while a background thread keeps updating the columns they read, or with no updates for comparison
+static void BM_QueriesUnderUpdates(benchmark::State &state)
+{
+    uint32_t num_columns = state.range(0);
+    bool updating = state.range(1);
+    serverInstance->GenData(serverInstance->GetSlotSize(), num_columns);
+
+    vector<pair<uint32_t, int32_t>> query = vector<pair<uint32_t, int32_t>>();
+    for (uint32_t i = 0; i < num_columns; i++)
+    {
+        query.push_back(pair(i, 1));
+    }
+
+    std::atomic<bool> stop = false;
+    std::atomic<uint64_t> updates = 0;
+    thread updater;
+    if (updating)
+    {
+        updater = thread([&]
+                         {
+            for (uint32_t i = 0; !stop; i++)
+            {
+                serverInstance->UpdateOneValue(i % serverInstance->GetSlotSize(), i % num_columns, 0);
+                updates++;
+            } });
+    }
+
+    for (auto _ : state)
+    {
+        auto result = serverInstance->PRSQuery(query);
+        benchmark::DoNotOptimize(result);
+    }
+
+    stop = true;
+    if (updater.joinable())
+    {
+        updater.join();
+    }
+    state.counters["Queries/s"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.counters["Updates"] = updates.load();
+    state.counters["CopiedVersions"] = serverInstance->GetCacheStats().copied_versions;
+}
+
+static void BM_PackedPRS(benchmark::State &state)
+{
+    uint32_t num_columns = state.range(0);
+    uint32_t snps_per_slot = state.range(1);
+
+    serverInstance->SaveKeys("packed_keys.bin");
+    Server packed("packed_keys.bin", false);
+    packed.SetPacking(snps_per_slot);
+    packed.GenData(1, num_columns);
+
+    vector<pair<uint32_t, int32_t>> query = vector<pair<uint32_t, int32_t>>();
+    for (uint32_t i = 0; i < num_columns; i++)
+    {
+        query.push_back(pair(i, 1));
+    }
+
+    for (auto _ : state)
+    {
+        auto result = packed.PRSQuery(query);
+        benchmark::DoNotOptimize(result);
+    }
+
+    uint32_t stored_columns = (num_columns + snps_per_slot - 1) / snps_per_slot;
+    state.counters["Storage"] = (double)stored_columns * packed.GetCompressedRows() * packed.StorageOfOneElement();
+    state.counters["Columns"] = num_columns;
+
+    std::remove("packed_keys.bin");
+}
+
+static void BM_VCFIngest(benchmark::State &state)
+{
+    uint32_t num_variants = state.range(0);
+    uint32_t num_threads = state.range(1);
+    uint32_t num_samples = 2 * serverInstance->GetSlotSize();
+
+    const char *genotypes[] = {"0|0", "0|1", "1|0", "1|1"};
+    std::ofstream vcf("ingest.vcf");
+    vcf << "##fileformat=VCFv4.1" << std::endl;
+    for (uint32_t i = 0; i < num_variants; i++)
+    {
+        vcf << "22\t" << i << "\trs" << i << "\tG\tA\t100\tPASS\t.\tGT";
+        for (uint32_t j = 0; j < num_samples; j++)
+        {
+            vcf << "\t" << genotypes[rand() % 4];
+        }
+        vcf << std::endl;
+    }
+    vcf.close();
+
+    IngestStats stats;
+    for (auto _ : state)
+    {
+        stats = serverInstance->IngestVCF("ingest.vcf", "ingest_db.bin", num_threads);
+    }
+
+    state.counters["Variants/s"] = stats.variants_per_second;
+    state.counters["Peak RSS"] = stats.peak_rss_bytes;
+
+    std::remove("ingest.vcf");
+    std::remove("ingest_db.bin");
+}
+
+static void BM_BGZFIngest(benchmark::State &state)
+{
+    uint32_t scale = state.range(0);
+    bool compressed = state.range(1);
+
+    // Scale the sample VCF up by repeating its variant lines
+    std::ifstream sample("./data/chr22_100samples_10SNPs.vcf");
+    std::string line, header, variants;
+    while (std::getline(sample, line))
+    {
+        (line[0] == '#' ? header : variants) += line + "\n";
+    }
+
+    std::string vcf_file = compressed ? "ingest.vcf.gz" : "ingest.vcf";
+    if (compressed)
+    {
+        BGZFWriter writer(vcf_file);
+        writer.Write(header);
+        for (uint32_t i = 0; i < scale; i++)
+        {
+            writer.Write(variants);
+        }
+        writer.Close();
+    }
+    else
+    {
+        std::ofstream writer(vcf_file);
+        writer << header;
+        for (uint32_t i = 0; i < scale; i++)
+        {
+            writer << variants;
+        }
+    }
+
+    IngestStats stats;
+    for (auto _ : state)
+    {
+        stats = serverInstance->IngestVCF(vcf_file, "ingest_db.bin");
+    }
+
+    std::ifstream file(vcf_file, std::ios::binary | std::ios::ate);
+    state.counters["File size"] = (double)file.tellg();
+    state.counters["Variants/s"] = stats.variants_per_second;
+
+    std::remove(vcf_file.c_str());
+    std::remove("ingest_db.bin");
+}
+
 static void BM_SimilarityComputation(benchmark::State &state)
 {
     int snps = state.range(0);
@@ -361,16 +805,30 @@ BENCHMARK(BM_GeneratePublicKeySwitch)->ArgsProduct({{2, 3, 4, 5, 6, 7, 8, 9, 10,
 BENCHMARK(BM_SwithPublicKeySwitch)->ArgsProduct({{2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20}})->Unit(benchmark::kSecond);
 BENCHMARK(BM_ParallelPRSQuery)->ArgsProduct({{1024, 4096, 16384}, benchmark::CreateRange(1, 16, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
 
-BENCHMARK(BM_ParallelMAFQuery)->ArgsProduct({{2, 4, 8, 16}, benchmark::CreateRange(1, 16, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
-BENCHMARK(BM_ParallelCountQuery)->ArgsProduct({{2, 4, 8, 16}, benchmark::CreateRange(1, 16, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_ParallelMAFQuery)->ArgsProduct({{2, 4, 8, 16}, benchmark::CreateRange(1, 16, /*step=*/2), {1, 4, 16}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_ParallelCountQuery)->ArgsProduct({{2, 4, 8, 16}, benchmark::CreateRange(1, 16, /*step=*/2), {1, 4, 16}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_ProductTree)->ArgsProduct({{2, 3, 5, 8, 13, 16}, {0, 1}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_SumMany)->ArgsProduct({{16, 64, 256}, {1, 8}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_SumSlots)->ArgsProduct({{1, 2, 4, 8}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_SumSlotsBaseline)->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK(BM_ParallelSimilarityQuery)->ArgsProduct({{1024, 4096, 16384}, {8}})->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK(BM_EncrpytCiphertext)->Unit(benchmark::kSecond)->Setup(DoSetup);
 
 BENCHMARK(BM_UpdateOneValue)->ArgsProduct({benchmark::CreateRange(1, 1024, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_UpdateOneValuePooled)->ArgsProduct({{1, 8, 64}, {8, 64}})->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK(BM_UpdateOneRow)->ArgsProduct({benchmark::CreateRange(1, 1024, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_UpdateOneRowBuffered)->ArgsProduct({benchmark::CreateRange(1, 1024, /*step=*/2), {1, 16, 256}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_UpdateOneValueWAL)->ArgsProduct({{0, 1, 10}, {16, 256}, {1, 8}})->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK(BM_InsertRow)->ArgsProduct({benchmark::CreateRange(1, 1024, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_Compact)->ArgsProduct({{1, 16, 64}})->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK(BM_DeleteRowAddition)->ArgsProduct({benchmark::CreateRange(1, 1024, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK(BM_DeleteRowMultiplication)->ArgsProduct({benchmark::CreateRange(1, 1024, /*step=*/2)})->Unit(benchmark::kSecond)->Setup(DoSetup);
 
+BENCHMARK(BM_ColumnPrefetch)->ArgsProduct({{64, 256, 1024}, {0, 1, 2, 4}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_QueriesUnderUpdates)->ArgsProduct({{16, 256}, {0, 1}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_PackedPRS)->ArgsProduct({{64, 256}, {1, 2, 3, 4}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_VCFIngest)->ArgsProduct({{256, 1024}, {1, 2, 4, 8}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+BENCHMARK(BM_BGZFIngest)->ArgsProduct({{10, 100}, {0, 1}})->Unit(benchmark::kSecond)->Setup(DoSetup);
+
 BENCHMARK(BM_StorageCiphertext)->Unit(benchmark::kSecond)->Setup(DoSetup);
 BENCHMARK_MAIN();
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include "bgzf.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <zlib.h>
+
+using namespace std;
+
+// gzip magic, deflate, FEXTRA set
+const unsigned char BGZF_MAGIC[4] = {0x1f, 0x8b, 8, 4};
+
+// Fixed part of the gzip header up to and including XLEN, and the CRC32 and ISIZE footer
+const size_t BGZF_HEADER = 12;
+const size_t BGZF_FOOTER = 8;
+
+// A block may not exceed 64 KiB including its header and footer
+const size_t BGZF_MAX_BLOCK = 1 << 16;
+
+// Blocks in flight per inflating thread
+const size_t BGZF_QUEUE_DEPTH = 4;
+
+static uint32_t read_le(const char *bytes, size_t length)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        value |= (uint32_t)(unsigned char)bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+static void write_le(string &bytes, uint32_t value, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        bytes.push_back((char)((value >> (8 * i)) & 0xff));
+    }
+}
+
+// Size of the block from its "BC" extra subfield, 0 when there is none
+static size_t bgzf_block_size(const char *extra, size_t xlen)
+{
+    for (size_t i = 0; i + 4 <= xlen;)
+    {
+        size_t slen = read_le(extra + i + 2, 2);
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+        {
+            return read_le(extra + i + 4, 2) + 1;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+// Reads the next compressed block, false at the end of the file
+static bool read_block(istream &file, string &block)
+{
+    block.assign(BGZF_HEADER, '\0');
+    file.read(&block[0], BGZF_HEADER);
+    if (file.gcount() == 0)
+    {
+        return false;
+    }
+    if ((size_t)file.gcount() != BGZF_HEADER || memcmp(block.data(), BGZF_MAGIC, sizeof(BGZF_MAGIC)) != 0)
+    {
+        throw invalid_argument("ERROR: not a BGZF block");
+    }
+
+    size_t xlen = read_le(block.data() + 10, 2);
+    block.resize(BGZF_HEADER + xlen);
+    file.read(&block[BGZF_HEADER], xlen);
+
+    size_t size = bgzf_block_size(block.data() + BGZF_HEADER, xlen);
+    if (!file || size < BGZF_HEADER + xlen + BGZF_FOOTER)
+    {
+        throw invalid_argument("ERROR: BGZF block has no valid size field");
+    }
+
+    block.resize(size);
+    file.read(&block[BGZF_HEADER + xlen], size - BGZF_HEADER - xlen);
+    if (!file)
+    {
+        throw invalid_argument("ERROR: BGZF block is truncated");
+    }
+    return true;
+}
+
+static string inflate_block(const string &block)
+{
+    size_t xlen = read_le(block.data() + 10, 2);
+    const char *compressed = block.data() + BGZF_HEADER + xlen;
+    size_t compressed_length = block.size() - BGZF_HEADER - xlen - BGZF_FOOTER;
+    uint32_t crc = read_le(block.data() + block.size() - 8, 4);
+    uint32_t length = read_le(block.data() + block.size() - 4, 4);
+
+    string data(length, '\0');
+
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+        throw runtime_error("ERROR: failed initializing zlib");
+    }
+    stream.next_in = (Bytef *)compressed;
+    stream.avail_in = compressed_length;
+    stream.next_out = (Bytef *)&data[0];
+    stream.avail_out = length;
+    int status = inflate(&stream, Z_FINISH);
+    uLong inflated = stream.total_out;
+    inflateEnd(&stream);
+
+    if (status != Z_STREAM_END || inflated != length || crc32(0, (const Bytef *)data.data(), length) != crc)
+    {
+        throw runtime_error("ERROR: corrupt BGZF block");
+    }
+    return data;
+}
+
+bool IsBGZF(const string &path)
+{
+    ifstream file(path, ios::binary);
+    char header[BGZF_HEADER + 4];
+    file.read(header, sizeof(header));
+    return file && memcmp(header, BGZF_MAGIC, sizeof(BGZF_MAGIC)) == 0 && header[12] == 'B' && header[13] == 'C';
+}
+
+BGZFReader::BGZFReader(const string &path, uint32_t num_threads)
+    : file(path, ios::binary),
+      tasks(BGZF_QUEUE_DEPTH * max<uint32_t>(num_threads, 1)),
+      blocks(BGZF_QUEUE_DEPTH * max<uint32_t>(num_threads, 1))
+{
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open BGZF file: " + path);
+    }
+
+    reader = thread(&BGZFReader::ReadBlocks, this);
+    for (uint32_t t = 0; t < max<uint32_t>(num_threads, 1); t++)
+    {
+        workers.emplace_back(&BGZFReader::InflateBlocks, this);
+    }
+}
+
+BGZFReader::~BGZFReader()
+{
+    blocks.Close();
+    tasks.Close();
+    reader.join();
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void BGZFReader::ReadBlocks()
+{
+    try
+    {
+        string block;
+        while (read_block(file, block))
+        {
+            packaged_task<string()> task([block = move(block)]
+                                         { return inflate_block(block); });
+            if (!blocks.Push(task.get_future()) || !tasks.Push(move(task)))
+            {
+                return;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Surfaces in GetLine once the blocks before it are consumed
+        promise<string> failed;
+        failed.set_exception(current_exception());
+        blocks.Push(failed.get_future());
+    }
+    blocks.Close();
+    tasks.Close();
+}
+
+void BGZFReader::InflateBlocks()
+{
+    while (optional<packaged_task<string()>> task = tasks.Pop())
+    {
+        (*task)();
+    }
+}
+
+bool BGZFReader::NextBlock()
+{
+    optional<future<string>> block = blocks.Pop();
+    if (!block)
+    {
+        return false;
+    }
+    string inflated = block->get();
+
+    data.erase(0, position);
+    position = 0;
+    data += inflated;
+    return true;
+}
+
+bool BGZFReader::GetLine(string &line)
+{
+    while (true)
+    {
+        const char *start = data.data() + position;
+        const char *newline = static_cast<const char *>(memchr(start, '\n', data.size() - position));
+        if (newline != nullptr)
+        {
+            line.assign(start, newline - start);
+            position += newline - start + 1;
+            return true;
+        }
+
+        if (!NextBlock())
+        {
+            // The last line may have no newline
+            if (position == data.size())
+            {
+                return false;
+            }
+            line.assign(data, position, string::npos);
+            position = data.size();
+            return true;
+        }
+    }
+}
+
+BGZFWriter::BGZFWriter(const string &path, size_t _block_size)
+    : file(path, ios::binary | ios::trunc), block_size(min(max<size_t>(_block_size, 1), BGZF_MAX_BLOCK_DATA))
+{
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open BGZF file for writing: " + path);
+    }
+}
+
+BGZFWriter::~BGZFWriter()
+{
+    if (!closed)
+    {
+        try
+        {
+            Close();
+        }
+        catch (...)
+        {
+        }
+    }
+}
+
+void BGZFWriter::Write(string_view text)
+{
+    pending.append(text);
+
+    size_t offset = 0;
+    while (pending.size() - offset >= block_size)
+    {
+        WriteBlock(string_view(pending).substr(offset, block_size));
+        offset += block_size;
+    }
+    pending.erase(0, offset);
+}
+
+void BGZFWriter::Close()
+{
+    if (!pending.empty())
+    {
+        WriteBlock(pending);
+        pending.clear();
+    }
+    WriteBlock(string_view());
+    closed = true;
+
+    file.flush();
+    if (!file)
+    {
+        throw runtime_error("ERROR: failed writing BGZF file");
+    }
+}
+
+void BGZFWriter::WriteBlock(string_view block)
+{
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw runtime_error("ERROR: failed initializing zlib");
+    }
+    string compressed(deflateBound(&stream, block.size()), '\0');
+    stream.next_in = (Bytef *)block.data();
+    stream.avail_in = block.size();
+    stream.next_out = (Bytef *)&compressed[0];
+    stream.avail_out = compressed.size();
+    int status = deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    size_t size = BGZF_HEADER + 6 + compressed.size() + BGZF_FOOTER;
+    if (status != Z_STREAM_END || size > BGZF_MAX_BLOCK)
+    {
+        throw runtime_error("ERROR: failed compressing BGZF block");
+    }
+
+    string header(reinterpret_cast<const char *>(BGZF_MAGIC), sizeof(BGZF_MAGIC));
+    write_le(header, 0, 4);        // MTIME
+    header.push_back(0);           // XFL
+    header.push_back((char)0xff);  // OS unknown
+    write_le(header, 6, 2);        // XLEN
+    header += "BC";                // BGZF subfield
+    write_le(header, 2, 2);        // SLEN
+    write_le(header, size - 1, 2); // BSIZE
+
+    string footer;
+    write_le(footer, crc32(0, (const Bytef *)block.data(), block.size()), 4);
+    write_le(footer, block.size(), 4);
+
+    file.write(header.data(), header.size());
+    file.write(compressed.data(), compressed.size());
+    file.write(footer.data(), footer.size());
+}
@@ -0,0 +1,81 @@
+/*
+BGZF (bgzip) files
+
+A BGZF file is a series of independent gzip members of at most 64 KiB each, with the size of every member
+stored in a "BC" extra field of its header. BGZFReader therefore only has to parse the headers to split
+the file into blocks; the blocks themselves are inflated in parallel by a pool of worker threads and
+handed back in file order.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+
+using namespace std;
+
+// Largest amount of data bgzip puts in one block
+const size_t BGZF_MAX_BLOCK_DATA = 0xff00;
+
+// True when path starts with a BGZF block
+bool IsBGZF(const string &path);
+
+class BGZFReader
+{
+public:
+    BGZFReader(const string &path, uint32_t num_threads);
+    ~BGZFReader();
+
+    BGZFReader(const BGZFReader &) = delete;
+    BGZFReader &operator=(const BGZFReader &) = delete;
+
+    // Next line without its newline, false at the end of the file
+    bool GetLine(string &line);
+
+private:
+    void ReadBlocks();
+    void InflateBlocks();
+    bool NextBlock();
+
+    ifstream file;
+
+    // Blocks waiting for a worker, and their results in file order; the second queue bounds the blocks in flight
+    BoundedQueue<packaged_task<string()>> tasks;
+    BoundedQueue<future<string>> blocks;
+
+    string data;
+    size_t position = 0;
+
+    thread reader;
+    vector<thread> workers;
+};
+
+class BGZFWriter
+{
+public:
+    explicit BGZFWriter(const string &path, size_t _block_size = BGZF_MAX_BLOCK_DATA);
+    ~BGZFWriter();
+
+    BGZFWriter(const BGZFWriter &) = delete;
+    BGZFWriter &operator=(const BGZFWriter &) = delete;
+
+    void Write(string_view text);
+
+    // Writes the last block and the empty end-of-file block
+    void Close();
+
+private:
+    void WriteBlock(string_view block);
+
+    ofstream file;
+    size_t block_size;
+    string pending;
+    bool closed = false;
+};
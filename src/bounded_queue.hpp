@@ -0,0 +1,73 @@
+/*
+Bounded blocking queue linking the stages of a pipeline
+
+Push blocks while the queue is full, so a fast stage cannot run ahead of a slow one and the items in flight
+stay bounded. Close marks the end of the input: Pop drains the remaining items and then returns nullopt.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+using namespace std;
+
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t _capacity) : capacity(_capacity == 0 ? 1 : _capacity) {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    // Returns false when the queue was closed before the item could be added
+    bool Push(T item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        not_full.wait(lock, [&]
+                      { return closed || items.size() < capacity; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Waits for the next item, or returns nullopt once the queue is closed and empty
+    optional<T> Pop()
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        not_empty.wait(lock, [&]
+                       { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return nullopt;
+        }
+        T item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return item;
+    }
+
+    void Close()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    bool closed = false;
+
+    mutex queue_mutex;
+    condition_variable not_empty;
+    condition_variable not_full;
+};
@@ -0,0 +1,834 @@
+#include "column_store.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+const uint32_t NO_COLUMN = numeric_limits<uint32_t>::max();
+
+ColumnStore::~ColumnStore()
+{
+    if (spill_fd >= 0)
+    {
+        close(spill_fd);
+        unlink(spill_path.c_str());
+    }
+}
+
+void ColumnStore::Assign(vector<Column> &&columns)
+{
+    Clear();
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    num_cols = columns.size();
+    slots = vector<Slot>(num_cols);
+    for (uint32_t col = 0; col < num_cols; col++)
+    {
+        Slot &slot = slots[col];
+        slot.column = make_shared<Column>(move(columns[col]));
+        slot.pinned = slot.column;
+        slot.dirty = true;
+        slot.since = epoch;
+        lru.push_front(col);
+        slot.lru = lru.begin();
+        stats.cached_bytes += ColumnBytes(*slot.column);
+    }
+    Evict(NO_COLUMN);
+}
+
+const DBFileMapping &ColumnStore::Map(const string &db_file, const helib::PubKey &pk, uint32_t num_slots)
+{
+    unique_ptr<DBFileMapping> new_mapping = make_unique<DBFileMapping>(db_file, num_slots);
+
+    Clear();
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    mapping = move(new_mapping);
+    public_key = &pk;
+    num_cols = mapping->Header().num_cols;
+    slots = vector<Slot>(num_cols);
+    for (Slot &slot : slots)
+    {
+        slot.since = epoch;
+    }
+
+    return *mapping;
+}
+
+void ColumnStore::SetMemoryBudget(uint64_t _memory_budget, uint64_t _ctxt_bytes, const string &spill_file, const helib::PubKey &pk)
+{
+    lock_guard<mutex> lock(cache_mutex);
+
+    // Columns spilled to the current spill file would be lost when it is replaced
+    for (const Slot &slot : slots)
+    {
+        if (!slot.spilled.empty())
+        {
+            throw invalid_argument("ERROR: the memory budget must be set before columns are spilled");
+        }
+    }
+
+    if (spill_fd >= 0)
+    {
+        close(spill_fd);
+        unlink(spill_path.c_str());
+        spill_fd = -1;
+    }
+
+    memory_budget = _memory_budget;
+    ctxt_bytes = _ctxt_bytes;
+    public_key = &pk;
+    spill_path = spill_file;
+    spill_end = 0;
+
+    if (memory_budget > 0)
+    {
+        spill_fd = open(spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (spill_fd < 0)
+        {
+            throw invalid_argument("ERROR: cannot open spill file: " + spill_path);
+        }
+    }
+
+    stats.cached_bytes = 0;
+    for (uint32_t col : lru)
+    {
+        stats.cached_bytes += ColumnBytes(*slots[col].column);
+    }
+    Evict(NO_COLUMN);
+}
+
+void ColumnStore::SetCompression(uint32_t _hot_columns, uint64_t _ctxt_bytes, const helib::PubKey &pk)
+{
+    lock_guard<mutex> lock(cache_mutex);
+
+    hot_columns = _hot_columns;
+    ctxt_bytes = _ctxt_bytes;
+    public_key = &pk;
+
+    // With neither a budget nor a hot set columns are no longer cached, so one held only deflated would be
+    // dropped by its next update. Every compressed column is inflated and kept resident instead.
+    if (!Caching())
+    {
+        for (uint32_t col = 0; col < num_cols; col++)
+        {
+            Slot &slot = slots[col];
+            if (!slot.compressed)
+            {
+                continue;
+            }
+            if (!slot.column)
+            {
+                shared_ptr<Column> column = slot.pinned.lock();
+                slot.column = column ? column : Load(col, slot.compressed, {});
+                slot.pinned = slot.column;
+                lru.push_front(col);
+                slot.lru = lru.begin();
+            }
+            slot.dirty = true;
+            slot.generation++;
+            DropCompressed(slot);
+        }
+    }
+
+    stats.cached_bytes = 0;
+    for (uint32_t col : lru)
+    {
+        stats.cached_bytes += ColumnBytes(*slots[col].column);
+    }
+    Evict(NO_COLUMN);
+}
+
+void ColumnStore::Clear()
+{
+    lock_guard<mutex> lock(cache_mutex);
+
+    num_cols = 0;
+    slots.clear();
+    lru.clear();
+    versioned.clear();
+    mapping.reset();
+    stats = ColumnCacheStats();
+    // Snapshots of the old columns, had any outlived them, find nothing to read rather than the new ones
+    epoch++;
+
+    if (spill_fd >= 0 && ftruncate(spill_fd, 0) != 0)
+    {
+        throw runtime_error("ERROR: cannot truncate spill file: " + spill_path);
+    }
+    spill_end = 0;
+}
+
+ColumnStore::ColumnRef ColumnStore::operator[](uint32_t col) const
+{
+    if (col >= num_cols)
+    {
+        throw out_of_range("ERROR: column " + to_string(col) + " is out of range");
+    }
+    return ColumnRef(Fault(col));
+}
+
+shared_ptr<const ColumnStore::Snapshot> ColumnStore::TakeSnapshot() const
+{
+    lock_guard<mutex> lock(cache_mutex);
+    readers.insert(epoch);
+    return shared_ptr<const Snapshot>(new Snapshot(*this, epoch));
+}
+
+ColumnStore::Snapshot::~Snapshot()
+{
+    lock_guard<mutex> lock(store.cache_mutex);
+    store.readers.erase(store.readers.find(epoch));
+    store.Reclaim();
+}
+
+ColumnStore::ColumnRef ColumnStore::Snapshot::operator[](uint32_t col) const
+{
+    if (col >= store.num_cols)
+    {
+        throw out_of_range("ERROR: column " + to_string(col) + " is out of range");
+    }
+
+    while (true)
+    {
+        {
+            lock_guard<mutex> lock(store.cache_mutex);
+            const Slot &slot = store.slots[col];
+            if (slot.since > epoch)
+            {
+                for (const Version &version : slot.history)
+                {
+                    if (version.since <= epoch && epoch < version.until)
+                    {
+                        return ColumnRef(version.column);
+                    }
+                }
+                throw runtime_error("ERROR: column " + to_string(col) + " changed under a snapshot without keeping its version");
+            }
+        }
+
+        shared_ptr<Column> column = store.Fault(col);
+
+        // A change published while the column was faulted in moved the version this snapshot reads to the history
+        lock_guard<mutex> lock(store.cache_mutex);
+        if (store.slots[col].since <= epoch)
+        {
+            return ColumnRef(column);
+        }
+    }
+}
+
+shared_ptr<ColumnStore::Column> ColumnStore::Fault(uint32_t col) const
+{
+    while (true)
+    {
+        shared_ptr<const CompressedColumn> compressed;
+        vector<DBFileRecord> spilled;
+        uint64_t generation;
+        {
+            lock_guard<mutex> lock(cache_mutex);
+            Slot &slot = slots[col];
+            if (slot.column)
+            {
+                stats.hits++;
+                Touch(col);
+                return slot.column;
+            }
+            shared_ptr<Column> column = slot.pinned.lock();
+            if (column)
+            {
+                stats.hits++;
+                Install(col, column);
+                return column;
+            }
+            stats.misses++;
+            compressed = slot.compressed;
+            spilled = slot.spilled;
+            generation = slot.generation;
+        }
+
+        // Deserialize outside the lock so other columns can be faulted in concurrently
+        shared_ptr<Column> column = Load(col, compressed, spilled);
+
+        lock_guard<mutex> lock(cache_mutex);
+        Slot &slot = slots[col];
+        if (slot.column)
+        {
+            Touch(col);
+            return slot.column;
+        }
+        shared_ptr<Column> raced = slot.pinned.lock();
+        if (raced)
+        {
+            Install(col, raced);
+            return raced;
+        }
+        if (slot.generation != generation)
+        {
+            // Another thread faulted, modified and evicted the column while this copy was being read
+            continue;
+        }
+        Install(col, column);
+        return column;
+    }
+}
+
+shared_ptr<ColumnStore::Column> ColumnStore::Load(uint32_t col, const shared_ptr<const CompressedColumn> &compressed,
+                                                  const vector<DBFileRecord> &spilled) const
+{
+    shared_ptr<Column> column = make_shared<Column>();
+
+    if (compressed)
+    {
+        vector<char> buffer(compressed->raw_length);
+        uLongf length = buffer.size();
+        if (uncompress(reinterpret_cast<Bytef *>(buffer.data()), &length,
+                       reinterpret_cast<const Bytef *>(compressed->data.data()), compressed->data.size()) != Z_OK ||
+            length != buffer.size())
+        {
+            throw runtime_error("ERROR: failed inflating column " + to_string(col));
+        }
+
+        column->reserve(compressed->records.size());
+        for (const DBFileRecord &record : compressed->records)
+        {
+            MemoryStreamBuffer record_buffer(buffer.data() + record.offset, record.length);
+            istream str(&record_buffer);
+            column->push_back(helib::Ctxt::readFrom(str, *public_key));
+        }
+        return column;
+    }
+
+    if (spilled.empty())
+    {
+        if (!mapping)
+        {
+            throw runtime_error("ERROR: column " + to_string(col) + " has no backing copy");
+        }
+        uint32_t num_compressed_rows = mapping->Header().num_compressed_rows;
+        column->reserve(num_compressed_rows);
+        for (uint32_t row = 0; row < num_compressed_rows; row++)
+        {
+            column->push_back(mapping->ReadRecord(mapping->RecordIndex(col, row), *public_key));
+        }
+        return column;
+    }
+
+    // A spilled column is contiguous in the spill file, so it is read back with a single pread
+    uint64_t start = spilled.front().offset;
+    uint64_t length = spilled.back().offset + spilled.back().length - start;
+    vector<char> buffer(length);
+    for (uint64_t done = 0; done < length;)
+    {
+        ssize_t count = pread(spill_fd, buffer.data() + done, length - done, start + done);
+        if (count <= 0)
+        {
+            throw runtime_error("ERROR: failed reading spill file: " + spill_path);
+        }
+        done += count;
+    }
+
+    column->reserve(spilled.size());
+    for (const DBFileRecord &record : spilled)
+    {
+        MemoryStreamBuffer record_buffer(buffer.data() + (record.offset - start), record.length);
+        istream str(&record_buffer);
+        column->push_back(helib::Ctxt::readFrom(str, *public_key));
+    }
+    return column;
+}
+
+void ColumnStore::Install(uint32_t col, const shared_ptr<Column> &column) const
+{
+    Slot &slot = slots[col];
+    slot.pinned = column;
+
+    // Without a budget or hot set a mapped column is only kept alive by the queries using it
+    if (!Caching())
+    {
+        return;
+    }
+
+    slot.column = column;
+    lru.push_front(col);
+    slot.lru = lru.begin();
+    stats.cached_bytes += ColumnBytes(*column);
+    Evict(col);
+}
+
+void ColumnStore::Touch(uint32_t col) const
+{
+    if (Caching())
+    {
+        lru.splice(lru.begin(), lru, slots[col].lru);
+    }
+}
+
+void ColumnStore::Evict(uint32_t keep) const
+{
+    if (!Caching())
+    {
+        return;
+    }
+
+    while (!lru.empty() && ((memory_budget > 0 && stats.cached_bytes > memory_budget) ||
+                            (hot_columns > 0 && lru.size() > hot_columns)))
+    {
+        uint32_t victim = lru.back();
+        if (victim == keep)
+        {
+            // The column being handed out is the most recently used, so it is the last one left
+            break;
+        }
+
+        Slot &slot = slots[victim];
+        if (slot.dirty && hot_columns > 0)
+        {
+            Compress(slot);
+        }
+        else if (slot.dirty)
+        {
+            Spill(slot);
+        }
+        stats.cached_bytes -= ColumnBytes(*slot.column);
+        slot.column.reset();
+        lru.pop_back();
+        stats.evictions++;
+    }
+}
+
+void ColumnStore::Spill(Slot &slot) const
+{
+    ostringstream str;
+    vector<DBFileRecord> records;
+    records.reserve(slot.column->size());
+    for (const helib::Ctxt &ctxt : *slot.column)
+    {
+        uint64_t start = str.tellp();
+        ctxt.writeTo(str);
+        uint64_t end = str.tellp();
+        records.push_back(DBFileRecord{spill_end + start, end - start});
+    }
+
+    // The spill file is append-only; space held by older copies of a column is reclaimed by Clear
+    string data = str.str();
+    for (uint64_t done = 0; done < data.size();)
+    {
+        ssize_t count = pwrite(spill_fd, data.data() + done, data.size() - done, spill_end + done);
+        if (count <= 0)
+        {
+            throw runtime_error("ERROR: failed writing spill file: " + spill_path);
+        }
+        done += count;
+    }
+    spill_end += data.size();
+
+    slot.spilled = move(records);
+    slot.generation++;
+    slot.dirty = false;
+    stats.spilled_bytes += data.size();
+}
+
+void ColumnStore::Compress(Slot &slot) const
+{
+    ostringstream str;
+    shared_ptr<CompressedColumn> compressed = make_shared<CompressedColumn>();
+    compressed->records.reserve(slot.column->size());
+    for (const helib::Ctxt &ctxt : *slot.column)
+    {
+        uint64_t start = str.tellp();
+        ctxt.writeTo(str);
+        uint64_t end = str.tellp();
+        compressed->records.push_back(DBFileRecord{start, end - start});
+    }
+
+    // Columns are recompressed on every eviction after an update, so favour speed over ratio
+    string raw = str.str();
+    uLongf length = compressBound(raw.size());
+    compressed->data.resize(length);
+    if (compress2(reinterpret_cast<Bytef *>(&compressed->data[0]), &length,
+                  reinterpret_cast<const Bytef *>(raw.data()), raw.size(), Z_BEST_SPEED) != Z_OK)
+    {
+        throw runtime_error("ERROR: failed deflating column");
+    }
+    compressed->data.resize(length);
+    compressed->data.shrink_to_fit();
+    compressed->raw_length = raw.size();
+
+    DropCompressed(slot);
+    slot.compressed = compressed;
+    slot.generation++;
+    slot.dirty = false;
+    stats.compressed_columns++;
+    stats.compressed_raw_bytes += compressed->raw_length;
+    stats.compressed_bytes += compressed->data.size();
+}
+
+void ColumnStore::DropCompressed(Slot &slot) const
+{
+    if (!slot.compressed)
+    {
+        return;
+    }
+    stats.compressed_columns--;
+    stats.compressed_raw_bytes -= slot.compressed->raw_length;
+    stats.compressed_bytes -= slot.compressed->data.size();
+    slot.compressed.reset();
+}
+
+void ColumnStore::Update(uint32_t col, uint32_t row, const function<void(helib::Ctxt &)> &fn)
+{
+    if (col >= num_cols)
+    {
+        throw out_of_range("ERROR: column " + to_string(col) + " is out of range");
+    }
+    if (mapping && !Caching())
+    {
+        throw invalid_argument("ERROR: a mapped database is read-only");
+    }
+
+    shared_ptr<Column> column = Fault(col);
+
+    // Updates run under the cache lock so the column cannot be spilled halfway through one
+    lock_guard<mutex> lock(cache_mutex);
+    Slot &slot = slots[col];
+    column = Writable(col, column);
+    fn(column->at(row));
+    slot.dirty = true;
+
+    // The compressed copy no longer matches, and the column is recompressed once it turns cold again
+    DropCompressed(slot);
+}
+
+void ColumnStore::Append(uint32_t col, vector<helib::Ctxt> &&rows)
+{
+    if (col >= num_cols)
+    {
+        throw out_of_range("ERROR: column " + to_string(col) + " is out of range");
+    }
+    if (mapping && !Caching())
+    {
+        throw invalid_argument("ERROR: a mapped database is read-only");
+    }
+
+    shared_ptr<Column> column = Fault(col);
+
+    lock_guard<mutex> lock(cache_mutex);
+    Slot &slot = slots[col];
+    column = Writable(col, column);
+    for (helib::Ctxt &ctxt : rows)
+    {
+        column->push_back(move(ctxt));
+    }
+    if (Caching())
+    {
+        stats.cached_bytes += rows.size() * ctxt_bytes;
+    }
+    slot.dirty = true;
+    DropCompressed(slot);
+}
+
+shared_ptr<ColumnStore::Column> ColumnStore::Writable(uint32_t col, const shared_ptr<Column> &column)
+{
+    Slot &slot = slots[col];
+    if (!slot.column)
+    {
+        Install(col, column);
+    }
+
+    // Only snapshots taken at or after the epoch the current version was published at can read it
+    if (readers.lower_bound(slot.since) == readers.end())
+    {
+        return column;
+    }
+
+    shared_ptr<Column> copy = make_shared<Column>(*column);
+    uint64_t published = ++epoch;
+    slot.history.push_back(Version{slot.since, published, column});
+    versioned.insert(col);
+    slot.since = published;
+    slot.pinned = copy;
+    if (slot.column)
+    {
+        slot.column = copy;
+    }
+    stats.copied_versions++;
+    return copy;
+}
+
+void ColumnStore::Reclaim() const
+{
+    for (auto col = versioned.begin(); col != versioned.end();)
+    {
+        vector<Version> &history = slots[*col].history;
+        history.erase(remove_if(history.begin(), history.end(), [&](const Version &version)
+                                {
+            auto reader = readers.lower_bound(version.since);
+            return reader == readers.end() || *reader >= version.until; }),
+                      history.end());
+        col = history.empty() ? versioned.erase(col) : next(col);
+    }
+}
+
+void ColumnStore::WriteTo(DBFileWriter &writer) const
+{
+    for (uint32_t col = 0; col < num_cols; col++)
+    {
+        ColumnRef column = (*this)[col];
+        for (const helib::Ctxt &ctxt : column)
+        {
+            writer.Write(ctxt);
+        }
+    }
+}
+
+uint64_t ColumnStore::ResidentCiphertexts() const
+{
+    lock_guard<mutex> lock(cache_mutex);
+
+    uint64_t count = 0;
+    for (const Slot &slot : slots)
+    {
+        shared_ptr<Column> column = slot.column ? slot.column : slot.pinned.lock();
+        if (column)
+        {
+            count += column->size();
+        }
+    }
+    return count;
+}
+
+ColumnCacheStats ColumnStore::CacheStats() const
+{
+    lock_guard<mutex> lock(cache_mutex);
+
+    ColumnCacheStats current = stats;
+    current.memory_budget = memory_budget;
+    for (uint32_t col : versioned)
+    {
+        current.retained_versions += slots[col].history.size();
+    }
+    return current;
+}
+
+ColumnMemory ColumnStore::Memory(uint32_t col) const
+{
+    if (col >= num_cols)
+    {
+        throw out_of_range("ERROR: column " + to_string(col) + " is out of range");
+    }
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    const Slot &slot = slots[col];
+    shared_ptr<Column> column = slot.column ? slot.column : slot.pinned.lock();
+
+    uint64_t rows = 0;
+    if (column)
+    {
+        rows = column->size();
+    }
+    else if (slot.compressed)
+    {
+        rows = slot.compressed->records.size();
+    }
+    else if (!slot.spilled.empty())
+    {
+        rows = slot.spilled.size();
+    }
+    else if (mapping)
+    {
+        rows = mapping->Header().num_compressed_rows;
+    }
+
+    ColumnMemory memory;
+    memory.full_bytes = rows * ctxt_bytes;
+    memory.hot = column != nullptr;
+    memory.compressed_bytes = slot.compressed ? slot.compressed->data.size() : 0;
+    memory.resident_bytes = (memory.hot ? memory.full_bytes : 0) + memory.compressed_bytes;
+    return memory;
+}
+
+void ColumnStore::Advise(const vector<uint32_t> &cols) const
+{
+    lock_guard<mutex> lock(cache_mutex);
+
+    for (uint32_t col : cols)
+    {
+        if (col >= num_cols)
+        {
+            continue;
+        }
+        const Slot &slot = slots[col];
+        if (slot.column || !slot.pinned.expired())
+        {
+            continue;
+        }
+        if (slot.compressed)
+        {
+            continue;
+        }
+        if (!slot.spilled.empty())
+        {
+            uint64_t start = slot.spilled.front().offset;
+            uint64_t length = slot.spilled.back().offset + slot.spilled.back().length - start;
+            posix_fadvise(spill_fd, start, length, POSIX_FADV_WILLNEED);
+        }
+        else if (mapping)
+        {
+            mapping->WillNeed(mapping->RecordIndex(col, 0), mapping->Header().num_compressed_rows);
+        }
+    }
+}
+
+ColumnPrefetcher::ColumnPrefetcher(const ColumnStore::Snapshot &_snapshot, vector<uint32_t> _plan, size_t _depth)
+    : snapshot(_snapshot), store(_snapshot.Store()), plan(move(_plan)), depth(_depth), loaded(plan.size())
+{
+    // Fully resident columns cost nothing to fault, so there is nothing to overlap
+    if (!store.IsMapped() && !store.Caching())
+    {
+        depth = 0;
+    }
+    if (depth == 0)
+    {
+        return;
+    }
+
+    // The whole plan is known up front, so the kernel can start on all of it before the first column is needed
+    store.Advise(plan);
+    worker = thread(&ColumnPrefetcher::Run, this);
+}
+
+ColumnPrefetcher::~ColumnPrefetcher()
+{
+    {
+        lock_guard<mutex> lock(prefetch_mutex);
+        stop = true;
+    }
+    loaded_cv.notify_all();
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+
+    if (depth > 0)
+    {
+        lock_guard<mutex> lock(store.cache_mutex);
+        store.stats.prefetched += next_load;
+        store.stats.prefetch_load_seconds += load_seconds;
+        store.stats.prefetch_stall_seconds += stall_seconds;
+    }
+}
+
+void ColumnPrefetcher::Run()
+{
+    while (true)
+    {
+        size_t i;
+        {
+            unique_lock<mutex> lock(prefetch_mutex);
+            loaded_cv.wait(lock, [&]
+                           { return stop || next_load >= plan.size() || next_load < consumed + depth; });
+            if (stop || next_load >= plan.size())
+            {
+                return;
+            }
+            i = next_load;
+        }
+
+        auto start = chrono::steady_clock::now();
+        optional<ColumnStore::ColumnRef> column;
+        exception_ptr load_error;
+        try
+        {
+            column.emplace(snapshot[plan[i]]);
+        }
+        catch (...)
+        {
+            load_error = current_exception();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        {
+            lock_guard<mutex> lock(prefetch_mutex);
+            loaded[i] = move(column);
+            error = load_error;
+            load_seconds += seconds;
+            next_load++;
+        }
+        loaded_cv.notify_all();
+
+        if (load_error)
+        {
+            return;
+        }
+    }
+}
+
+ColumnStore::ColumnRef ColumnPrefetcher::Get(size_t i)
+{
+    if (depth == 0)
+    {
+        return snapshot[plan[i]];
+    }
+
+    auto start = chrono::steady_clock::now();
+    unique_lock<mutex> lock(prefetch_mutex);
+    loaded_cv.wait(lock, [&]
+                   { return loaded[i].has_value() || error; });
+    stall_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (!loaded[i])
+    {
+        rethrow_exception(error);
+    }
+
+    // Hand the pin over so the prefetcher never holds more than depth columns itself
+    ColumnStore::ColumnRef column = move(*loaded[i]);
+    loaded[i].reset();
+    consumed = i + 1;
+    lock.unlock();
+    loaded_cv.notify_all();
+    return column;
+}
+
+void PrintColumnCacheStats(const ColumnCacheStats &stats)
+{
+    cout << "Column cache: " << stats.hits << " hits, " << stats.misses << " misses";
+    if (stats.hits + stats.misses > 0)
+    {
+        cout << " (" << 100.0 * stats.hits / (stats.hits + stats.misses) << "% hit rate)";
+    }
+    cout << ", " << stats.evictions << " evictions, " << stats.spilled_bytes << " B spilled, "
+         << stats.cached_bytes << " B cached";
+    if (stats.memory_budget > 0)
+    {
+        cout << " of " << stats.memory_budget << " B budget";
+    }
+    if (stats.compressed_columns > 0)
+    {
+        cout << ", " << stats.compressed_columns << " columns compressed from " << stats.compressed_raw_bytes
+             << " B to " << stats.compressed_bytes << " B";
+    }
+    if (stats.prefetched > 0 && stats.prefetch_load_seconds > 0)
+    {
+        cout << ", " << stats.prefetched << " columns prefetched with "
+             << 100.0 * (1 - stats.prefetch_stall_seconds / stats.prefetch_load_seconds) << "% of the load time overlapped";
+    }
+    if (stats.copied_versions > 0)
+    {
+        cout << ", " << stats.copied_versions << " columns copied under a snapshot (" << stats.retained_versions << " retained)";
+    }
+    cout << endl;
+}
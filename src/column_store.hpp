@@ -0,0 +1,275 @@
+/*
+Column store behind encrypted_db[col][row]
+
+Columns are either resident on the heap or read-only views of a database file mapped with
+MAP_SHARED, so several server processes can serve the same store from one copy in the page cache.
+
+With a memory budget the store becomes a column cache: the least recently used columns are evicted
+once the cached columns exceed the budget. Evicted columns that exist nowhere else (resident or
+modified columns) are spilled to a local file and faulted back on demand.
+
+With compression only a small hot set of columns is kept as DoubleCRTs. Columns falling out of it are
+kept in memory as deflated Ctxt::writeTo blobs instead of being spilled, and inflated again on first touch.
+
+Readers see the store through snapshots. Every published change starts a new epoch, and a snapshot reads each
+column as it was at the epoch it was taken at: a change to a column some snapshot can still see goes into a
+copy of it, and the old version is retired with the epoch it was superseded at. Once no snapshot's epoch falls
+within a retired version's lifetime it is reclaimed. Columns no snapshot can see are changed in place, so a burst
+of updates copies each column at most once per snapshot.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "db_file.hpp"
+
+using namespace std;
+
+struct ColumnCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t spilled_bytes = 0;
+    uint64_t cached_bytes = 0;
+    uint64_t memory_budget = 0;
+
+    // Columns loaded ahead of the query by a ColumnPrefetcher, the time spent loading them and
+    // the part of that time the query still had to wait for
+    uint64_t prefetched = 0;
+    double prefetch_load_seconds = 0;
+    double prefetch_stall_seconds = 0;
+
+    // Cold columns held compressed, with their serialized size before and after deflating
+    uint64_t compressed_columns = 0;
+    uint64_t compressed_raw_bytes = 0;
+    uint64_t compressed_bytes = 0;
+
+    // Columns copied because a snapshot could still see them, and superseded versions not reclaimed yet
+    uint64_t copied_versions = 0;
+    uint64_t retained_versions = 0;
+};
+
+// Memory of one column: full_bytes is what the column takes as DoubleCRTs (StorageOfOneElement per
+// ciphertext) and resident_bytes what this process actually holds for it right now
+struct ColumnMemory
+{
+    uint64_t full_bytes = 0;
+    uint64_t resident_bytes = 0;
+    uint64_t compressed_bytes = 0;
+    bool hot = false;
+};
+
+class ColumnStore
+{
+public:
+    using Column = vector<helib::Ctxt>;
+
+    // Pins one column for as long as the reference lives, so the store can release it meanwhile
+    class ColumnRef
+    {
+    public:
+        explicit ColumnRef(shared_ptr<const Column> _column) : column(move(_column)) {}
+
+        const helib::Ctxt &operator[](size_t row) const { return (*column)[row]; }
+        const Column &operator*() const { return *column; }
+        size_t size() const { return column->size(); }
+
+        Column::const_iterator begin() const { return column->begin(); }
+        Column::const_iterator end() const { return column->end(); }
+
+    private:
+        shared_ptr<const Column> column;
+    };
+
+    // Consistent view of the store as of the epoch it was taken at, held by a query for as long as it runs
+    class Snapshot
+    {
+    public:
+        ~Snapshot();
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        ColumnRef operator[](uint32_t col) const;
+        size_t size() const { return store.size(); }
+        const ColumnStore &Store() const { return store; }
+
+    private:
+        friend class ColumnStore;
+        Snapshot(const ColumnStore &_store, uint64_t _epoch) : store(_store), epoch(_epoch) {}
+
+        const ColumnStore &store;
+        uint64_t epoch;
+    };
+
+    ColumnStore() = default;
+    ~ColumnStore();
+
+    ColumnStore(const ColumnStore &) = delete;
+    ColumnStore &operator=(const ColumnStore &) = delete;
+
+    // Replaces the store with resident columns
+    void Assign(vector<Column> &&columns);
+
+    // Replaces the store with a read-only mapping of db_file
+    const DBFileMapping &Map(const string &db_file, const helib::PubKey &pk, uint32_t num_slots);
+
+    // Caps the cached columns at memory_budget bytes, counting ctxt_bytes per ciphertext, and spills
+    // evicted columns to spill_file. A budget of 0 keeps every resident column in memory.
+    void SetMemoryBudget(uint64_t memory_budget, uint64_t ctxt_bytes, const string &spill_file, const helib::PubKey &pk);
+
+    // Keeps at most hot_columns columns as DoubleCRTs and compresses colder modified or resident columns
+    // in memory rather than spilling them. A hot set of 0 turns compression off; without a memory budget the
+    // compressed columns are then inflated back into memory.
+    void SetCompression(uint32_t hot_columns, uint64_t ctxt_bytes, const helib::PubKey &pk);
+
+    void Clear();
+
+    size_t size() const { return num_cols; }
+    bool empty() const { return num_cols == 0; }
+    bool IsMapped() const { return mapping != nullptr; }
+    bool ReadOnly() const { return mapping && !Caching(); }
+
+    // Faults the column in if it is not cached. Columns are shared by every query pinning them concurrently.
+    ColumnRef operator[](uint32_t col) const;
+    shared_ptr<const Snapshot> TakeSnapshot() const;
+
+    // Applies fn to one stored ciphertext, in place unless a snapshot can see its column. Mapped stores only accept
+    // updates with a memory budget, in which case modified columns are spilled instead of being written back to the mapping.
+    void Update(uint32_t col, uint32_t row, const function<void(helib::Ctxt &)> &fn);
+    // Adds compressed rows to the end of one column, under the same conditions as Update
+    void Append(uint32_t col, vector<helib::Ctxt> &&rows);
+
+    // Writes every column to writer in the column-major order of the database file
+    void WriteTo(DBFileWriter &writer) const;
+
+    // Number of ciphertexts currently held on this process' heap
+    uint64_t ResidentCiphertexts() const;
+
+    ColumnCacheStats CacheStats() const;
+    ColumnMemory Memory(uint32_t col) const;
+
+    // Starts kernel readahead for every column of a query plan that is not cached yet
+    void Advise(const vector<uint32_t> &cols) const;
+
+private:
+    friend class ColumnPrefetcher;
+
+    struct CompressedColumn
+    {
+        string data;                 // deflated Ctxt::writeTo blobs of the whole column
+        uint64_t raw_length;         // length of the blobs before deflating
+        vector<DBFileRecord> records; // location of each ciphertext in the inflated blobs
+    };
+
+    // Version of a column superseded while a snapshot could still see it, current for epochs [since, until)
+    struct Version
+    {
+        uint64_t since;
+        uint64_t until;
+        shared_ptr<const Column> column;
+    };
+
+    struct Slot
+    {
+        shared_ptr<Column> column;                    // cached copy, null once evicted
+        weak_ptr<Column> pinned;                      // last copy handed out, may outlive its eviction in a query
+        shared_ptr<const CompressedColumn> compressed; // compressed copy, preferred over any copy on disk
+        vector<DBFileRecord> spilled;                 // location in the spill file, empty while backed by the mapping
+        uint64_t generation = 0;                      // bumped whenever the backing copy changes so stale faults are retried
+        bool dirty = false;                           // cached copy exists nowhere else
+        uint64_t since = 0;                           // epoch the current version was published at
+        vector<Version> history;                      // superseded versions some snapshot may still read
+        list<uint32_t>::iterator lru;
+    };
+
+    shared_ptr<Column> Fault(uint32_t col) const;
+    shared_ptr<Column> Load(uint32_t col, const shared_ptr<const CompressedColumn> &compressed,
+                            const vector<DBFileRecord> &spilled) const;
+
+    // The following expect cache_mutex to be held
+    void Install(uint32_t col, const shared_ptr<Column> &column) const;
+    void Touch(uint32_t col) const;
+    void Evict(uint32_t keep) const;
+    void Spill(Slot &slot) const;
+    void Compress(Slot &slot) const;
+    void DropCompressed(Slot &slot) const;
+    // Returns the version of column col a change can be applied to, copying it if a snapshot can see it
+    shared_ptr<Column> Writable(uint32_t col, const shared_ptr<Column> &column);
+    void Reclaim() const;
+    bool Caching() const { return memory_budget > 0 || hot_columns > 0; }
+    uint64_t ColumnBytes(const Column &column) const { return column.size() * ctxt_bytes; }
+
+    size_t num_cols = 0;
+
+    unique_ptr<DBFileMapping> mapping;
+    const helib::PubKey *public_key = nullptr;
+
+    uint64_t memory_budget = 0;
+    uint32_t hot_columns = 0;
+    uint64_t ctxt_bytes = 0;
+    string spill_path;
+    int spill_fd = -1;
+
+    mutable mutex cache_mutex;
+    mutable vector<Slot> slots;
+    mutable list<uint32_t> lru;
+    mutable uint64_t spill_end = 0;
+    mutable ColumnCacheStats stats;
+
+    mutable uint64_t epoch = 0;
+    mutable multiset<uint64_t> readers; // epochs of the snapshots held
+    mutable set<uint32_t> versioned;    // columns with superseded versions
+};
+
+// Walks the columns of a query plan in order while a background thread faults in the next depth
+// columns, so the computation on one column overlaps the I/O and deserialization of the following ones.
+// A depth of 0 loads every column synchronously when it is requested.
+class ColumnPrefetcher
+{
+public:
+    ColumnPrefetcher(const ColumnStore::Snapshot &_snapshot, vector<uint32_t> _plan, size_t _depth);
+    ~ColumnPrefetcher();
+
+    ColumnPrefetcher(const ColumnPrefetcher &) = delete;
+    ColumnPrefetcher &operator=(const ColumnPrefetcher &) = delete;
+
+    // Column plan[i]; columns have to be requested in plan order
+    ColumnStore::ColumnRef Get(size_t i);
+
+private:
+    void Run();
+
+    const ColumnStore::Snapshot &snapshot;
+    const ColumnStore &store;
+    vector<uint32_t> plan;
+    size_t depth;
+
+    mutex prefetch_mutex;
+    condition_variable loaded_cv;
+    vector<optional<ColumnStore::ColumnRef>> loaded;
+    size_t next_load = 0;
+    size_t consumed = 0;
+    bool stop = false;
+    exception_ptr error;
+
+    double load_seconds = 0;
+    double stall_seconds = 0;
+
+    thread worker;
+};
+
+void PrintColumnCacheStats(const ColumnCacheStats &stats);
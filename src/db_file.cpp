@@ -0,0 +1,364 @@
+#include "db_file.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+template <typename T>
+static void write_raw(ostream &str, const T &value)
+{
+    str.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static T read_raw(istream &str)
+{
+    T value;
+    str.read(reinterpret_cast<char *>(&value), sizeof(T));
+    if (!str)
+    {
+        throw invalid_argument("ERROR: database file is truncated");
+    }
+    return value;
+}
+
+static void write_header(ostream &str, const DBFileHeader &header)
+{
+    str.write(DB_FILE_MAGIC, sizeof(DB_FILE_MAGIC));
+    write_raw(str, header.version);
+    write_raw(str, header.flags);
+    write_raw(str, header.num_slots);
+    write_raw(str, header.num_rows);
+    write_raw(str, header.num_cols);
+    write_raw(str, header.num_compressed_rows);
+    write_raw(str, header.num_continuous);
+    write_raw(str, header.num_headers);
+    write_raw(str, header.index_offset);
+    write_raw(str, header.snps_per_slot);
+    write_raw(str, header.num_snps);
+    write_raw(str, (uint32_t)header.deleted_rows.size());
+    write_raw(str, header.wal_lsn);
+}
+
+static DBFileHeader read_header(istream &str)
+{
+    char magic[sizeof(DB_FILE_MAGIC)];
+    str.read(magic, sizeof(magic));
+    if (!str || memcmp(magic, DB_FILE_MAGIC, sizeof(magic)) != 0)
+    {
+        throw invalid_argument("ERROR: not a SQUiD database file");
+    }
+
+    DBFileHeader header;
+    header.version = read_raw<uint32_t>(str);
+    if (header.version == 0 || header.version > DB_FILE_VERSION)
+    {
+        throw invalid_argument("ERROR: unsupported database file version " + to_string(header.version));
+    }
+    header.flags = read_raw<uint32_t>(str);
+    header.num_slots = read_raw<uint32_t>(str);
+    header.num_rows = read_raw<uint32_t>(str);
+    header.num_cols = read_raw<uint32_t>(str);
+    header.num_compressed_rows = read_raw<uint32_t>(str);
+    header.num_continuous = read_raw<uint32_t>(str);
+    header.num_headers = read_raw<uint32_t>(str);
+    header.index_offset = read_raw<uint64_t>(str);
+    if (header.version >= 2)
+    {
+        header.snps_per_slot = read_raw<uint32_t>(str);
+        header.num_snps = read_raw<uint32_t>(str);
+    }
+    else
+    {
+        header.num_snps = header.num_cols;
+    }
+    if (header.version >= 3)
+    {
+        header.deleted_rows.resize(read_raw<uint32_t>(str));
+    }
+    if (header.version >= 4)
+    {
+        header.wal_lsn = read_raw<uint64_t>(str);
+    }
+    return header;
+}
+
+static uint64_t num_records(const DBFileHeader &header)
+{
+    return (uint64_t)header.num_cols * header.num_compressed_rows + header.num_continuous;
+}
+
+static helib::Ctxt read_record(istream &str, const helib::PubKey &pk, const DBFileHeader &header)
+{
+    if (header.flags & DB_FILE_SEEDED)
+    {
+        return ReadSeededCtxt(str, pk);
+    }
+    return helib::Ctxt::readFrom(str, pk);
+}
+
+DBFileWriter::DBFileWriter(const string &path, const DBFileHeader &_header, const vector<string> &column_headers,
+                           const helib::SecKey *_seeding_key)
+    : file(path, ios::binary | ios::trunc), header(_header), seeding_key(_seeding_key)
+{
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open database file for writing: " + path);
+    }
+
+    header.num_headers = column_headers.size();
+    if (seeding_key)
+    {
+        header.flags |= DB_FILE_SEEDED;
+    }
+
+    // The index offset is only known once every record is written, so the header is patched in Finish
+    write_header(file, header);
+
+    for (const string &column_header : column_headers)
+    {
+        write_raw(file, (uint32_t)column_header.size());
+        file.write(column_header.data(), column_header.size());
+    }
+
+    index.reserve(num_records(header));
+}
+
+void DBFileWriter::Write(const helib::Ctxt &ctxt)
+{
+    uint64_t start = file.tellp();
+    if (seeding_key)
+    {
+        WriteSeededCtxt(file, ctxt, *seeding_key);
+    }
+    else
+    {
+        ctxt.writeTo(file);
+    }
+    uint64_t end = file.tellp();
+    index.push_back(DBFileRecord{start, end - start});
+}
+
+void DBFileWriter::Finish()
+{
+    if (index.size() != num_records(header))
+    {
+        throw invalid_argument("ERROR: number of records written does not match the database header");
+    }
+
+    header.index_offset = file.tellp();
+    for (const DBFileRecord &record : index)
+    {
+        write_raw(file, record.offset);
+        write_raw(file, record.length);
+    }
+    for (uint32_t row : header.deleted_rows)
+    {
+        write_raw(file, row);
+    }
+
+    file.seekp(0);
+    write_header(file, header);
+    file.flush();
+
+    if (!file)
+    {
+        throw runtime_error("ERROR: failed writing database file");
+    }
+}
+
+DBFileMapping::DBFileMapping(const string &path, uint32_t num_slots)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw invalid_argument("ERROR: cannot open database file: " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        throw invalid_argument("ERROR: cannot map empty database file: " + path);
+    }
+    length = st.st_size;
+
+    // MAP_SHARED keeps a single copy of the file in the page cache for every process mapping it
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        throw runtime_error("ERROR: mmap failed for database file: " + path);
+    }
+    data = static_cast<const char *>(mapped);
+
+    // The destructor does not run for a constructor that throws, so the mapping is released here
+    try
+    {
+        MemoryStreamBuffer buffer(data, length);
+        istream str(&buffer);
+
+        header = read_header(str);
+        if (header.num_slots != num_slots)
+        {
+            throw invalid_argument("ERROR: database file was written for " + to_string(header.num_slots) +
+                                   " slots but the context has " + to_string(num_slots));
+        }
+
+        for (uint32_t i = 0; i < header.num_headers; i++)
+        {
+            uint32_t header_length = read_raw<uint32_t>(str);
+            string column_header(header_length, '\0');
+            str.read(&column_header[0], header_length);
+            column_headers.push_back(column_header);
+        }
+
+        uint64_t index_length = num_records(header) * sizeof(DBFileRecord);
+        uint64_t deleted_length = header.deleted_rows.size() * sizeof(uint32_t);
+        if (header.index_offset > length || index_length + deleted_length > length - header.index_offset)
+        {
+            throw invalid_argument("ERROR: database file index is truncated");
+        }
+
+        index.resize(num_records(header));
+        memcpy(index.data(), data + header.index_offset, index_length);
+        memcpy(header.deleted_rows.data(), data + header.index_offset + index_length, deleted_length);
+
+        // Checked once here, so ReadRecord and WillNeed can trust the index
+        for (uint64_t i = 0; i < index.size(); i++)
+        {
+            if (index[i].offset > length || index[i].length > length - index[i].offset)
+            {
+                throw invalid_argument("ERROR: record " + to_string(i) + " lies past the end of database file: " + path);
+            }
+        }
+    }
+    catch (...)
+    {
+        munmap(const_cast<char *>(data), length);
+        throw;
+    }
+}
+
+DBFileMapping::~DBFileMapping()
+{
+    munmap(const_cast<char *>(data), length);
+}
+
+helib::Ctxt DBFileMapping::ReadRecord(uint64_t i, const helib::PubKey &pk) const
+{
+    MemoryStreamBuffer buffer(RecordData(i), index[i].length);
+    istream str(&buffer);
+    return read_record(str, pk, header);
+}
+
+void DBFileMapping::WillNeed(uint64_t first, uint64_t count) const
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start = index[first].offset & ~(page_size - 1);
+    uint64_t end = index[first + count - 1].offset + index[first + count - 1].length;
+
+    // Only a hint, so a failure just leaves the reads synchronous
+    madvise(const_cast<char *>(data) + start, end - start, MADV_WILLNEED);
+}
+
+DBLoadStats ReadDBFile(const string &path, const helib::PubKey &pk, uint32_t num_slots,
+                       DBFileHeader &header,
+                       vector<vector<helib::Ctxt>> &encrypted_db,
+                       vector<helib::Ctxt> &continuous_db,
+                       vector<string> &column_headers)
+{
+    auto start = chrono::steady_clock::now();
+
+    // One large buffer turns the many small reads done by Ctxt::read into bulk sequential reads
+    vector<char> buffer(DB_FILE_READ_BUFFER);
+    ifstream file;
+    file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    file.open(path, ios::binary);
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open database file: " + path);
+    }
+
+    header = read_header(file);
+    if (header.num_slots != num_slots)
+    {
+        throw invalid_argument("ERROR: database file was written for " + to_string(header.num_slots) +
+                               " slots but the context has " + to_string(num_slots));
+    }
+
+    column_headers = vector<string>();
+    column_headers.reserve(header.num_headers);
+    for (uint32_t i = 0; i < header.num_headers; i++)
+    {
+        uint32_t length = read_raw<uint32_t>(file);
+        string column_header(length, '\0');
+        file.read(&column_header[0], length);
+        column_headers.push_back(column_header);
+    }
+
+    encrypted_db = vector<vector<helib::Ctxt>>();
+    encrypted_db.reserve(header.num_cols);
+    for (uint32_t i = 0; i < header.num_cols; i++)
+    {
+        vector<helib::Ctxt> cipher_vector = vector<helib::Ctxt>();
+        cipher_vector.reserve(header.num_compressed_rows);
+        for (uint32_t j = 0; j < header.num_compressed_rows; j++)
+        {
+            cipher_vector.push_back(read_record(file, pk, header));
+        }
+        encrypted_db.push_back(move(cipher_vector));
+    }
+
+    continuous_db = vector<helib::Ctxt>();
+    continuous_db.reserve(header.num_continuous);
+    for (uint32_t j = 0; j < header.num_continuous; j++)
+    {
+        continuous_db.push_back(read_record(file, pk, header));
+    }
+
+    if (!file || (uint64_t)file.tellg() != header.index_offset)
+    {
+        throw invalid_argument("ERROR: database file records do not match its header");
+    }
+
+    if (!header.deleted_rows.empty())
+    {
+        file.seekg(header.index_offset + num_records(header) * sizeof(DBFileRecord));
+        for (uint32_t &row : header.deleted_rows)
+        {
+            row = read_raw<uint32_t>(file);
+        }
+    }
+
+    DBLoadStats stats;
+    stats.bytes_read = header.index_offset;
+    stats.num_ciphertexts = num_records(header);
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+void PrintDBLoadStats(const DBLoadStats &stats)
+{
+    cout << "Loaded " << stats.num_ciphertexts << " ciphertexts (" << stats.bytes_read << " B) in "
+         << stats.seconds << " s";
+    if (stats.seconds > 0)
+    {
+        cout << " (" << stats.bytes_read / stats.seconds / (1 << 20) << " MiB/s)";
+    }
+    cout << endl;
+}
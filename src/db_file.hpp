@@ -0,0 +1,143 @@
+/*
+Binary on-disk format for an encrypted database
+
+Layout (host byte order):
+    header    : magic "SQDB", version, flags, num_slots, num_rows, num_cols,
+                num_compressed_rows, num_continuous, num_headers, index offset,
+                snps_per_slot, num_snps (version 2 on), num_deleted (version 3 on),
+                wal_lsn (version 4 on)
+    headers   : one length-prefixed string per column header
+    records   : one Ctxt::writeTo blob per ciphertext, column-major
+                (column 0 rows 0..n-1, column 1 rows 0..n-1, ...) followed by continuous_db.
+                With DB_FILE_SEEDED set every record is a WriteSeededCtxt blob instead.
+                num_cols counts stored columns, which hold snps_per_slot of the num_snps SNPs each.
+    index     : (offset, length) of every record, in the same order as the records
+    deleted   : num_deleted uint32_t indices of deleted rows (version 3 on)
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+#include <cstdint>
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "seeded_ctxt.hpp"
+
+using namespace std;
+
+const char DB_FILE_MAGIC[4] = {'S', 'Q', 'D', 'B'};
+const uint32_t DB_FILE_VERSION = 4;
+
+// Header flags
+const uint32_t DB_FILE_SEEDED = 1;
+
+// Size of the read buffer used when streaming a database file in
+const size_t DB_FILE_READ_BUFFER = 1 << 24;
+
+struct DBFileHeader
+{
+    uint32_t version = DB_FILE_VERSION;
+    uint32_t flags = 0;
+    uint32_t num_slots = 0;
+    uint32_t num_rows = 0;
+    uint32_t num_cols = 0;
+    uint32_t num_compressed_rows = 0;
+    uint32_t num_continuous = 0;
+    uint32_t num_headers = 0;
+    uint64_t index_offset = 0;
+    uint32_t snps_per_slot = 1;
+    uint32_t num_snps = 0;
+    // Last write-ahead log record the file includes, so recovery only replays the records after it
+    uint64_t wal_lsn = 0;
+
+    // Only their count is part of the fixed header; the rows themselves follow the index
+    vector<uint32_t> deleted_rows;
+};
+
+struct DBFileRecord
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct DBLoadStats
+{
+    uint64_t bytes_read = 0;
+    uint64_t num_ciphertexts = 0;
+    double seconds = 0;
+};
+
+// Read-only stream buffer over bytes owned by someone else, e.g. a file mapping
+class MemoryStreamBuffer : public std::streambuf
+{
+public:
+    MemoryStreamBuffer(const char *data, size_t length)
+    {
+        char *begin = const_cast<char *>(data);
+        setg(begin, begin, begin + length);
+    }
+};
+
+// Streams records into a database file; the index and final header are written by Finish.
+// Given the data owner's secret key, records are written as seeded ciphertexts of about half the size.
+class DBFileWriter
+{
+public:
+    DBFileWriter(const string &path, const DBFileHeader &_header, const vector<string> &column_headers,
+                 const helib::SecKey *_seeding_key = nullptr);
+
+    void Write(const helib::Ctxt &ctxt);
+    void Finish();
+
+private:
+    ofstream file;
+    DBFileHeader header;
+    vector<DBFileRecord> index;
+    const helib::SecKey *seeding_key;
+};
+
+// Read-only shared mapping of a database file. Every process mapping the same file shares its pages,
+// and ciphertexts are deserialized straight out of the mapping when a query needs them.
+class DBFileMapping
+{
+public:
+    DBFileMapping(const string &path, uint32_t num_slots);
+    ~DBFileMapping();
+
+    DBFileMapping(const DBFileMapping &) = delete;
+    DBFileMapping &operator=(const DBFileMapping &) = delete;
+
+    const DBFileHeader &Header() const { return header; }
+    const vector<string> &ColumnHeaders() const { return column_headers; }
+    uint64_t MappedBytes() const { return length; }
+
+    uint64_t RecordIndex(uint32_t col, uint32_t row) const { return (uint64_t)col * header.num_compressed_rows + row; }
+    const DBFileRecord &Record(uint64_t i) const { return index[i]; }
+    const char *RecordData(uint64_t i) const { return data + index[i].offset; }
+
+    helib::Ctxt ReadRecord(uint64_t i, const helib::PubKey &pk) const;
+
+    // Asks the kernel to start reading records [first, first + count) in the background
+    void WillNeed(uint64_t first, uint64_t count) const;
+
+private:
+    const char *data = nullptr;
+    size_t length = 0;
+
+    DBFileHeader header;
+    vector<string> column_headers;
+    vector<DBFileRecord> index;
+};
+
+// Reads the whole file sequentially through one large buffer. Throws invalid_argument on a
+// malformed file or when the file was written for a different slot count than num_slots.
+DBLoadStats ReadDBFile(const string &path, const helib::PubKey &pk, uint32_t num_slots,
+                       DBFileHeader &header,
+                       vector<vector<helib::Ctxt>> &encrypted_db,
+                       vector<helib::Ctxt> &continuous_db,
+                       vector<string> &column_headers);
+
+void PrintDBLoadStats(const DBLoadStats &stats);
@@ -0,0 +1,78 @@
+#include "delta_buffer.hpp"
+
+using namespace std;
+
+void DeltaBuffer::Add(uint32_t col, uint32_t row, uint32_t slot, unsigned long delta)
+{
+    lock_guard<mutex> lock(buffer_mutex);
+
+    PendingDelta &pending = deltas[{col, row}];
+    if (pending.slots.empty())
+    {
+        pending.col = col;
+        pending.row = row;
+        pending.slots.resize(num_slots, 0);
+        stats.pending_ciphertexts++;
+    }
+    pending.slots[slot] = (pending.slots[slot] + delta % modulus) % modulus;
+    pending.cells++;
+    stats.pending_cells++;
+}
+
+vector<PendingDelta> DeltaBuffer::Drain()
+{
+    lock_guard<mutex> lock(buffer_mutex);
+
+    vector<PendingDelta> drained;
+    drained.reserve(deltas.size());
+    for (auto &entry : deltas)
+    {
+        drained.push_back(move(entry.second));
+    }
+    deltas.clear();
+
+    if (!drained.empty())
+    {
+        stats.merges++;
+        stats.merged_ciphertexts += stats.pending_ciphertexts;
+        stats.merged_cells += stats.pending_cells;
+        stats.pending_ciphertexts = 0;
+        stats.pending_cells = 0;
+    }
+    return drained;
+}
+
+void DeltaBuffer::Restore(vector<PendingDelta> pending)
+{
+    lock_guard<mutex> lock(buffer_mutex);
+
+    for (PendingDelta &delta : pending)
+    {
+        PendingDelta &merged = deltas[{delta.col, delta.row}];
+        if (merged.slots.empty())
+        {
+            merged.col = delta.col;
+            merged.row = delta.row;
+            merged.slots = move(delta.slots);
+            stats.pending_ciphertexts++;
+        }
+        else
+        {
+            for (size_t k = 0; k < merged.slots.size(); k++)
+            {
+                merged.slots[k] = (merged.slots[k] + delta.slots[k]) % modulus;
+            }
+        }
+        merged.cells += delta.cells;
+
+        stats.pending_cells += delta.cells;
+        stats.merged_ciphertexts--;
+        stats.merged_cells -= delta.cells;
+    }
+}
+
+DeltaBufferStats DeltaBuffer::Stats() const
+{
+    lock_guard<mutex> lock(buffer_mutex);
+    return stats;
+}
@@ -0,0 +1,60 @@
+/*
+Plaintext buffer of pending edits
+
+Edits to the encrypted database are additions of a plaintext delta to one ciphertext, so edits to the same
+(column, compressed row) can be summed in the clear before anything is encrypted. DeltaBuffer keeps one vector
+of slot deltas, reduced mod the plaintext modulus, per ciphertext with pending edits. Draining it yields one
+plaintext per touched ciphertext, which is encrypted and added once however many cells of it were edited.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+struct PendingDelta
+{
+    uint32_t col;
+    uint32_t row; // compressed row
+    vector<unsigned long> slots;
+    uint64_t cells = 0; // edits summed into slots
+};
+
+struct DeltaBufferStats
+{
+    uint64_t pending_ciphertexts = 0; // ciphertexts with edits waiting to be merged
+    uint64_t pending_cells = 0;
+    uint64_t merges = 0;
+    uint64_t merged_ciphertexts = 0; // encryptions the merges made
+    uint64_t merged_cells = 0;       // edits those encryptions carried
+};
+
+class DeltaBuffer
+{
+public:
+    DeltaBuffer(uint32_t _num_slots, unsigned long _modulus) : num_slots(_num_slots), modulus(_modulus) {}
+
+    // Adds delta to one slot of the ciphertext at (col, row)
+    void Add(uint32_t col, uint32_t row, uint32_t slot, unsigned long delta);
+
+    // Removes every pending delta, in column order, and counts them as merged
+    vector<PendingDelta> Drain();
+
+    // Puts back drained deltas that were not applied, summing them with any edits added since
+    void Restore(vector<PendingDelta> pending);
+
+    DeltaBufferStats Stats() const;
+
+private:
+    uint32_t num_slots;
+    unsigned long modulus;
+
+    mutable mutex buffer_mutex;
+    map<pair<uint32_t, uint32_t>, PendingDelta> deltas;
+    DeltaBufferStats stats;
+};
@@ -0,0 +1,312 @@
+#include "executor.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+// Worker the current thread is, so the tasks it readies go onto its own deque
+static thread_local const Executor *current_executor = nullptr;
+static thread_local uint32_t current_worker = 0;
+// Tasks Push is running inline on the current thread, each nested in the one before
+static thread_local uint32_t inline_depth = 0;
+
+TaskGraph::Node TaskGraph::Add(const char *kind, function<void()> fn, const vector<Node> &deps)
+{
+    Node node = tasks.size();
+    for (Node dep : deps)
+    {
+        if (dep >= node)
+        {
+            throw invalid_argument("ERROR: a task can only depend on tasks added before it");
+        }
+    }
+
+    tasks.emplace_back();
+    Task &task = tasks.back();
+    task.kind = kind;
+    task.fn = move(fn);
+    task.num_deps = deps.size();
+    for (Node dep : deps)
+    {
+        tasks[dep].dependents.push_back(node);
+    }
+    return node;
+}
+
+Executor::Executor(uint32_t num_threads, size_t _max_queued) : max_queued(_max_queued)
+{
+    num_threads = max<uint32_t>(num_threads, 1);
+    for (uint32_t t = 0; t < num_threads; t++)
+    {
+        workers.push_back(make_unique<Worker>());
+    }
+    stats.threads = num_threads;
+    stats.max_queued = max_queued;
+
+    for (uint32_t t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back(&Executor::Work, this, t);
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        lock_guard<mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    work_cv.notify_all();
+    for (thread &worker : threads)
+    {
+        worker.join();
+    }
+}
+
+void Executor::Run(TaskGraph &graph)
+{
+    if (graph.size() == 0)
+    {
+        return;
+    }
+
+    GraphRun run;
+    run.graph = &graph;
+    run.remaining = graph.size();
+    for (TaskGraph::Task &task : graph.tasks)
+    {
+        task.pending = task.num_deps;
+    }
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        stats.graphs++;
+    }
+
+    for (TaskGraph::Node node = 0; node < graph.size(); node++)
+    {
+        if (graph.tasks[node].num_deps == 0)
+        {
+            Push(Item{&run, node});
+        }
+    }
+
+    // Works on whatever is ready, ours or not, rather than idling a core while the graph finishes
+    uint32_t index = current_executor == this ? current_worker : next_worker++ % workers.size();
+    while (true)
+    {
+        {
+            lock_guard<mutex> lock(run.run_mutex);
+            if (run.done)
+            {
+                break;
+            }
+        }
+        Item item;
+        if (Take(index, item))
+        {
+            Execute(item);
+            continue;
+        }
+        unique_lock<mutex> lock(run.run_mutex);
+        run.done_cv.wait_for(lock, chrono::milliseconds(1), [&]
+                             { return run.done; });
+    }
+
+    if (run.error)
+    {
+        rethrow_exception(run.error);
+    }
+}
+
+void Executor::Push(const Item &item)
+{
+    bool full = queued >= max_queued;
+    if (full && inline_depth < EXECUTOR_MAX_INLINE_DEPTH)
+    {
+        {
+            lock_guard<mutex> lock(stats_mutex);
+            stats.inline_runs++;
+        }
+        inline_depth++;
+        Execute(item);
+        inline_depth--;
+        return;
+    }
+
+    // Counted before it is queued, so takers never see more tasks than were counted
+    size_t depth = ++queued;
+    uint32_t index = current_executor == this ? current_worker : next_worker++ % workers.size();
+    {
+        lock_guard<mutex> lock(workers[index]->worker_mutex);
+        workers[index]->ready.push_back(item);
+    }
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        stats.peak_queued = max<uint64_t>(stats.peak_queued, depth);
+        if (full)
+        {
+            stats.overflows++;
+        }
+    }
+    {
+        lock_guard<mutex> lock(sleep_mutex);
+    }
+    work_cv.notify_one();
+}
+
+bool Executor::Take(uint32_t index, Item &item)
+{
+    {
+        Worker &own = *workers[index];
+        lock_guard<mutex> lock(own.worker_mutex);
+        if (!own.ready.empty())
+        {
+            item = own.ready.back();
+            own.ready.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (size_t k = 1; k < workers.size(); k++)
+    {
+        Worker &victim = *workers[(index + k) % workers.size()];
+        lock_guard<mutex> lock(victim.worker_mutex);
+        if (!victim.ready.empty())
+        {
+            item = victim.ready.front();
+            victim.ready.pop_front();
+            queued--;
+
+            lock_guard<mutex> stats_lock(stats_mutex);
+            stats.steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::Execute(const Item &item)
+{
+    GraphRun &run = *item.run;
+    TaskGraph::Task &task = run.graph->tasks[item.node];
+
+    if (!run.failed)
+    {
+        auto start = chrono::steady_clock::now();
+        try
+        {
+            task.fn();
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(run.run_mutex);
+            if (!run.error)
+            {
+                run.error = current_exception();
+            }
+            run.failed = true;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        lock_guard<mutex> lock(stats_mutex);
+        TaskTimings &timings = stats.timings[task.kind];
+        timings.count++;
+        timings.seconds += seconds;
+        timings.max_seconds = max(timings.max_seconds, seconds);
+        stats.tasks++;
+    }
+
+    // Dependents are readied before this task counts as done, so the graph cannot finish with tasks still unqueued
+    for (TaskGraph::Node dependent : task.dependents)
+    {
+        if (--run.graph->tasks[dependent].pending == 0)
+        {
+            Push(Item{&run, dependent});
+        }
+    }
+    if (--run.remaining == 0)
+    {
+        // Run returns as soon as it sees done, so nothing may touch run once the lock is released
+        lock_guard<mutex> lock(run.run_mutex);
+        run.done = true;
+        run.done_cv.notify_all();
+    }
+}
+
+void Executor::Work(uint32_t index)
+{
+    current_executor = this;
+    current_worker = index;
+
+    while (true)
+    {
+        Item item;
+        if (Take(index, item))
+        {
+            Execute(item);
+            continue;
+        }
+
+        unique_lock<mutex> lock(sleep_mutex);
+        work_cv.wait(lock, [&]
+                     { return stop || queued > 0; });
+        if (stop && queued == 0)
+        {
+            return;
+        }
+    }
+}
+
+ExecutorStats Executor::Stats()
+{
+    lock_guard<mutex> lock(stats_mutex);
+    return stats;
+}
+
+void Executor::ResetStats()
+{
+    lock_guard<mutex> lock(stats_mutex);
+    ExecutorStats reset;
+    reset.threads = stats.threads;
+    reset.max_queued = stats.max_queued;
+    stats = reset;
+}
+
+static mutex query_executor_mutex;
+static shared_ptr<Executor> query_executor;
+
+shared_ptr<Executor> QueryExecutor()
+{
+    lock_guard<mutex> lock(query_executor_mutex);
+    if (!query_executor)
+    {
+        query_executor = make_shared<Executor>(max(1u, thread::hardware_concurrency()), QUERY_EXECUTOR_MAX_QUEUED);
+    }
+    return query_executor;
+}
+
+void SetQueryExecutor(uint32_t num_threads, size_t max_queued)
+{
+    shared_ptr<Executor> replaced;
+    {
+        lock_guard<mutex> lock(query_executor_mutex);
+        replaced = move(query_executor);
+        query_executor = make_shared<Executor>(num_threads, max_queued);
+    }
+    // The old workers are joined off the lock, by whichever of this call and the graphs still using it is last
+    replaced.reset();
+}
+
+void PrintExecutorStats(const ExecutorStats &stats)
+{
+    cout << "Query executor: " << stats.threads << " threads, " << stats.graphs << " graphs, " << stats.tasks << " tasks, "
+         << stats.steals << " steals, " << stats.inline_runs << " run inline, " << stats.overflows << " queued past the limit, peak queue " << stats.peak_queued << "/"
+         << stats.max_queued << endl;
+    for (const auto &[kind, timings] : stats.timings)
+    {
+        cout << "  " << kind << ": " << timings.count << " tasks, " << timings.seconds << " s total, "
+             << (timings.count > 0 ? timings.seconds / timings.count * 1000 : 0) << " ms mean, "
+             << timings.max_seconds * 1000 << " ms max" << endl;
+    }
+}
@@ -0,0 +1,152 @@
+/*
+Process-wide work-stealing executor for query task graphs
+
+A parallel query is expressed as a TaskGraph: small tasks (an equality test, one product or sum of a reduction
+tree, a mask, a squash) that each run once the tasks they depend on are done. The graph fixes which operands
+every task combines, so results do not depend on the order the tasks happen to finish in.
+
+Every worker keeps its own deque of ready tasks. The tasks a worker's work makes ready go onto its own end of the
+deque and it takes its next task from there, so chains of dependent tasks stay on one core; a worker running dry
+steals from the other end of another worker's deque. The thread waiting for a graph works on it too.
+
+All queries of a process share one executor instead of starting threads of their own, so several API requests
+running at once split the cores between them rather than oversubscribing them. At most max_queued tasks wait in
+the deques; a task readied beyond that runs right away on the thread that readied it. As the tasks that one readies
+may run inline in turn, a thread already EXECUTOR_MAX_INLINE_DEPTH inline runs deep queues past the limit instead.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+const size_t QUERY_EXECUTOR_MAX_QUEUED = 1 << 16;
+// Inline runs a thread may nest before the tasks it readies are queued regardless of max_queued
+const uint32_t EXECUTOR_MAX_INLINE_DEPTH = 8;
+
+struct TaskTimings
+{
+    uint64_t count = 0;
+    double seconds = 0;
+    double max_seconds = 0;
+};
+
+struct ExecutorStats
+{
+    uint32_t threads = 0;
+    uint64_t max_queued = 0;
+    uint64_t graphs = 0;
+    uint64_t tasks = 0;
+    uint64_t steals = 0;        // tasks taken from the deque of another worker
+    uint64_t inline_runs = 0;   // tasks run by the thread readying them because max_queued tasks were waiting
+    uint64_t overflows = 0;     // tasks queued past max_queued because their thread was too deep in inline runs
+    uint64_t peak_queued = 0;
+    map<string, TaskTimings> timings; // by task kind
+};
+
+class TaskGraph
+{
+public:
+    using Node = size_t;
+
+    // Adds a task running fn once every task in deps, all added before it, has finished. Tasks of the same kind
+    // share their timings in ExecutorStats.
+    Node Add(const char *kind, function<void()> fn, const vector<Node> &deps = {});
+    size_t size() const { return tasks.size(); }
+
+private:
+    friend class Executor;
+
+    struct Task
+    {
+        const char *kind;
+        function<void()> fn;
+        vector<Node> dependents;
+        uint32_t num_deps = 0;
+        atomic<uint32_t> pending{0};
+    };
+
+    deque<Task> tasks; // never moves a task once added
+};
+
+class Executor
+{
+public:
+    Executor(uint32_t num_threads, size_t _max_queued);
+    ~Executor();
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    uint32_t Size() const { return workers.size(); }
+
+    // Runs every task of graph after its dependencies and returns once all of them are done. The first exception
+    // a task throws is rethrown here; the tasks depending on it are skipped.
+    void Run(TaskGraph &graph);
+
+    ExecutorStats Stats();
+    void ResetStats();
+
+private:
+    struct GraphRun
+    {
+        TaskGraph *graph;
+        atomic<size_t> remaining{0};
+        atomic<bool> failed{false};
+        exception_ptr error;
+        mutex run_mutex;
+        condition_variable done_cv;
+        bool done = false;
+    };
+
+    struct Item
+    {
+        GraphRun *run = nullptr;
+        TaskGraph::Node node = 0;
+    };
+
+    struct Worker
+    {
+        mutex worker_mutex;
+        deque<Item> ready;
+    };
+
+    void Push(const Item &item);
+    bool Take(uint32_t index, Item &item);
+    void Execute(const Item &item);
+    void Work(uint32_t index);
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    size_t max_queued;
+
+    atomic<size_t> queued{0};
+    atomic<uint32_t> next_worker{0};
+
+    mutex sleep_mutex;
+    condition_variable work_cv;
+    bool stop = false;
+
+    mutex stats_mutex;
+    ExecutorStats stats;
+};
+
+// Executor every query of the process runs on, created with one thread per core on first use. It is shared by
+// every Server and Squid instance of the process.
+shared_ptr<Executor> QueryExecutor();
+// Replaces it for all of them; graphs already running finish on the old one
+void SetQueryExecutor(uint32_t num_threads, size_t max_queued = QUERY_EXECUTOR_MAX_QUEUED);
+
+void PrintExecutorStats(const ExecutorStats &stats);
@@ -7,7 +7,6 @@ namespace constants
     // DEBUG PARAMETERS
 
     const int DEBUG = 0;
-    const int ALPHA = 1; // Maximum number of delete operations before the similarity query fails
     
     // BGV PARAMETERS
     const Params P131(17293, 131, 1, 431);
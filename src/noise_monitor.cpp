@@ -0,0 +1,117 @@
+#include "noise_monitor.hpp"
+
+using namespace std;
+
+void NoiseMonitor::SetThreshold(long bits)
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    stats.threshold_bits = bits;
+    stop = bits <= 0;
+    if (stop)
+    {
+        queue.clear();
+        queued.clear();
+        stats.pending = 0;
+    }
+    queue_cv.notify_all();
+}
+
+long NoiseMonitor::Threshold() const
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    return stats.threshold_bits;
+}
+
+void NoiseMonitor::Touched(uint32_t col, uint32_t row, long bit_capacity)
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    if (stats.threshold_bits <= 0)
+    {
+        return;
+    }
+    versions[{col, row}] = next_version++;
+    Queue({col, row}, bit_capacity);
+}
+
+void NoiseMonitor::Check(uint32_t col, uint32_t row, long bit_capacity)
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    if (stats.threshold_bits <= 0)
+    {
+        return;
+    }
+    Queue({col, row}, bit_capacity);
+}
+
+void NoiseMonitor::Queue(const Cell &cell, long bit_capacity)
+{
+    if (bit_capacity >= stats.threshold_bits || !queued.insert(cell).second)
+    {
+        return;
+    }
+    queue.push_back(cell);
+    stats.queued++;
+    stats.pending++;
+    queue_cv.notify_one();
+}
+
+optional<NoiseMonitor::Cell> NoiseMonitor::Next()
+{
+    unique_lock<mutex> lock(monitor_mutex);
+    queue_cv.wait(lock, [&]
+                  { return stop || !queue.empty(); });
+    if (stop)
+    {
+        return nullopt;
+    }
+
+    // Leaves the set of queued cells, so a change during the refresh can queue the cell again
+    Cell cell = queue.front();
+    queue.pop_front();
+    queued.erase(cell);
+    return cell;
+}
+
+void NoiseMonitor::Stop()
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    stop = true;
+    queue_cv.notify_all();
+}
+
+uint64_t NoiseMonitor::Version(const Cell &cell) const
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    auto found = versions.find(cell);
+    return found == versions.end() ? cleared_version : found->second;
+}
+
+void NoiseMonitor::Refreshed(bool swapped)
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    stats.pending -= min<uint64_t>(stats.pending, 1);
+    if (swapped)
+    {
+        stats.refreshed++;
+    }
+    else
+    {
+        stats.stale++;
+    }
+}
+
+void NoiseMonitor::Clear()
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    versions.clear();
+    queue.clear();
+    queued.clear();
+    stats.pending = 0;
+    cleared_version = next_version++;
+}
+
+RefreshStats NoiseMonitor::Stats() const
+{
+    lock_guard<mutex> lock(monitor_mutex);
+    return stats;
+}
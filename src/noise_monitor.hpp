@@ -0,0 +1,86 @@
+/*
+Capacity tracking for stored ciphertexts
+
+Every in-place change to a stored ciphertext (an update, a merged delta, a mask) eats into its capacity,
+the bits of modulus left above its noise. NoiseMonitor is told the capacity a ciphertext is left with after
+each change and queues those below a threshold for refresh. A refresh decrypts a copy with the secret key
+and encrypts it afresh off the query path; the cell's version tells whether it changed meanwhile, in which
+case the fresh copy is stale and dropped (the change itself will have queued the cell again if needed).
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Width in bits of one bucket of a noise histogram
+const long NOISE_HISTOGRAM_BUCKET_BITS = 16;
+
+struct RefreshStats
+{
+    long threshold_bits = 0; // ciphertexts below this capacity are queued, 0 when refresh is off
+    uint64_t queued = 0;
+    uint64_t pending = 0;    // queued and not refreshed yet
+    uint64_t refreshed = 0;
+    uint64_t stale = 0;      // refreshes dropped because the ciphertext changed meanwhile
+};
+
+// Capacity of the ciphertexts of one column, counts[b] holding those with [b, b + 1) * bucket_bits bits left
+struct NoiseHistogram
+{
+    long bucket_bits = NOISE_HISTOGRAM_BUCKET_BITS;
+    vector<uint32_t> counts;
+    long min_bits = 0;
+    long max_bits = 0;
+};
+
+class NoiseMonitor
+{
+public:
+    using Cell = pair<uint32_t, uint32_t>; // stored column, compressed row
+
+    // Turns queueing on with the given threshold, or off with 0
+    void SetThreshold(long bits);
+    long Threshold() const;
+
+    // Records a change that left cell with bit_capacity bits and queues it if that is below the threshold
+    void Touched(uint32_t col, uint32_t row, long bit_capacity);
+    // Queues cell if below the threshold, without counting as a change
+    void Check(uint32_t col, uint32_t row, long bit_capacity);
+
+    // Blocks for the next cell to refresh, nullopt once stopped
+    optional<Cell> Next();
+    void Stop();
+
+    // Changes whenever cell is touched or the cells are cleared
+    uint64_t Version(const Cell &cell) const;
+    void Refreshed(bool swapped);
+
+    // Forgets every cell, for when the stored ciphertexts are replaced or move
+    void Clear();
+
+    RefreshStats Stats() const;
+
+private:
+    void Queue(const Cell &cell, long bit_capacity);
+
+    mutable mutex monitor_mutex;
+    condition_variable queue_cv;
+    deque<Cell> queue;
+    set<Cell> queued;
+    map<Cell, uint64_t> versions;
+    uint64_t next_version = 1;
+    uint64_t cleared_version = 0;
+    bool stop = false;
+
+    RefreshStats stats;
+};
@@ -0,0 +1,133 @@
+#include "plink_file.hpp"
+
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+const uint8_t PLINK_BED_MAGIC[3] = {0x6c, 0x1b, 0x01};
+
+// Number of A1 alleles for each 2-bit code
+const uint8_t PLINK_GENOTYPE[4] = {2, 0, 1, 0};
+
+// The four genotypes packed in every possible .bed byte, so a byte is decoded with one lookup
+static const array<array<uint8_t, 4>, 256> PLINK_BYTE_GENOTYPES = []
+{
+    array<array<uint8_t, 4>, 256> table;
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            table[byte][i] = PLINK_GENOTYPE[(byte >> (2 * i)) & 3];
+        }
+    }
+    return table;
+}();
+
+static vector<string> read_lines(const string &path)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open PLINK file: " + path);
+    }
+
+    vector<string> lines;
+    string line;
+    while (getline(file, line))
+    {
+        if (line.find_first_not_of(" \t\r") != string::npos)
+        {
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+PLINKFile::PLINKFile(const string &prefix)
+{
+    num_samples = read_lines(prefix + ".fam").size();
+    bytes_per_snp = (num_samples + 3) / 4;
+
+    for (const string &line : read_lines(prefix + ".bim"))
+    {
+        istringstream fields(line);
+        string chromosome, id;
+        fields >> chromosome >> id;
+        snp_ids.push_back(id);
+    }
+
+    string bed = prefix + ".bed";
+    int fd = open(bed.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw invalid_argument("ERROR: cannot open PLINK file: " + bed);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != sizeof(PLINK_BED_MAGIC) + (uint64_t)snp_ids.size() * bytes_per_snp)
+    {
+        close(fd);
+        throw invalid_argument("ERROR: size of " + bed + " does not match " + to_string(snp_ids.size()) +
+                               " SNPs of " + to_string(num_samples) + " samples");
+    }
+    length = st.st_size;
+
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        throw runtime_error("ERROR: mmap failed for PLINK file: " + bed);
+    }
+    data = static_cast<const uint8_t *>(mapped);
+    madvise(mapped, length, MADV_SEQUENTIAL);
+
+    if (data[0] != PLINK_BED_MAGIC[0] || data[1] != PLINK_BED_MAGIC[1] || data[2] != PLINK_BED_MAGIC[2])
+    {
+        munmap(mapped, length);
+        throw invalid_argument("ERROR: " + bed + " is not a SNP-major PLINK .bed file");
+    }
+}
+
+PLINKFile::~PLINKFile()
+{
+    munmap(const_cast<uint8_t *>(data), length);
+}
+
+void PLINKFile::Decode(uint32_t snp, uint32_t first, uint32_t count, unsigned long weight, unsigned long *out) const
+{
+    if (snp >= snp_ids.size() || first + count > num_samples)
+    {
+        throw invalid_argument("ERROR: PLINK genotype out of range");
+    }
+
+    const uint8_t *bytes = data + sizeof(PLINK_BED_MAGIC) + (uint64_t)snp * bytes_per_snp;
+    uint32_t sample = first;
+    uint32_t end = first + count;
+
+    // Samples up to the first byte boundary, then whole bytes, then the rest
+    for (; sample < end && sample % 4 != 0; sample++)
+    {
+        out[sample - first] += weight * PLINK_BYTE_GENOTYPES[bytes[sample / 4]][sample % 4];
+    }
+    for (; sample + 4 <= end; sample += 4)
+    {
+        const array<uint8_t, 4> &genotypes = PLINK_BYTE_GENOTYPES[bytes[sample / 4]];
+        unsigned long *slots = out + (sample - first);
+        slots[0] += weight * genotypes[0];
+        slots[1] += weight * genotypes[1];
+        slots[2] += weight * genotypes[2];
+        slots[3] += weight * genotypes[3];
+    }
+    for (; sample < end; sample++)
+    {
+        out[sample - first] += weight * PLINK_BYTE_GENOTYPES[bytes[sample / 4]][sample % 4];
+    }
+}
@@ -0,0 +1,47 @@
+/*
+PLINK binary genotype files
+
+A fileset prefix.bed / prefix.bim / prefix.fam holds the genotypes in SNP-major order, 2 bits per sample:
+
+    bed : magic 0x6c 0x1b, mode 0x01 (SNP-major), then ceil(num_samples / 4) bytes per SNP,
+          lowest bits first, 00 = homozygous A1, 01 = missing, 10 = heterozygous, 11 = homozygous A2
+    bim : one line per SNP, its ID in the second field
+    fam : one line per sample
+
+A SNP is already a column of encrypted_db and its samples the rows, so the genotypes of one compressed row
+are a contiguous run of bytes. The .bed file is mapped read-only and decoded four genotypes per byte.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class PLINKFile
+{
+public:
+    explicit PLINKFile(const string &prefix);
+    ~PLINKFile();
+
+    PLINKFile(const PLINKFile &) = delete;
+    PLINKFile &operator=(const PLINKFile &) = delete;
+
+    uint32_t NumSNPs() const { return snp_ids.size(); }
+    uint32_t NumSamples() const { return num_samples; }
+    const vector<string> &SNPIDs() const { return snp_ids; }
+
+    // Adds weight times the genotype (number of A1 alleles, missing counting as 0) of samples
+    // [first, first + count) of snp to out[0, count)
+    void Decode(uint32_t snp, uint32_t first, uint32_t count, unsigned long weight, unsigned long *out) const;
+
+private:
+    const uint8_t *data = nullptr;
+    size_t length = 0;
+
+    uint32_t num_samples = 0;
+    uint32_t bytes_per_snp = 0;
+    vector<string> snp_ids;
+};
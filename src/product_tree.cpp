@@ -0,0 +1,128 @@
+#include "product_tree.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+using namespace std;
+
+ProductTreePlan PlanProductTree(const vector<long> &bit_capacities, long product_bits)
+{
+    if (bit_capacities.empty())
+    {
+        throw invalid_argument("ERROR: a product needs at least one operand");
+    }
+    // A step has to cost something, or equal operands would be chained instead of paired
+    product_bits = max(product_bits, 1L);
+
+    ProductTreePlan plan;
+    vector<uint32_t> depths(bit_capacities.size(), 0);
+
+    // Operands left to multiply as (-capacity, index), most capacity first and lowest index first among equals.
+    // A product takes the lower index of the two, so the last one lands in operand 0.
+    set<pair<long, uint32_t>> operands;
+    for (uint32_t i = 0; i < bit_capacities.size(); i++)
+    {
+        operands.insert(pair(-bit_capacities[i], i));
+    }
+
+    while (operands.size() > 1)
+    {
+        pair<long, uint32_t> a = *operands.begin();
+        operands.erase(operands.begin());
+        pair<long, uint32_t> b = *operands.begin();
+        operands.erase(operands.begin());
+
+        ProductStep step{min(a.second, b.second), max(a.second, b.second)};
+        plan.steps.push_back(step);
+        depths[step.into] = max(depths[a.second], depths[b.second]) + 1;
+        // b has no more capacity than a
+        operands.insert(pair(b.first + product_bits, step.into));
+    }
+    plan.depth = depths[0];
+    return plan;
+}
+
+helib::Ctxt MultiplyTree(vector<helib::Ctxt> &values, long product_bits, bool lazy_relinearize, ProductTreeStats *stats)
+{
+    auto start = chrono::steady_clock::now();
+
+    vector<long> bit_capacities;
+    for (const helib::Ctxt &value : values)
+    {
+        bit_capacities.push_back(value.bitCapacity());
+    }
+    ProductTreePlan plan = PlanProductTree(bit_capacities, product_bits);
+
+    uint32_t key_switches = 0;
+    for (const ProductStep &step : plan.steps)
+    {
+        for (uint32_t operand : {step.into, step.from})
+        {
+            if (!values[operand].inCanonicalForm())
+            {
+                values[operand].reLinearize();
+                key_switches++;
+            }
+        }
+        values[step.into].multLowLvl(values[step.from], true);
+        if (!lazy_relinearize)
+        {
+            values[step.into].reLinearize();
+            key_switches++;
+        }
+    }
+
+    if (stats != nullptr)
+    {
+        stats->operands = values.size();
+        stats->depth = plan.depth;
+        stats->multiplications = plan.steps.size();
+        stats->key_switches = key_switches;
+        stats->bit_capacity = values[0].bitCapacity();
+        stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    return values[0];
+}
+
+TaskGraph::Node AddProductTree(TaskGraph &graph, const vector<helib::Ctxt *> &values, vector<TaskGraph::Node> ready,
+                               const ProductTreePlan &plan, bool relinearize_product)
+{
+    vector<bool> multiplied(values.size(), false);
+    auto relinearize = [&](uint32_t operand)
+    {
+        helib::Ctxt *value = values[operand];
+        ready[operand] = graph.Add("relinearize", [value]
+                                   { value->reLinearize(); }, {ready[operand]});
+    };
+
+    for (const ProductStep &step : plan.steps)
+    {
+        for (uint32_t operand : {step.into, step.from})
+        {
+            if (multiplied[operand])
+            {
+                relinearize(operand);
+            }
+        }
+        helib::Ctxt *a = values[step.into];
+        helib::Ctxt *b = values[step.from];
+        ready[step.into] = graph.Add("product", [a, b]
+                                     { a->multLowLvl(*b, true); }, {ready[step.into], ready[step.from]});
+        multiplied[step.into] = true;
+    }
+
+    if (relinearize_product && multiplied[0])
+    {
+        relinearize(0);
+    }
+    return ready[0];
+}
+
+void PrintProductTreeStats(const ProductTreeStats &stats)
+{
+    cout << "Product tree: " << stats.operands << " operands, depth " << stats.depth << ", " << stats.multiplications
+         << " multiplications, " << stats.key_switches << " key switches, " << stats.bit_capacity << " bits left, "
+         << stats.seconds << " s" << endl;
+}
@@ -0,0 +1,65 @@
+/*
+Product trees for conjunctions of encrypted predicates
+
+The product of n ciphertexts takes n - 1 multiplications whatever the tree, but the shape of the tree decides how
+much capacity the product is left with. The plan multiplies the two operands with the most capacity left first and
+puts their product back among the rest, as Huffman coding does with weights combined by max instead of sum. With
+operands of equal capacity this is a balanced tree of depth ceil(log2 n), for any n; an operand that arrives with
+less capacity (a refreshed column next to an updated one, say) is multiplied in late, where it costs the least.
+
+A multiplication leaves a ciphertext with a part under s^2, which a key switch (relinearization) takes back to s.
+Only a product about to be multiplied again needs it: adding, masking and negating work on the s^2 part as they do
+on the others. The root of a tree is therefore left as it is, and its caller relinearizes once after summing the
+roots of all compressed rows, rather than once per row.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "executor.hpp"
+
+using namespace std;
+
+// One multiplication of a product tree: operand into is multiplied by operand from, which is not used afterwards
+struct ProductStep
+{
+    uint32_t into;
+    uint32_t from;
+};
+
+// Steps multiplying every operand into operand 0, each after the steps producing its operands
+struct ProductTreePlan
+{
+    vector<ProductStep> steps;
+    uint32_t depth = 0; // longest chain of multiplications from an operand to the product
+};
+
+struct ProductTreeStats
+{
+    uint32_t operands = 0;
+    uint32_t depth = 0;
+    uint32_t multiplications = 0;
+    uint32_t key_switches = 0;
+    long bit_capacity = 0; // left in the product
+    double seconds = 0;
+};
+
+// Plans the product of operands with the given capacities, a multiplication costing about product_bits bits of it
+ProductTreePlan PlanProductTree(const vector<long> &bit_capacities, long product_bits);
+
+// Multiplies values, which it consumes, along PlanProductTree. With lazy_relinearize the product is relinearized only
+// where it is multiplied again and the product returned is not; otherwise after every multiplication.
+helib::Ctxt MultiplyTree(vector<helib::Ctxt> &values, long product_bits, bool lazy_relinearize = true,
+                         ProductTreeStats *stats = nullptr);
+
+// Adds the steps of plan to graph as "product" tasks, with a "relinearize" task before each product multiplied again.
+// ready[i] is the task after which *values[i] is set; returns the task after which *values[0] holds the product,
+// relinearized only with relinearize_product.
+TaskGraph::Node AddProductTree(TaskGraph &graph, const vector<helib::Ctxt *> &values, vector<TaskGraph::Node> ready,
+                               const ProductTreePlan &plan, bool relinearize_product);
+
+void PrintProductTreeStats(const ProductTreeStats &stats);
@@ -20,7 +20,8 @@ int main()
 {
     Server server = Server(constants::P131, false);
 
-    server.SetData("./data/chr22_100samples_10SNPs.vcf");
+    IngestStats stats = server.SetData("./data/chr22_100samples_10SNPs.vcf");
+    PrintIngestStats(stats);
 
     std::cout << "Database:" << std::endl;
     server.PrintEncryptedDB(true);
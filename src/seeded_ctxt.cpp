@@ -0,0 +1,153 @@
+#include "seeded_ctxt.hpp"
+
+#include <helib/binio.h>
+#include <NTL/ZZ.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum SeededCtxtKind : uint8_t
+{
+    FULL_CTXT = 0,
+    SEEDED_CTXT = 1
+};
+
+template <typename T>
+static void write_raw(ostream &str, const T &value)
+{
+    str.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static T read_raw(istream &str)
+{
+    T value;
+    str.read(reinterpret_cast<char *>(&value), sizeof(T));
+    if (!str)
+    {
+        throw invalid_argument("ERROR: seeded ciphertext is truncated");
+    }
+    return value;
+}
+
+static helib::DoubleCRT expand_seed(const helib::Context &context, const helib::IndexSet &primes, const NTL::ZZ &seed)
+{
+    helib::DoubleCRT a(context, primes);
+    // The seed is public, so it is expanded on a stream of its own: the one the noise of every later encryption and
+    // the next fresh seed are drawn from is restored untouched when push goes out of scope
+    NTL::RandomStreamPush push;
+    a.randomize(&seed);
+    return a;
+}
+
+// Every field of a ciphertext but its parts, as Ctxt::writeTo stores them
+struct CtxtFields
+{
+    long ptxt_space;
+    NTL::xdouble noise_bound;
+    helib::IndexSet primes;
+    long int_factor;
+    NTL::xdouble rat_factor;
+    NTL::xdouble ptxt_mag;
+};
+
+static void write_fields(ostream &str, const CtxtFields &fields)
+{
+    helib::write_raw_int(str, fields.ptxt_space);
+    helib::write_raw_xdouble(str, fields.noise_bound);
+    fields.primes.writeTo(str);
+    helib::write_raw_int(str, fields.int_factor);
+    helib::write_raw_xdouble(str, fields.rat_factor);
+    helib::write_raw_xdouble(str, fields.ptxt_mag);
+}
+
+static CtxtFields read_fields(istream &str)
+{
+    CtxtFields fields;
+    fields.ptxt_space = helib::read_raw_int(str);
+    fields.noise_bound = helib::read_raw_xdouble(str);
+    fields.primes.read(str);
+    fields.int_factor = helib::read_raw_int(str);
+    fields.rat_factor = helib::read_raw_xdouble(str);
+    fields.ptxt_mag = helib::read_raw_xdouble(str);
+    if (!str)
+    {
+        throw invalid_argument("ERROR: seeded ciphertext is truncated");
+    }
+    return fields;
+}
+
+void WriteSeededCtxt(ostream &str, const helib::Ctxt &ctxt, const helib::SecKey &sk)
+{
+    if (ctxt.size() != 2 || !ctxt.inCanonicalForm())
+    {
+        write_raw(str, FULL_CTXT);
+        ctxt.writeTo(str);
+        return;
+    }
+
+    const helib::IndexSet &primes = ctxt.getPrimeSet();
+
+    unsigned char seed_bytes[CTXT_SEED_BYTES];
+    NTL::ZZ seed = NTL::RandomBits_ZZ(8 * CTXT_SEED_BYTES);
+    NTL::BytesFromZZ(seed_bytes, seed, CTXT_SEED_BYTES);
+    helib::DoubleCRT a = expand_seed(ctxt.getContext(), primes, seed);
+
+    // b' = b + (a_old - a) * s keeps b' + a * s = b + a_old * s, so the plaintext and noise are unchanged
+    helib::DoubleCRT s = sk.sKeys[0];
+    s.removePrimes(s.getIndexSet() / primes);
+    helib::DoubleCRT b = ctxt[0];
+    helib::DoubleCRT shift = ctxt[1];
+    shift -= a;
+    shift *= s;
+    b += shift;
+
+    write_raw(str, SEEDED_CTXT);
+    write_fields(str, CtxtFields{ctxt.getPtxtSpace(), ctxt.getNoiseBound(), primes, ctxt.getIntFactor(),
+                                 ctxt.getRatFactor(), ctxt.getPtxtMag()});
+    helib::CtxtPart(b, ctxt[0].skHandle).writeTo(str);
+    ctxt[1].skHandle.writeTo(str);
+    str.write(reinterpret_cast<const char *>(seed_bytes), CTXT_SEED_BYTES);
+}
+
+helib::Ctxt ReadSeededCtxt(istream &str, const helib::PubKey &pk)
+{
+    uint8_t kind = read_raw<uint8_t>(str);
+    if (kind == FULL_CTXT)
+    {
+        return helib::Ctxt::readFrom(str, pk);
+    }
+    if (kind != SEEDED_CTXT)
+    {
+        throw invalid_argument("ERROR: unknown seeded ciphertext kind " + to_string(kind));
+    }
+
+    const helib::Context &context = pk.getContext();
+    CtxtFields fields = read_fields(str);
+    helib::CtxtPart b(context, fields.primes);
+    b.read(str);
+    helib::SKHandle a_handle;
+    a_handle.read(str);
+
+    unsigned char seed_bytes[CTXT_SEED_BYTES];
+    str.read(reinterpret_cast<char *>(seed_bytes), CTXT_SEED_BYTES);
+    if (!str)
+    {
+        throw invalid_argument("ERROR: seeded ciphertext is truncated");
+    }
+    helib::CtxtPart a(expand_seed(context, fields.primes, NTL::ZZFromBytes(seed_bytes, CTXT_SEED_BYTES)), a_handle);
+
+    // Handed to Ctxt::read in the layout Ctxt::writeTo uses, so HElib still checks and sets up the ciphertext itself
+    stringstream full;
+    helib::writeEyeCatcher(full, helib::EyeCatcher::CTXT_BEGIN);
+    write_fields(full, fields);
+    helib::write_raw_int(full, 2);
+    b.writeTo(full);
+    a.writeTo(full);
+    helib::writeEyeCatcher(full, helib::EyeCatcher::CTXT_END);
+    return helib::Ctxt::readFrom(full, pk);
+}
@@ -0,0 +1,24 @@
+/*
+Seeded ciphertexts
+
+A fresh ciphertext (b, a) under the secret key s satisfies b + a * s = m + p * e. When a is expanded
+from a PRG seed instead of being stored, only b and the seed need to be kept, which halves the size
+of a stored or uploaded ciphertext. The data owner rewrites a ciphertext onto a seed with
+WriteSeededCtxt and the server expands the seed back when it reads the ciphertext.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+#include <iostream>
+
+using namespace std;
+
+const size_t CTXT_SEED_BYTES = 32;
+
+// Writes ctxt with its a part replaced by a fresh seed. Ciphertexts that are not in canonical two-part
+// form are written in full. Needs the secret key, so only the data owner can seed ciphertexts.
+void WriteSeededCtxt(ostream &str, const helib::Ctxt &ctxt, const helib::SecKey &sk);
+
+// Reads a ciphertext written by WriteSeededCtxt, expanding its a part from the seed
+helib::Ctxt ReadSeededCtxt(istream &str, const helib::PubKey &pk);
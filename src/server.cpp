@@ -1,6 +1,10 @@
 #include "server.hpp"
 #include "tools.hpp"
 
+#include <NTL/BasicThreadPool.h>
+#include <NTL/ZZ_pX.h>
+#include <unordered_map>
+
 using namespace std;
 
 // ------------------------------------------------------------------------------------------------------------------------
@@ -8,14 +12,64 @@ using namespace std;
 //                                                         HELPER FUNCTIONS
 
 // ------------------------------------------------------------------------------------------------------------------------
-helib::Ctxt AddMany(vector<helib::Ctxt> &v);
-helib::Ctxt AddManySafe(vector<helib::Ctxt> &v, const helib::PubKey &pk);
-helib::Ctxt MultiplyMany(vector<helib::Ctxt> &v);
+
+// Bounds of chunk c of count items split into num_chunks chunks of sizes differing by at most one
+static pair<size_t, size_t> chunk_bounds(size_t count, size_t num_chunks, size_t c)
+{
+    return pair(c * count / num_chunks, (c + 1) * count / num_chunks);
+}
+inline long estimateCtxtSize(const helib::Context &context, long offset);
+
+// Weight of base-3 digit d in a packed slot value
+static unsigned long digit_weight(uint32_t digit)
+{
+    unsigned long weight = 1;
+    for (uint32_t d = 0; d < digit; d++)
+    {
+        weight *= 3;
+    }
+    return weight;
+}
+
+// Genotype stored in base-3 digit d of a packed slot value
+static uint32_t packed_digit(uint32_t packed, uint32_t digit)
+{
+    return (packed / digit_weight(digit)) % 3;
+}
 
 Server::Server(const Params &_params, bool _with_similarity)
 {
     meta(_params);
+    Setup(_with_similarity);
+}
+
+Server::Server(string key_file, bool _with_similarity)
+{
+    std::ifstream file(key_file, std::ios::binary);
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open key file: " + key_file);
+    }
+    meta(file);
+    Setup(_with_similarity);
+}
+
+Server::~Server()
+{
+    if (compactor.joinable())
+    {
+        compactor.join();
+    }
+    StopMerger();
+    noise_monitor.Stop();
+    if (refresher.joinable())
+    {
+        refresher.join();
+    }
+}
 
+void Server::Setup(bool _with_similarity)
+{
     num_slots = meta.data->ea.size();
     plaintext_modulus = meta.data->context.getP();
 
@@ -25,6 +79,12 @@ Server::Server(const Params &_params, bool _with_similarity)
 
     db_set = false;
 
+    // Capacity one multiplication of fresh ciphertexts takes, which product trees are planned with
+    helib::Ctxt fresh = Encrypt(1);
+    helib::Ctxt product = fresh;
+    product.multiplyBy(fresh);
+    product_bits = fresh.bitCapacity() - product.bitCapacity();
+
     with_similarity = _with_similarity;
 
     // Can take a while to generate polynomials for comparator so we have option to skip it
@@ -36,61 +96,56 @@ Server::Server(const Params &_params, bool _with_similarity)
 
 void Server::GenData(uint32_t _num_rows, uint32_t _num_cols)
 {
+    unique_lock<recursive_mutex> view = LockShape();
+
     num_rows = _num_rows;
+    deleted_rows.clear();
+    DataReplaced();
     num_cols = _num_cols;
 
     num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
 
-    encrypted_db = vector<vector<helib::Ctxt>>();
-    for (uint32_t i = 0; i < num_cols; i++)
-    {
-        vector<helib::Ctxt> cipher_vector = vector<helib::Ctxt>();
-        for (uint32_t j = 0; j < num_compressed_rows; j++)
-        {
-            helib::Ctxt ctxt = Encrypt(0);
-
-            cipher_vector.push_back(ctxt);
-        }
-        encrypted_db.push_back(cipher_vector);
-    }
+    encrypted_db.Assign(EncryptColumns(NumStoredColumns(), 0, num_compressed_rows, [](uint32_t i, uint32_t j, vector<unsigned long> &slots) {}));
 
     db_set = true;
 }
 
 void Server::GenContinuousData(uint32_t _num_rows, uint32_t _low, uint32_t _high)
 {
+    unique_lock<recursive_mutex> view = LockShape();
+
     num_rows = _num_rows;
+    deleted_rows.clear();
+    DataReplaced();
     num_cols = 1;
 
     num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
 
-    continuous_db = vector<helib::Ctxt>();
-    for (uint32_t j = 0; j < num_compressed_rows; j++)
+    // rand() is not thread safe, so the values are drawn up front
+    vector<unsigned long> values = vector<unsigned long>((size_t)num_compressed_rows * num_slots);
+    for (unsigned long &value : values)
     {
-        helib::Ptxt<helib::BGV> ptxt(meta.data->context);
-
-        helib::Ctxt ctxt(meta.data->publicKey);
-
-        for (uint32_t i = 0; i < num_slots; i++)
-        {
-            ptxt[i] = rand() % (_high - _low + 1) + _low;
-        }
-
-        meta.data->publicKey.Encrypt(ctxt, ptxt.getPolyRepr());
-
-        continuous_db.push_back(ctxt);
+        value = rand() % (_high - _low + 1) + _low;
     }
+
+    vector<vector<helib::Ctxt>> columns = EncryptColumns(1, 0, num_compressed_rows, [&](uint32_t i, uint32_t j, vector<unsigned long> &slots)
+                                                         { copy_n(values.begin() + (size_t)j * num_slots, num_slots, slots.begin()); });
+    continuous_db = move(columns[0]);
 }
 
 void Server::GenDataDummy(uint32_t _num_rows, uint32_t _num_cols)
 {
+    unique_lock<recursive_mutex> view = LockShape();
+
     num_rows = _num_rows;
+    deleted_rows.clear();
+    DataReplaced();
     num_cols = _num_cols;
 
     num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
 
-    encrypted_db = vector<vector<helib::Ctxt>>();
-    for (uint32_t i = 0; i < num_cols; i++)
+    vector<vector<helib::Ctxt>> columns = vector<vector<helib::Ctxt>>();
+    for (uint32_t i = 0; i < NumStoredColumns(); i++)
     {
         vector<helib::Ctxt> cipher_vector = vector<helib::Ctxt>();
         for (uint32_t j = 0; j < num_compressed_rows; j++)
@@ -103,14 +158,17 @@ void Server::GenDataDummy(uint32_t _num_rows, uint32_t _num_cols)
 
             cipher_vector.push_back(ctxt);
         }
-        encrypted_db.push_back(cipher_vector);
+        columns.push_back(move(cipher_vector));
     }
+    encrypted_db.Assign(move(columns));
 
     db_set = true;
 }
 
 void Server::SetData(vector<vector<uint32_t>> &db)
 {
+    unique_lock<recursive_mutex> view = LockShape();
+
     num_cols = db.size();
     if (num_cols == 0)
     {
@@ -118,177 +176,1330 @@ void Server::SetData(vector<vector<uint32_t>> &db)
     }
 
     num_rows = db[0].size();
+    deleted_rows.clear();
+    DataReplaced();
 
     num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
 
-    encrypted_db = vector<vector<helib::Ctxt>>();
-    for (uint32_t i = 0; i < num_cols; i++)
+    auto fill = [&](uint32_t i, uint32_t j, vector<unsigned long> &slots)
     {
-        vector<helib::Ctxt> cipher_vector = vector<helib::Ctxt>();
-        for (uint32_t j = 0; j < num_compressed_rows; j++)
+        uint32_t entries_left = min(num_slots, num_rows - (j * num_slots));
+        for (uint32_t k = 0; k < entries_left; k++)
         {
-
-            vector<unsigned long> ptxt = vector<unsigned long>(num_slots, 0);
-
-            uint32_t entries_left = min(num_slots, num_rows - (j * num_slots));
-            for (uint32_t k = 0; k < entries_left; k++)
+            // SNP i * snps_per_slot + d goes into base-3 digit d of the slot
+            for (uint32_t d = 0; d < snps_per_slot && i * snps_per_slot + d < num_cols; d++)
             {
-                ptxt[k] = db[i][j * num_slots + k];
+                uint32_t value = db[i * snps_per_slot + d][j * num_slots + k];
+                if (snps_per_slot > 1 && value > 2)
+                {
+                    throw invalid_argument("ERROR: a packed DB can only hold genotypes 0, 1 and 2");
+                }
+                slots[k] += value * digit_weight(d);
             }
+        }
+    };
+    encrypted_db.Assign(EncryptColumns(NumStoredColumns(), 0, num_compressed_rows, fill));
+
+    db_set = true;
+}
 
-            helib::Ctxt ctxt = Encrypt(ptxt);
+IngestStats Server::SetData(string vcf_file)
+{
+    unique_lock<recursive_mutex> view = LockShape();
 
-            cipher_vector.push_back(ctxt);
-        }
-        encrypted_db.push_back(cipher_vector);
+    vector<vector<helib::Ctxt>> columns = vector<vector<helib::Ctxt>>();
+    vector<string> headers = vector<string>();
+
+    VCFIngest ingest(meta.data->publicKey, num_slots, snps_per_slot, thread::hardware_concurrency());
+    IngestStats stats = ingest.Run(vcf_file, [&](uint32_t col, vector<string> &&ids, vector<helib::Ctxt> &&ciphertexts)
+                                      {
+        headers.insert(headers.end(), ids.begin(), ids.end());
+        columns.push_back(move(ciphertexts)); });
+
+    if (stats.variants == 0)
+    {
+        throw invalid_argument("ERROR: DB has zero columns! THIS DOES NOT WORK!");
     }
 
+    encrypted_db.Assign(move(columns));
+    column_headers = move(headers);
+
+    num_rows = stats.samples;
+    deleted_rows.clear();
+    DataReplaced();
+    num_cols = stats.variants;
+    num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
+
     db_set = true;
+    return stats;
 }
 
-void Server::SetData(string vcf_file)
+IngestStats Server::SetDataPLINK(string bfile_prefix)
 {
-    std::ifstream file(vcf_file);
-    if (!file.is_open())
+    unique_lock<recursive_mutex> view = LockShape();
+
+    auto start = chrono::steady_clock::now();
+
+    PLINKFile plink(bfile_prefix);
+    if (plink.NumSNPs() == 0)
     {
-        std::cout << "Error opening file: " << vcf_file << std::endl;
-        return;
+        throw invalid_argument("ERROR: DB has zero columns! THIS DOES NOT WORK!");
     }
 
-    uint32_t col_counter = 0;
-    uint32_t row_counter = 0;
-    uint32_t delimiter_counter = 0;
+    num_rows = plink.NumSamples();
+    deleted_rows.clear();
+    DataReplaced();
+    num_cols = plink.NumSNPs();
+    num_compressed_rows = num_rows % num_slots == 0 ? num_rows / num_slots : (num_rows / num_slots) + 1;
 
-    std::vector<std::vector<uint32_t>> matrix;
-    std::string line;
-    while (std::getline(file, line))
+    // Every compressed row of a stored column is decoded straight out of the mapped .bed file into its slots
+    auto fill = [&](uint32_t i, uint32_t j, vector<unsigned long> &slots)
     {
-        // Skip header lines starting with "#"
-        if (line[0] == '#')
-            continue;
+        uint32_t entries_left = min(num_slots, num_rows - (j * num_slots));
+        for (uint32_t d = 0; d < snps_per_slot && i * snps_per_slot + d < num_cols; d++)
+        {
+            plink.Decode(i * snps_per_slot + d, j * num_slots, entries_left, digit_weight(d), slots.data());
+        }
+    };
+    encrypted_db.Assign(EncryptColumns(NumStoredColumns(), 0, num_compressed_rows, fill));
+    column_headers = plink.SNPIDs();
+    db_set = true;
+
+    IngestStats stats;
+    stats.variants = num_cols;
+    stats.samples = num_rows;
+    stats.ciphertexts = (uint64_t)NumStoredColumns() * num_compressed_rows;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats.variants_per_second = stats.seconds > 0 ? stats.variants / stats.seconds : 0;
+    stats.peak_rss_bytes = PeakRSSBytes();
+    return stats;
+}
 
-        std::vector<uint32_t> row;
+void Server::SetColumnHeaders(vector<string> &headers)
+{
+    column_headers = vector<string>();
+    for (uint32_t i = 0; i < headers.size(); i++)
+    {
+        column_headers.push_back(headers[i]);
+    }
+}
 
-        col_counter += 1;
+void Server::AppendRows(vector<vector<uint32_t>> &db)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+    WaitLogged(view, AppendRowsLocked(db));
+}
 
-        std::istringstream iss(line);
-        std::string token;
-        while (std::getline(iss, token, '\t'))
+uint64_t Server::AppendRowsLocked(vector<vector<uint32_t>> &db)
+{
+    if (!db_set)
+    {
+        throw invalid_argument("ERROR: there is no DB to append rows to");
+    }
+    if (db.size() != num_cols)
+    {
+        throw invalid_argument("ERROR: appended rows have " + to_string(db.size()) + " columns but the DB has " + to_string(num_cols));
+    }
+    uint32_t num_new_rows = db[0].size();
+    for (vector<uint32_t> &column : db)
+    {
+        if (column.size() != num_new_rows)
         {
-            if (delimiter_counter == 2)
-            { // When we are reading in the snp name
-                column_headers.push_back(token);
-            }
+            throw invalid_argument("ERROR: appended columns differ in length");
+        }
+    }
+    if (num_new_rows == 0)
+    {
+        return 0;
+    }
 
-            delimiter_counter += 1;
-            if (token == "1/1" || token == "1|1")
-            {
-                row.push_back(2);
-                row_counter += 1;
-            }
-            if (token == "0/1" || token == "0|1")
-            {
-                row.push_back(1);
-                row_counter += 1;
-            }
-            if (token == "1|0")
+    uint32_t first_new_row = num_rows;
+    uint32_t new_num_rows = num_rows + num_new_rows;
+    uint32_t new_num_compressed_rows = new_num_rows % num_slots == 0 ? new_num_rows / num_slots : (new_num_rows / num_slots) + 1;
+
+    // The compressed row the first new row falls in, which is the last existing one unless that one is full
+    uint32_t first_compressed_row = first_new_row / num_slots;
+
+    auto fill = [&](uint32_t i, uint32_t j, vector<unsigned long> &slots)
+    {
+        uint32_t begin = max(j * num_slots, first_new_row);
+        uint32_t end = min((j + 1) * num_slots, new_num_rows);
+        for (uint32_t r = begin; r < end; r++)
+        {
+            for (uint32_t d = 0; d < snps_per_slot && i * snps_per_slot + d < num_cols; d++)
             {
-                row.push_back(1);
-                row_counter += 1;
+                uint32_t value = db[i * snps_per_slot + d][r - first_new_row];
+                if (snps_per_slot > 1 && value > 2)
+                {
+                    throw invalid_argument("ERROR: a packed DB can only hold genotypes 0, 1 and 2");
+                }
+                slots[r - j * num_slots] += value * digit_weight(d);
             }
-            if (token == "0/0" || token == "0|0")
+        }
+    };
+    vector<vector<helib::Ctxt>> columns = EncryptColumns(NumStoredColumns(), first_compressed_row, new_num_compressed_rows, fill);
+
+    string encoded;
+    if (wal)
+    {
+        vector<const helib::Ctxt *> ctxts;
+        for (vector<helib::Ctxt> &column : columns)
+        {
+            for (helib::Ctxt &ctxt : column)
             {
-                row.push_back(0);
-                row_counter += 1;
+                ctxts.push_back(&ctxt);
             }
-            if (token == "./." || token == ".|.")
+        }
+        encoded = WriteAheadLog::Encode(WAL_APPEND, 0, num_new_rows, ctxts);
+    }
+    ApplyAppend(num_new_rows, columns);
+    return LogChange(encoded);
+}
+
+void Server::ApplyAppend(uint32_t num_new_rows, vector<vector<helib::Ctxt>> &columns)
+{
+    uint32_t new_num_rows = num_rows + num_new_rows;
+    uint32_t new_num_compressed_rows = new_num_rows % num_slots == 0 ? new_num_rows / num_slots : (new_num_rows / num_slots) + 1;
+    uint32_t first_compressed_row = num_rows / num_slots;
+
+    // Slots past the last row hold zero, so the new rows of a partly filled compressed row are simply added in
+    for (uint32_t i = 0; i < columns.size(); i++)
+    {
+        auto next = columns[i].begin();
+        if (first_compressed_row < num_compressed_rows)
+        {
+            UpdateCell(i, first_compressed_row, [&](helib::Ctxt &stored)
+                       { stored += *next; });
+            next++;
+        }
+        encrypted_db.Append(i, vector<helib::Ctxt>(make_move_iterator(next), make_move_iterator(columns[i].end())));
+    }
+
+    num_rows = new_num_rows;
+    num_compressed_rows = new_num_compressed_rows;
+    db_version++;
+}
+
+IngestStats Server::AppendVCF(string vcf_file)
+{
+    auto start = chrono::steady_clock::now();
+
+    VCFGenotypes vcf = ReadVCFGenotypes(vcf_file);
+    if (vcf.ids.size() != num_cols)
+    {
+        throw invalid_argument("ERROR: " + vcf_file + " has " + to_string(vcf.ids.size()) + " variants but the DB has " + to_string(num_cols) + " columns");
+    }
+
+    // Without headers the variants have to come in column order
+    vector<vector<uint32_t>> db = vector<vector<uint32_t>>(num_cols);
+    unordered_map<string, uint32_t> column_of;
+    for (uint32_t c = 0; c < column_headers.size(); c++)
+    {
+        column_of[column_headers[c]] = c;
+    }
+    for (uint32_t v = 0; v < vcf.ids.size(); v++)
+    {
+        uint32_t col = v;
+        if (!column_headers.empty())
+        {
+            auto found = column_of.find(vcf.ids[v]);
+            if (found == column_of.end())
             {
-                row.push_back(0);
-                row_counter += 1;
+                throw invalid_argument("ERROR: variant " + vcf.ids[v] + " of " + vcf_file + " is not a column of the DB");
             }
+            col = found->second;
+        }
+        if (!db[col].empty())
+        {
+            throw invalid_argument("ERROR: variant " + vcf.ids[v] + " appears twice in " + vcf_file);
         }
-        num_rows = row_counter;
-        row_counter = 0;
-        delimiter_counter = 0;
+        db[col] = move(vcf.genotypes[v]);
+    }
+    uint32_t first_compressed_row = num_rows / num_slots;
+    AppendRows(db);
+
+    IngestStats stats;
+    stats.variants = num_cols;
+    stats.samples = vcf.num_samples;
+    stats.ciphertexts = (uint64_t)NumStoredColumns() * (num_compressed_rows - first_compressed_row);
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats.variants_per_second = stats.seconds > 0 ? stats.variants / stats.seconds : 0;
+    stats.peak_rss_bytes = PeakRSSBytes();
+    return stats;
+}
 
-        matrix.push_back(row);
+void Server::SetPacking(uint32_t _snps_per_slot)
+{
+    if (db_set)
+    {
+        throw invalid_argument("ERROR: packing has to be set before the DB");
+    }
+    if (_snps_per_slot == 0 || digit_weight(_snps_per_slot) > plaintext_modulus)
+    {
+        throw invalid_argument("ERROR: " + to_string(_snps_per_slot) + " SNPs per slot do not fit in the plaintext modulus");
     }
-    num_cols = col_counter;
+    snps_per_slot = _snps_per_slot;
+}
 
-    SetData(matrix);
-    file.close();
+void Server::RequireUnpacked(string query)
+{
+    if (snps_per_slot > 1)
+    {
+        throw invalid_argument("ERROR: " + query + " is not supported on a packed DB");
+    }
 }
 
-void Server::SetColumnHeaders(vector<string> &headers)
+NTL::ZZX Server::PackedPolynomial(const function<long(uint32_t)> &f)
 {
-    column_headers = vector<string>();
-    for (uint32_t i = 0; i < headers.size(); i++)
+    uint32_t num_values = digit_weight(snps_per_slot);
+
+    NTL::ZZ_pPush push(NTL::conv<NTL::ZZ>((long)plaintext_modulus));
+    NTL::vec_ZZ_p x, y;
+    x.SetLength(num_values);
+    y.SetLength(num_values);
+    for (uint32_t v = 0; v < num_values; v++)
     {
-        column_headers.push_back(headers[i]);
+        x[v] = v;
+        y[v] = f(v);
     }
+
+    NTL::ZZ_pX poly;
+    NTL::interpolate(poly, x, y);
+    return NTL::conv<NTL::ZZX>(poly);
 }
 
-// Modify Operations
-void Server::UpdateOneValue(uint32_t row, uint32_t col, uint32_t value)
+helib::Ctxt Server::PackedEval(const NTL::ZZX &poly, const helib::Ctxt &packed)
 {
-    helib::Ptxt<helib::BGV> ptxt(meta.data->context);
+    helib::Ctxt result(meta.data->publicKey);
+    helib::polyEval(result, poly, packed);
+    return result;
+}
 
-    uint32_t compressed_row_index = floor(row / num_slots);
-    uint32_t row_index = row - (compressed_row_index * num_slots);
+void Server::SetEncryptionThreads(uint32_t num_threads)
+{
+    lock_guard<recursive_mutex> lock(db_mutex);
 
-    ptxt[row_index] = value;
+    uint32_t cores = max(1u, thread::hardware_concurrency());
+    num_threads = num_threads == 0 ? cores : num_threads;
 
-    helib::Ctxt ctxt(meta.data->publicKey);
+    // Cores the outer workers leave idle go to NTL's own threads inside each encryption
+    long ntl_threads = max(1u, cores / num_threads);
+    encryption_pool = make_shared<ThreadPool>(num_threads, [ntl_threads]
+                                              { NTL::SetNumThreads(ntl_threads); });
+}
 
-    meta.data->publicKey.Encrypt(ctxt, ptxt);
+void Server::SetQueryThreads(uint32_t num_threads, size_t max_queued)
+{
+    SetQueryExecutor(num_threads == 0 ? max(1u, thread::hardware_concurrency()) : num_threads, max_queued);
+}
 
-    encrypted_db[col][compressed_row_index] += ctxt;
+ExecutorStats Server::GetExecutorStats()
+{
+    return QueryExecutor()->Stats();
 }
-void Server::UpdateOneRow(uint32_t row, vector<uint32_t> &vals)
+
+shared_ptr<ThreadPool> Server::EncryptionPool()
 {
-    for (uint32_t v = 0; v < vals.size(); v++)
+    lock_guard<recursive_mutex> lock(db_mutex);
+
+    if (!encryption_pool)
+    {
+        SetEncryptionThreads(0);
+    }
+    return encryption_pool;
+}
+
+void Server::SetZeroPool(uint32_t capacity, uint32_t num_threads)
+{
+    lock_guard<recursive_mutex> lock(db_mutex);
+
+    zero_pool.reset();
+    if (capacity > 0)
+    {
+        zero_pool = make_shared<ZeroPool>(meta.data->publicKey, capacity, num_threads);
+    }
+}
+
+ZeroPoolStats Server::GetZeroPoolStats()
+{
+    shared_ptr<ZeroPool> pool;
+    {
+        lock_guard<recursive_mutex> lock(db_mutex);
+        pool = zero_pool;
+    }
+    return pool ? pool->Stats() : ZeroPoolStats();
+}
+
+void Server::SetUpdateBuffering(uint32_t _merge_interval_ms)
+{
+    StopMerger();
+    // Merged and dropped in one critical section, so an edit cannot land in a buffer that is going away
+    unique_lock<recursive_mutex> lock = LockView();
+
+    merge_interval_ms = _merge_interval_ms;
+    if (merge_interval_ms == 0)
+    {
+        delta_buffer.reset();
+        return;
+    }
+
+    if (!delta_buffer)
+    {
+        delta_buffer = make_unique<DeltaBuffer>(num_slots, plaintext_modulus);
+    }
+    merger_stop = false;
+    merger = thread(&Server::RunMerger, this);
+}
+
+void Server::MergeDeltas()
+{
+    LockView();
+}
+
+DeltaBufferStats Server::GetDeltaBufferStats()
+{
+    lock_guard<recursive_mutex> lock(db_mutex);
+    return delta_buffer ? delta_buffer->Stats() : DeltaBufferStats();
+}
+
+unique_lock<recursive_mutex> Server::LockView()
+{
+    unique_lock<recursive_mutex> lock(db_mutex);
+    if (background_error)
+    {
+        exception_ptr error = background_error;
+        background_error = nullptr;
+        rethrow_exception(error);
+    }
+    MergeDeltasLocked();
+    return lock;
+}
+
+unique_lock<recursive_mutex> Server::LockShape()
+{
+    unique_lock<recursive_mutex> view = LockView();
+    unique_lock<mutex> lock(query_mutex);
+    queries_cv.wait(lock, [&]
+                    { return active_queries == 0; });
+    return view;
+}
+
+thread_local Server::QueryView *Server::current_query = nullptr;
+
+Server::QueryView::QueryView(Server &_server) : server(_server), outer(current_query)
+{
+    if (Nested())
+    {
+        columns = outer->columns;
+    }
+    else
+    {
+        unique_lock<recursive_mutex> view = server.LockView();
+        columns = server.encrypted_db.TakeSnapshot();
+        lock_guard<mutex> lock(server.query_mutex);
+        server.active_queries++;
+    }
+    current_query = this;
+}
+
+Server::QueryView::~QueryView()
+{
+    current_query = outer;
+    if (Nested())
+    {
+        return;
+    }
+
+    // Released first, so the versions only this query could see are reclaimed before a waiting change goes ahead
+    columns.reset();
+    lock_guard<mutex> lock(server.query_mutex);
+    server.active_queries--;
+    server.queries_cv.notify_all();
+}
+
+void Server::MergeDeltasLocked()
+{
+    if (!delta_buffer)
+    {
+        return;
+    }
+    vector<PendingDelta> pending = delta_buffer->Drain();
+    if (pending.empty())
+    {
+        return;
+    }
+
+    // Deltas leave the buffer only once they are in the database, so an edit survives a failed merge and is
+    // retried by the next one
+    size_t applied = 0;
+    try
+    {
+        // One encryption per touched ciphertext, however many of its slots were edited
+        vector<helib::Ctxt> deltas = vector<helib::Ctxt>(pending.size(), helib::Ctxt(meta.data->publicKey));
+        shared_ptr<ZeroPool> pool = zero_pool;
+        EncryptionPool()->ParallelFor(pending.size(), [&](size_t i)
+                                     {
+            helib::Ptxt<helib::BGV> ptxt(meta.data->context);
+            for (uint32_t k = 0; k < num_slots; k++)
+            {
+                ptxt[k] = pending[i].slots[k];
+            }
+            if (pool)
+            {
+                deltas[i] = pool->Take();
+                deltas[i].addConstant(ptxt);
+            }
+            else
+            {
+                meta.data->publicKey.Encrypt(deltas[i], ptxt);
+            } });
+
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            UpdateCell(pending[i].col, pending[i].row, [&](helib::Ctxt &stored)
+                       { stored += deltas[i]; });
+            db_version++;
+            // Counted before it is logged, as a delta in the database must not be put back and added twice
+            applied = i + 1;
+            LogChange(WAL_ADD, pending[i].col, pending[i].row, {&deltas[i]});
+        }
+    }
+    catch (...)
+    {
+        delta_buffer->Restore(vector<PendingDelta>(make_move_iterator(pending.begin() + applied),
+                                                   make_move_iterator(pending.end())));
+        throw;
+    }
+}
+
+void Server::RunMerger()
+{
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(merger_mutex);
+            if (merger_cv.wait_for(lock, chrono::milliseconds(merge_interval_ms), [&]
+                                   { return merger_stop; }))
+            {
+                return;
+            }
+        }
+
+        lock_guard<recursive_mutex> lock(db_mutex);
+        try
+        {
+            MergeDeltasLocked();
+        }
+        catch (...)
+        {
+            if (!background_error)
+            {
+                background_error = current_exception();
+            }
+        }
+    }
+}
+
+void Server::StopMerger()
+{
+    if (!merger.joinable())
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(merger_mutex);
+        merger_stop = true;
+    }
+    merger_cv.notify_all();
+    merger.join();
+}
+
+void Server::UpdateCell(uint32_t col, uint32_t row, const function<void(helib::Ctxt &)> &fn)
+{
+    long bit_capacity = 0;
+    encrypted_db.Update(col, row, [&](helib::Ctxt &stored)
+                        {
+        fn(stored);
+        bit_capacity = stored.bitCapacity(); });
+    noise_monitor.Touched(col, row, bit_capacity);
+}
+
+void Server::SetRefreshThreshold(long min_bit_capacity)
+{
+    noise_monitor.SetThreshold(0);
+    if (refresher.joinable())
+    {
+        refresher.join();
+    }
+    if (min_bit_capacity <= 0)
+    {
+        return;
+    }
+    if (encrypted_db.ReadOnly())
+    {
+        throw invalid_argument("ERROR: a mapped database without a memory budget cannot be refreshed");
+    }
+
+    noise_monitor.SetThreshold(min_bit_capacity);
+
+    // Ciphertexts already below the threshold are queued straight away
+    {
+        unique_lock<recursive_mutex> view = LockView();
+        for (uint32_t i = 0; i < encrypted_db.size(); i++)
+        {
+            ColumnStore::ColumnRef column = encrypted_db[i];
+            for (uint32_t j = 0; j < column.size(); j++)
+            {
+                noise_monitor.Check(i, j, column[j].bitCapacity());
+            }
+        }
+    }
+
+    refresher = thread(&Server::RunRefresher, this);
+}
+
+RefreshStats Server::GetRefreshStats()
+{
+    return noise_monitor.Stats();
+}
+
+NoiseHistogram Server::GetNoiseHistogram(uint32_t col)
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    NoiseHistogram histogram;
+    ColumnStore::ColumnRef column = encrypted_db[col];
+    for (uint32_t j = 0; j < column.size(); j++)
+    {
+        long bits = max(0L, column[j].bitCapacity());
+        uint32_t bucket = bits / histogram.bucket_bits;
+        if (bucket >= histogram.counts.size())
+        {
+            histogram.counts.resize(bucket + 1, 0);
+        }
+        histogram.counts[bucket]++;
+        histogram.min_bits = j == 0 ? bits : min(histogram.min_bits, bits);
+        histogram.max_bits = max(histogram.max_bits, bits);
+    }
+    return histogram;
+}
+
+void Server::RunRefresher()
+{
+    while (optional<NoiseMonitor::Cell> cell = noise_monitor.Next())
+    {
+        try
+        {
+            uint32_t col = cell->first;
+            uint32_t row = cell->second;
+
+            // Copied under the lock, refreshed outside it, and swapped in only if nothing changed it meanwhile
+            helib::Ctxt stale(meta.data->publicKey);
+            uint64_t version;
+            {
+                lock_guard<recursive_mutex> lock(db_mutex);
+                if (col >= encrypted_db.size() || row >= num_compressed_rows)
+                {
+                    noise_monitor.Refreshed(false);
+                    continue;
+                }
+                version = noise_monitor.Version(*cell);
+                stale = encrypted_db[col][row];
+            }
+
+            helib::Ptxt<helib::BGV> ptxt(meta.data->context);
+            meta.data->secretKey.Decrypt(ptxt, stale);
+            helib::Ctxt fresh(meta.data->publicKey);
+            meta.data->publicKey.Encrypt(fresh, ptxt);
+
+            lock_guard<recursive_mutex> lock(db_mutex);
+            bool swapped = noise_monitor.Version(*cell) == version;
+            if (swapped)
+            {
+                encrypted_db.Update(col, row, [&](helib::Ctxt &stored)
+                                    { stored = move(fresh); });
+            }
+            noise_monitor.Refreshed(swapped);
+        }
+        catch (...)
+        {
+            lock_guard<recursive_mutex> lock(db_mutex);
+            if (!background_error)
+            {
+                background_error = current_exception();
+            }
+        }
+    }
+}
+
+void Server::StartCompaction()
+{
+    if (compactor.joinable())
+    {
+        if (compacting)
+        {
+            throw invalid_argument("ERROR: a compaction is already running");
+        }
+        // Done but not waited for; its outcome is replaced by the new one's
+        compactor.join();
+    }
+
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (!db_set)
+    {
+        throw invalid_argument("ERROR: DB needs to be set to compact it");
+    }
+
+    // Updates go on meanwhile, copying only the columns they change while the snapshot can see them
+    shared_ptr<const ColumnStore::Snapshot> snapshot = encrypted_db.TakeSnapshot();
+
+    compaction_stats = CompactionStats();
+    compaction_error = nullptr;
+    compacting = true;
+    compactor = thread(&Server::RunCompaction, this, db_version, num_rows, num_compressed_rows, deleted_rows, move(snapshot));
+}
+
+CompactionStats Server::WaitForCompaction()
+{
+    if (compactor.joinable())
+    {
+        compactor.join();
+    }
+    if (compaction_error)
+    {
+        exception_ptr error = compaction_error;
+        compaction_error = nullptr;
+        rethrow_exception(error);
+    }
+    return compaction_stats;
+}
+
+CompactionStats Server::Compact()
+{
+    StartCompaction();
+    return WaitForCompaction();
+}
+
+void Server::RunCompaction(uint64_t version, uint32_t snapshot_rows, uint32_t snapshot_compressed_rows,
+                           set<uint32_t> snapshot_deleted, shared_ptr<const ColumnStore::Snapshot> snapshot)
+{
+    try
+    {
+        auto start = chrono::steady_clock::now();
+
+        // New position of every live row, in the original order
+        vector<uint32_t> new_row = vector<uint32_t>(snapshot_rows, UINT32_MAX);
+        uint32_t num_live = 0;
+        for (uint32_t r = 0; r < snapshot_rows; r++)
+        {
+            if (snapshot_deleted.count(r) == 0)
+            {
+                new_row[r] = num_live++;
+            }
+        }
+
+        uint32_t num_columns = snapshot->size();
+        uint32_t old_compressed_rows = snapshot_compressed_rows;
+        uint32_t new_compressed_rows = max(1u, num_live % num_slots == 0 ? num_live / num_slots : (num_live / num_slots) + 1);
+
+        // Owner-side repacking: the slot values of the live rows are decrypted and moved in the clear, then
+        // encrypted afresh, which also leaves the compacted ciphertexts with fresh noise
+        shared_ptr<ThreadPool> pool = EncryptionPool();
+        vector<vector<unsigned long>> values = vector<vector<unsigned long>>(num_columns, vector<unsigned long>(num_live));
+        for (uint32_t i = 0; i < num_columns; i++)
+        {
+            ColumnStore::ColumnRef column = (*snapshot)[i];
+            pool->ParallelFor(old_compressed_rows, [&](size_t j)
+                              {
+                helib::Ptxt<helib::BGV> ptxt(meta.data->context);
+                meta.data->secretKey.Decrypt(ptxt, column[j]);
+                vector<helib::PolyMod> slots = ptxt.getSlotRepr();
+                for (uint32_t k = 0; k < num_slots && j * num_slots + k < snapshot_rows; k++)
+                {
+                    uint32_t r = new_row[j * num_slots + k];
+                    if (r != UINT32_MAX)
+                    {
+                        values[i][r] = (long)slots[k];
+                    }
+                } });
+        }
+        // Released before the result is published, which replaces the columns the snapshot reads
+        snapshot.reset();
+
+        auto fill = [&](uint32_t i, uint32_t j, vector<unsigned long> &slots)
+        {
+            for (uint32_t k = 0; k < num_slots && j * num_slots + k < num_live; k++)
+            {
+                slots[k] = values[i][j * num_slots + k];
+            }
+        };
+        vector<vector<helib::Ctxt>> compacted = EncryptColumns(num_columns, 0, new_compressed_rows, fill);
+
+        CompactionStats stats;
+        stats.live_rows = num_live;
+        stats.removed_rows = snapshot_rows - num_live;
+        stats.compressed_rows_before = old_compressed_rows;
+        stats.compressed_rows_after = new_compressed_rows;
+        stats.reclaimed_ciphertexts = (uint64_t)num_columns * (old_compressed_rows - min(old_compressed_rows, new_compressed_rows));
+
+        // Published in one step once the queries in flight are done, unless the DB changed since the snapshot
+        unique_lock<recursive_mutex> view = LockShape();
+        if (db_version == version)
+        {
+            encrypted_db.Assign(move(compacted));
+            num_rows = num_live;
+            num_compressed_rows = new_compressed_rows;
+            deleted_rows.clear();
+            DataReplaced();
+            stats.published = true;
+        }
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        compaction_stats = stats;
+    }
+    catch (...)
+    {
+        compaction_error = current_exception();
+    }
+    compacting = false;
+}
+
+vector<vector<helib::Ctxt>> Server::EncryptColumns(uint32_t num_columns, uint32_t first_row, uint32_t end_row,
+                                                   const function<void(uint32_t, uint32_t, vector<unsigned long> &)> &fill)
+{
+    // Pre-sized so every cell is encrypted in place by whichever worker takes it
+    uint32_t rows = end_row - first_row;
+    vector<vector<helib::Ctxt>> columns = vector<vector<helib::Ctxt>>(
+        num_columns, vector<helib::Ctxt>(rows, helib::Ctxt(meta.data->publicKey)));
+
+    EncryptionPool()->ParallelFor((size_t)num_columns * rows, [&](size_t cell)
+                                 {
+        uint32_t i = cell / rows;
+        uint32_t j = cell % rows;
+
+        vector<unsigned long> slots = vector<unsigned long>(num_slots, 0);
+        fill(i, first_row + j, slots);
+
+        helib::Ptxt<helib::BGV> ptxt(meta.data->context);
+        for (uint32_t k = 0; k < num_slots; k++)
+        {
+            ptxt[k] = slots[k];
+        }
+        meta.data->publicKey.Encrypt(columns[i][j], ptxt); });
+
+    return columns;
+}
+
+void Server::SaveKeys(string key_file)
+{
+    std::ofstream file(key_file, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+        throw invalid_argument("ERROR: cannot open key file for writing: " + key_file);
+    }
+    meta.data->writeTo(file);
+}
+
+void Server::SaveDB(string db_file, bool seeded)
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (!db_set)
+    {
+        throw invalid_argument("ERROR: DB needs to be set to be saved");
+    }
+
+    DBFileHeader header;
+    header.num_slots = num_slots;
+    header.num_rows = num_rows;
+    header.deleted_rows = vector<uint32_t>(deleted_rows.begin(), deleted_rows.end());
+    header.num_cols = encrypted_db.size();
+    header.num_compressed_rows = encrypted_db.empty() ? 0 : num_compressed_rows;
+    header.num_continuous = continuous_db.size();
+    header.snps_per_slot = snps_per_slot;
+    header.num_snps = num_cols;
+    header.wal_lsn = wal ? wal->LastLSN() : 0;
+
+    DBFileWriter writer(db_file, header, column_headers, seeded ? &meta.data->secretKey : nullptr);
+    encrypted_db.WriteTo(writer);
+    for (const helib::Ctxt &ctxt : continuous_db)
+    {
+        writer.Write(ctxt);
+    }
+    writer.Finish();
+}
+
+DBLoadStats Server::LoadDB(string db_file)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+
+    DBFileHeader header;
+    vector<vector<helib::Ctxt>> columns;
+    DBLoadStats stats = ReadDBFile(db_file, meta.data->publicKey, num_slots, header,
+                                   columns, continuous_db, column_headers);
+    encrypted_db.Assign(move(columns));
+
+    num_rows = header.num_rows;
+    num_cols = header.num_snps;
+    snps_per_slot = header.snps_per_slot;
+    num_compressed_rows = header.num_cols > 0 ? header.num_compressed_rows : header.num_continuous;
+    deleted_rows = set<uint32_t>(header.deleted_rows.begin(), header.deleted_rows.end());
+    loaded_wal_lsn = header.wal_lsn;
+    DataReplaced();
+
+    db_set = true;
+    return stats;
+}
+
+DBLoadStats Server::MapDB(string db_file)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+
+    auto start = chrono::steady_clock::now();
+
+    const DBFileMapping &mapping = encrypted_db.Map(db_file, meta.data->publicKey, num_slots);
+    const DBFileHeader &header = mapping.Header();
+
+    column_headers = mapping.ColumnHeaders();
+
+    // The continuous column is small and only used by range queries, so it stays resident
+    continuous_db = vector<helib::Ctxt>();
+    continuous_db.reserve(header.num_continuous);
+    uint64_t continuous_start = (uint64_t)header.num_cols * header.num_compressed_rows;
+    for (uint32_t j = 0; j < header.num_continuous; j++)
+    {
+        continuous_db.push_back(mapping.ReadRecord(continuous_start + j, meta.data->publicKey));
+    }
+
+    num_rows = header.num_rows;
+    num_cols = header.num_snps;
+    snps_per_slot = header.snps_per_slot;
+    num_compressed_rows = header.num_cols > 0 ? header.num_compressed_rows : header.num_continuous;
+    deleted_rows = set<uint32_t>(header.deleted_rows.begin(), header.deleted_rows.end());
+    loaded_wal_lsn = header.wal_lsn;
+    DataReplaced();
+
+    db_set = true;
+
+    DBLoadStats stats;
+    stats.bytes_read = mapping.MappedBytes();
+    stats.num_ciphertexts = header.num_continuous;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+IngestStats Server::IngestVCF(string vcf_file, string db_file, uint32_t num_threads)
+{
+    // The column headers precede the records in the file, so the variant IDs are read in a first pass
+    VCFSummary summary = ScanVCF(vcf_file, num_threads);
+
+    DBFileHeader header;
+    header.num_slots = num_slots;
+    header.num_rows = summary.num_samples;
+    header.num_cols = (summary.ids.size() + snps_per_slot - 1) / snps_per_slot;
+    header.num_compressed_rows = (summary.num_samples + num_slots - 1) / num_slots;
+    header.snps_per_slot = snps_per_slot;
+    header.num_snps = summary.ids.size();
+
+    DBFileWriter writer(db_file, header, summary.ids);
+    VCFIngest ingest(meta.data->publicKey, num_slots, snps_per_slot, num_threads);
+    IngestStats stats = ingest.Run(vcf_file, [&](uint32_t col, vector<string> &&ids, vector<helib::Ctxt> &&ciphertexts)
+                                      {
+        for (const helib::Ctxt &ctxt : ciphertexts)
+        {
+            writer.Write(ctxt);
+        } });
+    writer.Finish();
+    return stats;
+}
+
+void Server::EnableWAL(string wal_file, string checkpoint_file, uint32_t group_commit_ms, uint64_t _checkpoint_bytes)
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (!db_set)
+    {
+        throw invalid_argument("ERROR: DB needs to be set to log changes to it");
+    }
+    if (wal)
+    {
+        throw invalid_argument("ERROR: a write-ahead log is already open");
+    }
+
+    // Whatever an old log at wal_file holds does not apply to the new checkpoint
+    remove(wal_file.c_str());
+    wal = make_shared<WriteAheadLog>(wal_file, 0, group_commit_ms);
+    checkpoint_path = checkpoint_file;
+    checkpoint_bytes = _checkpoint_bytes;
+    Checkpoint();
+}
+
+WALReplayStats Server::Recover(string wal_file, string checkpoint_file, uint32_t group_commit_ms, uint64_t _checkpoint_bytes)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+
+    if (wal)
+    {
+        throw invalid_argument("ERROR: a write-ahead log is already open");
+    }
+
+    // Nothing is logged while the log is replayed, since the log is not open yet
+    LoadDB(checkpoint_file);
+    WALReplayStats stats = ReplayWAL(wal_file, meta.data->publicKey, loaded_wal_lsn, [&](WALRecord &record)
+                                     { ApplyWALRecord(record); });
+
+    wal = make_shared<WriteAheadLog>(wal_file, stats.last_lsn, group_commit_ms);
+    checkpoint_path = checkpoint_file;
+    checkpoint_bytes = _checkpoint_bytes;
+    return stats;
+}
+
+void Server::Checkpoint()
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (!wal)
+    {
+        throw invalid_argument("ERROR: there is no write-ahead log to checkpoint");
+    }
+
+    // Written beside the last checkpoint and renamed over it, so a crash always leaves one whole checkpoint.
+    // A crash before the log is emptied is harmless too, as the checkpoint records the last record it includes.
+    string tmp_file = checkpoint_path + ".tmp";
+    SaveDB(tmp_file);
+    PublishFile(tmp_file, checkpoint_path);
+    wal->Truncate();
+    checkpoint_pending = false;
+}
+
+void Server::DisableWAL()
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (wal)
+    {
+        wal->Sync();
+    }
+    wal.reset();
+    checkpoint_pending = false;
+}
+
+void Server::SyncWAL()
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (wal)
+    {
+        wal->Sync();
+    }
+}
+
+WALStats Server::GetWALStats()
+{
+    lock_guard<recursive_mutex> lock(db_mutex);
+    return wal ? wal->Stats() : WALStats();
+}
+
+void Server::DataReplaced()
+{
+    db_version++;
+    noise_monitor.Clear();
+    checkpoint_pending = wal != nullptr;
+}
+
+uint64_t Server::LogChange(WALRecordType type, uint32_t col, uint32_t row, const vector<const helib::Ctxt *> &ctxts)
+{
+    if (!wal)
+    {
+        return 0;
+    }
+    return LogChange(WriteAheadLog::Encode(type, col, row, ctxts));
+}
+
+uint64_t Server::LogChange(const string &encoded)
+{
+    if (!wal)
+    {
+        return 0;
+    }
+
+    // Once the DB was replaced the log no longer applies to the checkpoint, so the change is made durable by a
+    // new checkpoint instead, which includes it
+    uint64_t lsn = 0;
+    if (!checkpoint_pending)
+    {
+        lsn = wal->Append(encoded);
+    }
+    if (checkpoint_pending || wal->Bytes() >= checkpoint_bytes)
+    {
+        Checkpoint();
+    }
+    return lsn;
+}
+
+void Server::WaitLogged(unique_lock<recursive_mutex> &lock, uint64_t lsn)
+{
+    shared_ptr<WriteAheadLog> log = wal;
+    lock.unlock();
+    if (log && lsn > 0)
+    {
+        log->WaitDurable(lsn);
+    }
+}
+
+void Server::ApplyWALRecord(WALRecord &record)
+{
+    // A record that does not fit the DB means the log belongs to another checkpoint
+    string mismatch = "ERROR: write-ahead log record " + to_string(record.lsn) + " does not fit the checkpoint";
+
+    uint32_t num_columns = NumStoredColumns();
+    vector<vector<helib::Ctxt>> columns = vector<vector<helib::Ctxt>>(num_columns);
+    if (record.type == WAL_APPEND || record.type == WAL_REUSE)
+    {
+        if (num_columns == 0 || record.ctxts.empty() || record.ctxts.size() % num_columns != 0)
+        {
+            throw invalid_argument(mismatch);
+        }
+        size_t per_column = record.ctxts.size() / num_columns;
+        for (size_t k = 0; k < record.ctxts.size(); k++)
+        {
+            columns[k / per_column].push_back(move(record.ctxts[k]));
+        }
+    }
+
+    switch (record.type)
+    {
+    case WAL_ADD:
+        if (record.col >= num_columns || record.row >= num_compressed_rows || record.ctxts.size() != 1)
+        {
+            throw invalid_argument(mismatch);
+        }
+        UpdateCell(record.col, record.row, [&](helib::Ctxt &stored)
+                   { stored += record.ctxts[0]; });
+        db_version++;
+        break;
+    case WAL_APPEND:
+    {
+        uint32_t new_num_rows = num_rows + record.row;
+        uint32_t new_num_compressed_rows = new_num_rows % num_slots == 0 ? new_num_rows / num_slots : (new_num_rows / num_slots) + 1;
+        if (columns[0].size() != new_num_compressed_rows - num_rows / num_slots)
+        {
+            throw invalid_argument(mismatch);
+        }
+        ApplyAppend(record.row, columns);
+        break;
+    }
+    case WAL_REUSE:
+        if (deleted_rows.count(record.row) == 0 || columns[0].size() != 1)
+        {
+            throw invalid_argument(mismatch);
+        }
+        ApplyReuse(record.row, columns);
+        break;
+    case WAL_DELETE:
+        if (record.row >= num_rows)
+        {
+            throw invalid_argument(mismatch);
+        }
+        deleted_rows.insert(record.row);
+        db_version++;
+        break;
+    default:
+        throw invalid_argument("ERROR: unknown write-ahead log record type " + to_string(record.type));
+    }
+}
+
+void Server::SetMemoryBudget(uint64_t memory_budget, string spill_file)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+
+    encrypted_db.SetMemoryBudget(memory_budget, estimateCtxtSize(meta.data->context, 0), spill_file, meta.data->publicKey);
+}
+
+void Server::SetCompression(uint32_t hot_columns)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+
+    encrypted_db.SetCompression(hot_columns, estimateCtxtSize(meta.data->context, 0), meta.data->publicKey);
+}
+
+ColumnCacheStats Server::GetCacheStats()
+{
+    return encrypted_db.CacheStats();
+}
+
+void Server::SetPrefetchDepth(uint32_t depth)
+{
+    prefetch_depth = depth;
+}
+
+// Modify Operations
+void Server::UpdateOneValue(uint32_t row, uint32_t col, uint32_t value)
+{
+    uint32_t compressed_row_index = floor(row / num_slots);
+    uint32_t row_index = row - (compressed_row_index * num_slots);
+
+    // Slots past the last row have to stay zero for AppendRows
+    if (row >= num_rows || col >= num_cols)
+    {
+        throw out_of_range("ERROR: cell (" + to_string(row) + ", " + to_string(col) + ") is out of range");
+    }
+    if (snps_per_slot > 1 && value > 2)
+    {
+        throw invalid_argument("ERROR: a packed DB can only hold genotypes 0, 1 and 2");
+    }
+
+    // Copied under the lock, as SetZeroPool may replace the pool while this update waits on it
+    shared_ptr<ZeroPool> pool;
+    {
+        lock_guard<recursive_mutex> lock(db_mutex);
+        pool = zero_pool;
+        if (delta_buffer)
+        {
+            delta_buffer->Add(PackedColumn(col), compressed_row_index, row_index,
+                              value * digit_weight(col % snps_per_slot));
+            return;
+        }
+    }
+
+    helib::Ptxt<helib::BGV> ptxt(meta.data->context);
+    ptxt[row_index] = value * digit_weight(col % snps_per_slot);
+
+    if (!pool)
+    {
+        helib::Ctxt ctxt(meta.data->publicKey);
+
+        meta.data->publicKey.Encrypt(ctxt, ptxt);
+
+        unique_lock<recursive_mutex> lock(db_mutex);
+        UpdateCell(PackedColumn(col), compressed_row_index, [&](helib::Ctxt &stored)
+                   { stored += ctxt; });
+        db_version++;
+        WaitLogged(lock, LogChange(WAL_ADD, PackedColumn(col), compressed_row_index, {&ctxt}));
+        return;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    // A fresh encryption of zero plus the delta is as fresh as encrypting the delta itself
+    helib::Ctxt ctxt = pool->Take();
+    ctxt.addConstant(ptxt);
+
+    unique_lock<recursive_mutex> lock(db_mutex);
+    UpdateCell(PackedColumn(col), compressed_row_index, [&](helib::Ctxt &stored)
+               { stored += ctxt; });
+    db_version++;
+    uint64_t lsn = LogChange(WAL_ADD, PackedColumn(col), compressed_row_index, {&ctxt});
+    // Taken before the wait for the log, which is no part of the encryption the pool stands in for
+    pool->RecordLatency(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    WaitLogged(lock, lsn);
+}
+void Server::UpdateOneRow(uint32_t row, vector<uint32_t> &vals)
+{
+    for (uint32_t v = 0; v < vals.size(); v++)
+    {
+        UpdateOneValue(row, v, vals[v]);
+    }
+}
+uint32_t Server::InsertOneRow(vector<uint32_t> &vals)
+{
+    unique_lock<recursive_mutex> view = LockShape();
+
+    if (deleted_rows.empty())
+    {
+        vector<vector<uint32_t>> row = vector<vector<uint32_t>>(vals.size());
+        for (uint32_t v = 0; v < vals.size(); v++)
+        {
+            row[v].push_back(vals[v]);
+        }
+        uint64_t lsn = AppendRowsLocked(row);
+        uint32_t inserted = num_rows - 1;
+        WaitLogged(view, lsn);
+        return inserted;
+    }
+
+    if (vals.size() != num_cols)
+    {
+        throw invalid_argument("ERROR: inserted row has " + to_string(vals.size()) + " columns but the DB has " + to_string(num_cols));
+    }
+
+    // The slot of a deleted row still holds its old values, so it is cleared with a plaintext mask before the
+    // new ones are added
+    uint32_t row = *deleted_rows.begin();
+    uint32_t compressed_row_index = row / num_slots;
+    uint32_t row_index = row % num_slots;
+
+    auto fill = [&](uint32_t i, uint32_t j, vector<unsigned long> &slots)
+    {
+        for (uint32_t d = 0; d < snps_per_slot && i * snps_per_slot + d < num_cols; d++)
+        {
+            uint32_t value = vals[i * snps_per_slot + d];
+            if (snps_per_slot > 1 && value > 2)
+            {
+                throw invalid_argument("ERROR: a packed DB can only hold genotypes 0, 1 and 2");
+            }
+            slots[row_index] += value * digit_weight(d);
+        }
+    };
+    vector<vector<helib::Ctxt>> values = EncryptColumns(NumStoredColumns(), compressed_row_index, compressed_row_index + 1, fill);
+
+    ApplyReuse(row, values);
+
+    vector<const helib::Ctxt *> ctxts;
+    for (vector<helib::Ctxt> &value : values)
+    {
+        ctxts.push_back(&value[0]);
+    }
+    WaitLogged(view, LogChange(WAL_REUSE, 0, row, ctxts));
+    return row;
+}
+
+void Server::ApplyReuse(uint32_t row, const vector<vector<helib::Ctxt>> &values)
+{
+    uint32_t compressed_row_index = row / num_slots;
+    uint32_t row_index = row % num_slots;
+
+    helib::Ptxt<helib::BGV> mask(meta.data->context);
+    for (uint32_t i = 0; i < num_slots; i++)
     {
-        UpdateOneValue(row, v, vals[v]);
+        mask[i] = i == row_index ? 0 : 1;
     }
-}
-void Server::InsertOneRow(vector<uint32_t> &vals)
-{
-    uint32_t new_row = num_rows + 1;
-    for (uint32_t v = 0; v < vals.size(); v++)
+    for (uint32_t i = 0; i < values.size(); i++)
     {
-        UpdateOneValue(new_row, v, vals[v]);
+        UpdateCell(i, compressed_row_index, [&](helib::Ctxt &stored)
+                   {
+            stored.multByConstant(mask);
+            stored += values[i][0]; });
     }
+
+    deleted_rows.erase(row);
+    db_version++;
 }
 void Server::DeleteRowAddition(uint32_t row)
 {
-    for (uint32_t v = 0; v < num_cols; v++)
-    {
-        UpdateOneValue(row, v, 0);
-    }
+    DeleteRow(row);
 }
 void Server::DeleteRowMultiplication(uint32_t row)
 {
-    helib::Ptxt<helib::BGV> mask(meta.data->context);
-    for (uint32_t i = 0; i < num_slots; i++)
-    {
-        mask[i] = 1;
-    }
-
-    uint32_t compressed_row_index = floor(row / num_slots);
-    uint32_t row_index = row - (compressed_row_index * num_slots);
-
-    mask[row_index] = 0;
+    DeleteRow(row);
+}
+void Server::DeleteRow(uint32_t row)
+{
+    unique_lock<recursive_mutex> view = LockShape();
 
-    for (uint32_t c = 0; c < num_cols; c++)
+    if (row >= num_rows)
     {
-        encrypted_db[c][compressed_row_index].multByConstant(mask);
+        throw out_of_range("ERROR: row " + to_string(row) + " is out of range");
     }
-
-    num_deletes += 1;
+    deleted_rows.insert(row);
+    db_version++;
+    WaitLogged(view, LogChange(WAL_DELETE, 0, row, {}));
 }
 
 helib::Ctxt Server::CountQuery(bool conjunctive, vector<pair<uint32_t, uint32_t>> &query)
 {
+    QueryView view(*this);
+
     if (!db_set)
     {
         throw invalid_argument("ERROR: DB needs to be set to run query");
@@ -303,7 +1514,7 @@ helib::Ctxt Server::CountQuery(bool conjunctive, vector<pair<uint32_t, uint32_t>
     {
         for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            helib::Ctxt temp = MultiplyMany(cols[j]);
+            helib::Ctxt temp = MultiplyTree(cols[j], product_bits);
             filter_results.push_back(temp);
         }
     }
@@ -318,7 +1529,7 @@ helib::Ctxt Server::CountQuery(bool conjunctive, vector<pair<uint32_t, uint32_t>
         }
         for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            helib::Ctxt temp = MultiplyMany(cols[j]);
+            helib::Ctxt temp = MultiplyTree(cols[j], product_bits);
             filter_results.push_back(temp);
         }
         for (uint32_t j = 0; j < num_compressed_rows; j++)
@@ -332,65 +1543,85 @@ helib::Ctxt Server::CountQuery(bool conjunctive, vector<pair<uint32_t, uint32_t>
         print_vector(Decrypt(filter_results[0]));
     }
     MaskWithNumRows(filter_results);
-    helib::Ctxt result = AddManySafe(filter_results, meta.data->publicKey);
+    helib::Ctxt result = SumMany(filter_results, meta.data->publicKey);
+    // The products are summed as they come out of their trees and the sum relinearized once for the rotations
+    result.reLinearize();
     result = SquashCtxtLogTime(result);
     return result;
 }
 
-void process_iteration_filter(std::vector<std::vector<helib::Ctxt>> &encrypted_db,
-                              std::vector<helib::Ctxt> &predicates,
-                              vector<pair<uint32_t, uint32_t>> &query,
-                              Server *server_instance,
-                              size_t start_idx,
-                              size_t end_idx,
-                              std::mutex &predicates_mutex)
+void Server::AddFilterTasks(TaskGraph &graph, const ColumnStore::Snapshot &db, vector<pair<uint32_t, uint32_t>> &query,
+                            FilterTasks &filter, bool relinearize)
 {
-    std::vector<helib::Ctxt> equality_vectors;
+    if (!db_set)
+    {
+        throw invalid_argument("ERROR: DB needs to be set to run query");
+    }
+    if (query.empty())
+    {
+        throw invalid_argument("ERROR: query needs at least one predicate");
+    }
 
-    for (size_t i = start_idx; i < end_idx; i++)
+    for (pair<uint32_t, uint32_t> predicate : query)
     {
-        pair<uint32_t, uint32_t> column = query[i];
-        equality_vectors.push_back(server_instance->EQTest(column.second, encrypted_db[column.first][0]));
+        filter.columns.push_back(db[predicate.first]);
     }
-    helib::Ctxt predicate = MultiplyMany(equality_vectors);
+    filter.equalities.assign(num_compressed_rows, vector<helib::Ctxt>(query.size(), helib::Ctxt(meta.data->publicKey)));
 
-    std::lock_guard<std::mutex> lock(predicates_mutex);
-    predicates.push_back(predicate);
+    for (uint32_t row = 0; row < num_compressed_rows; row++)
+    {
+        vector<helib::Ctxt *> values;
+        vector<TaskGraph::Node> tests;
+        // Every equality test takes the same toll, so the tests rank by capacity as the stored ciphertexts do
+        vector<long> bit_capacities;
+        for (size_t k = 0; k < query.size(); k++)
+        {
+            helib::Ctxt *equality = &filter.equalities[row][k];
+            values.push_back(equality);
+            tests.push_back(graph.Add("eqtest", [this, equality, &filter, &query, row, k]
+                                      { *equality = EQTest(query[k].second, filter.columns[k][row]); }));
+            bit_capacities.push_back(filter.columns[k][row].bitCapacity());
+        }
+        TaskGraph::Node product = AddProductTree(graph, values, tests, PlanProductTree(bit_capacities, product_bits),
+                                                 relinearize);
+        filter.masked.push_back(graph.Add("mask", [this, &filter, row]
+                                          { MaskRow(filter.equalities[row][0], row); }, {product}));
+    }
 }
 
-helib::Ctxt Server::CountQueryP(vector<pair<uint32_t, uint32_t>> &query, uint32_t num_threads)
+helib::Ctxt Server::CountQueryP(vector<pair<uint32_t, uint32_t>> &query)
 {
-    uint32_t t = num_threads; // You can set this value based on the number of available cores or your requirements
-
-    size_t chunk_size = query.size() / t;
+    QueryView view(*this);
 
-    std::vector<std::thread> threads;
+    RequireUnpacked("CountQueryP");
 
-    std::mutex predicates_mutex;
+    TaskGraph graph;
+    FilterTasks filter;
+    AddFilterTasks(graph, view.Columns(), query, filter);
 
-    vector<helib::Ctxt> predicates = vector<helib::Ctxt>();
-    predicates.reserve(query.size());
-
-    for (size_t i = 0; i < t; i++)
+    vector<helib::Ctxt *> predicates;
+    for (vector<helib::Ctxt> &row : filter.equalities)
     {
-        size_t start_idx = i * chunk_size;
-        size_t end_idx = (i == t - 1) ? query.size() : (i + 1) * chunk_size;
-
-        threads.emplace_back(process_iteration_filter, std::ref(encrypted_db),
-                             std::ref(predicates), std::ref(query), this,
-                             start_idx, end_idx, std::ref(predicates_mutex));
+        predicates.push_back(&row[0]);
     }
+    TaskGraph::Node total = AddSumTree(graph, predicates, filter.masked);
+    // The products of the rows are summed as they are and relinearized once, for the rotations
+    total = graph.Add("relinearize", [&]
+                      { predicates[0]->reLinearize(); }, {total});
 
-    for (auto &thread : threads)
-    {
-        thread.join();
-    }
-    helib::Ctxt predicate = MultiplyMany(predicates);
-    return SquashCtxtLogTime(predicate);
+    // Rows are summed before the one squash, which then counts over every row at once
+    helib::Ctxt count(meta.data->publicKey);
+    graph.Add("squash", [&]
+              { count = SquashCtxtLogTime(*predicates[0]); }, {total});
+
+    QueryExecutor()->Run(graph);
+    return count;
 }
 
 helib::Ctxt Server::MAFQuery(uint32_t snp, bool conjunctive, vector<pair<uint32_t, uint32_t>> &query)
 {
+    QueryView view(*this);
+
     vector<vector<helib::Ctxt>> cols = filter(query);
     uint32_t num_columns = cols[0].size();
 
@@ -399,7 +1630,7 @@ helib::Ctxt Server::MAFQuery(uint32_t snp, bool conjunctive, vector<pair<uint32_
     {
         for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            helib::Ctxt temp = MultiplyMany(cols[j]);
+            helib::Ctxt temp = MultiplyTree(cols[j], product_bits);
             filter_results.push_back(temp);
         }
     }
@@ -414,7 +1645,7 @@ helib::Ctxt Server::MAFQuery(uint32_t snp, bool conjunctive, vector<pair<uint32_
         }
         for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            helib::Ctxt temp = MultiplyMany(cols[j]);
+            helib::Ctxt temp = MultiplyTree(cols[j], product_bits);
             filter_results.push_back(temp);
         }
         for (uint32_t j = 0; j < num_compressed_rows; j++)
@@ -423,18 +1654,32 @@ helib::Ctxt Server::MAFQuery(uint32_t snp, bool conjunctive, vector<pair<uint32_
         }
     }
     MaskWithNumRows(filter_results);
+    // Multiplying them by the SNPs needs the predicates relinearized, the products with the SNPs only once summed
+    for (helib::Ctxt &predicate : filter_results)
+    {
+        predicate.reLinearize();
+    }
 
     vector<helib::Ctxt> indv_MAF = vector<helib::Ctxt>();
+    ColumnStore::ColumnRef snp_column = view[PackedColumn(snp)];
+
+    NTL::ZZX genotype;
+    if (snps_per_slot > 1)
+    {
+        genotype = PackedPolynomial([&](uint32_t v)
+                                    { return (long)packed_digit(v, snp % snps_per_slot); });
+    }
 
     for (uint32_t i = 0; i < num_compressed_rows; i++)
     {
-        helib::Ctxt clone = encrypted_db[snp][i];
-        clone *= filter_results[i];
+        helib::Ctxt clone = snps_per_slot > 1 ? PackedEval(genotype, snp_column[i]) : snp_column[i];
+        clone.multLowLvl(filter_results[i]);
         indv_MAF.push_back(clone);
     }
 
-    helib::Ctxt freq = AddManySafe(indv_MAF, meta.data->publicKey);
-    helib::Ctxt number_of_patients = AddManySafe(filter_results, meta.data->publicKey);
+    helib::Ctxt freq = SumMany(indv_MAF, meta.data->publicKey);
+    freq.reLinearize();
+    helib::Ctxt number_of_patients = SumMany(filter_results, meta.data->publicKey);
 
     freq = SquashCtxtWithMask(freq, 0);
     number_of_patients = SquashCtxtWithMask(number_of_patients, 1);
@@ -446,130 +1691,164 @@ helib::Ctxt Server::MAFQuery(uint32_t snp, bool conjunctive, vector<pair<uint32_
     return freq;
 }
 
-helib::Ctxt Server::MAFQueryP(uint32_t snp, vector<pair<uint32_t, uint32_t>> &query, uint32_t num_threads)
+helib::Ctxt Server::MAFQueryP(uint32_t snp, vector<pair<uint32_t, uint32_t>> &query)
 {
-    uint32_t t = num_threads; // You can set this value based on the number of available cores or your requirements
-
-    size_t chunk_size = query.size() / t;
-
-    std::vector<std::thread> threads;
-
-    std::mutex predicates_mutex;
-
-    vector<helib::Ctxt> predicates = vector<helib::Ctxt>();
-    predicates.reserve(query.size());
-
-    for (size_t i = 0; i < t; i++)
-    {
-        size_t start_idx = i * chunk_size;
-        size_t end_idx = (i == t - 1) ? query.size() : (i + 1) * chunk_size;
-
-        threads.emplace_back(process_iteration_filter, std::ref(encrypted_db),
-                             std::ref(predicates), std::ref(query), this,
-                             start_idx, end_idx, std::ref(predicates_mutex));
-    }
-
-    for (auto &thread : threads)
-    {
-        thread.join();
-    }
-    helib::Ctxt predicate = MultiplyMany(predicates);
-
-    helib::Ctxt freq = encrypted_db[snp][0];
-    freq *= predicate;
-
-    freq = SquashCtxtWithMask(freq, 0);
-    helib::Ctxt number_of_patients = SquashCtxtWithMask(predicate, 1);
+    QueryView view(*this);
+
+    RequireUnpacked("MAFQueryP");
+
+    TaskGraph graph;
+    FilterTasks filter;
+    AddFilterTasks(graph, view.Columns(), query, filter, true);
+
+    ColumnStore::ColumnRef snp_column = view[snp];
+    vector<helib::Ctxt> indv_MAF(num_compressed_rows, helib::Ctxt(meta.data->publicKey));
+    vector<helib::Ctxt *> freqs;
+    vector<helib::Ctxt *> predicates;
+    vector<TaskGraph::Node> weighted;
+    for (uint32_t row = 0; row < num_compressed_rows; row++)
+    {
+        freqs.push_back(&indv_MAF[row]);
+        predicates.push_back(&filter.equalities[row][0]);
+        weighted.push_back(graph.Add("multiply", [&, row]
+                                     {
+            indv_MAF[row] = snp_column[row];
+            indv_MAF[row].multLowLvl(filter.equalities[row][0]); }, {filter.masked[row]}));
+    }
+    TaskGraph::Node freq_total = AddSumTree(graph, freqs, weighted);
+    freq_total = graph.Add("relinearize", [&]
+                           { freqs[0]->reLinearize(); }, {freq_total});
+    // The patient count sums the predicates in place, so it waits for the products reading them
+    TaskGraph::Node count_total = AddSumTree(graph, predicates, weighted);
+
+    helib::Ctxt freq(meta.data->publicKey);
+    helib::Ctxt number_of_patients(meta.data->publicKey);
+    graph.Add("squash", [&]
+              { freq = SquashCtxtWithMask(*freqs[0], 0); }, {freq_total});
+    graph.Add("squash", [&]
+              { number_of_patients = SquashCtxtWithMask(*predicates[0], 1); }, {count_total});
+
+    QueryExecutor()->Run(graph);
 
     number_of_patients.multByConstant(NTL::ZZX(2));
 
-
     freq += number_of_patients;
     return freq;
 }
 
 vector<helib::Ctxt> Server::PRSQuery(vector<pair<uint32_t, int32_t>> &prs_params)
 {
-    vector<helib::Ctxt> scores;
+    QueryView view(*this);
 
-    for (uint32_t j = 0; j < num_compressed_rows; j++)
+    vector<helib::Ctxt> scores = vector<helib::Ctxt>(num_compressed_rows, helib::Ctxt(meta.data->publicKey));
+
+    // SNPs sharing a packed column are scored together by a single polynomial of that column
+    vector<uint32_t> plan;
+    vector<vector<pair<uint32_t, int32_t>>> weights;
+    unordered_map<uint32_t, size_t> packed_index;
+    for (pair<uint32_t, int32_t> i : prs_params)
+    {
+        uint32_t col = PackedColumn(i.first);
+        if (snps_per_slot > 1 && packed_index.count(col))
+        {
+            weights[packed_index[col]].push_back(i);
+            continue;
+        }
+        packed_index[col] = plan.size();
+        plan.push_back(col);
+        weights.push_back(vector<pair<uint32_t, int32_t>>{i});
+    }
+    ColumnPrefetcher columns(view.Columns(), plan, prefetch_depth);
+
+    // Walk one column at a time so each column is pinned only once
+    for (size_t k = 0; k < plan.size(); k++)
     {
-        helib::Ctxt sum(meta.data->publicKey);
+        ColumnStore::ColumnRef column = columns.Get(k);
+        if (snps_per_slot > 1)
+        {
+            auto weighted_sum = [&](uint32_t v)
+            {
+                long total = 0;
+                for (pair<uint32_t, int32_t> i : weights[k])
+                {
+                    total += (long)i.second * packed_digit(v, i.first % snps_per_slot);
+                }
+                return total;
+            };
+            NTL::ZZX score = PackedPolynomial(weighted_sum);
+            for (uint32_t j = 0; j < num_compressed_rows; j++)
+            {
+                scores[j] += PackedEval(score, column[j]);
+            }
+            continue;
+        }
 
-        for (pair<uint32_t, int32_t> i : prs_params)
+        pair<uint32_t, int32_t> i = weights[k][0];
+        for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            helib::Ctxt temp = encrypted_db[i.first][j];
+            helib::Ctxt temp = column[j];
             temp.multByConstant(NTL::ZZX(i.second));
 
-            sum += temp;
+            scores[j] += temp;
         }
-        scores.push_back(sum);
     }
-    return scores;
-}
-
-void process_iteration_prs(std::vector<std::vector<helib::Ctxt>> &encrypted_db,
-                           std::vector<helib::Ctxt> &scores,
-                           vector<pair<uint32_t, int32_t>> &prs_params,
-                           size_t start_idx,
-                           size_t end_idx,
-                            std::mutex &scores_mutex
-                           )
-{
-    helib::Ctxt score = encrypted_db[prs_params[start_idx].first][0];
-    score.multByConstant(NTL::ZZX(prs_params[start_idx].second));
 
-    for (size_t i = start_idx + 1; i < end_idx; i++)
+    // Slots past the last row are already zero, so only deleted rows need masking
+    if (!deleted_rows.empty())
     {
-        pair<uint32_t, int32_t> param = prs_params[i];
-        helib::Ctxt clone = encrypted_db[param.first][0];
-        clone.multByConstant(NTL::ZZX(param.second));
-        score += clone;
-    }  
-
-    std::lock_guard<std::mutex> lock(scores_mutex);
-    scores.push_back(score);
+        MaskWithNumRows(scores);
+    }
+    return scores;
 }
 
-helib::Ctxt Server::PRSQueryP(vector<pair<uint32_t, int32_t>> &prs_params, uint32_t num_threads)
+helib::Ctxt Server::PRSQueryP(vector<pair<uint32_t, int32_t>> &prs_params, uint32_t num_tasks)
 {
-    uint32_t t = num_threads; // You can set this value based on the number of available cores or your requirements
-
-    size_t chunk_size = prs_params.size() / t;
-
-    std::vector<std::thread> threads;
-
-    vector<helib::Ctxt> scores = vector<helib::Ctxt>();
-    scores.reserve(t);
+    QueryView view(*this);
 
-    std::mutex scores_mutex;
+    RequireUnpacked("PRSQueryP");
 
-
-    for (size_t i = 0; i < t; i++)
+    if (prs_params.empty())
     {
-        size_t start_idx = i * chunk_size;
-        size_t end_idx = (i == t - 1) ? prs_params.size() : (i + 1) * chunk_size;
-
-        threads.emplace_back(process_iteration_prs, std::ref(encrypted_db),
-                             std::ref(scores), std::ref(prs_params),
-                             start_idx, end_idx, std::ref(scores_mutex));
+        throw invalid_argument("ERROR: PRS query needs at least one SNP");
     }
 
-    for (auto &thread : threads)
+    const ColumnStore::Snapshot &db = view.Columns();
+    size_t chunks = max<size_t>(1, min<size_t>(num_tasks, prs_params.size()));
+
+    TaskGraph graph;
+    vector<helib::Ctxt> scores(chunks, helib::Ctxt(meta.data->publicKey));
+    vector<helib::Ctxt *> values;
+    vector<TaskGraph::Node> weighted;
+    for (size_t c = 0; c < chunks; c++)
     {
-        thread.join();
+        values.push_back(&scores[c]);
+        weighted.push_back(graph.Add("weight", [&, c]
+                                     {
+            auto [start_idx, end_idx] = chunk_bounds(prs_params.size(), chunks, c);
+            for (size_t i = start_idx; i < end_idx; i++)
+            {
+                helib::Ctxt clone = db[prs_params[i].first][0];
+                clone.multByConstant(NTL::ZZX(prs_params[i].second));
+                scores[c] += clone;
+            } }));
     }
-
-    helib::Ctxt scores_all = scores[0];
-    for (size_t i = 1; i < t; i++)
+    TaskGraph::Node total = AddSumTree(graph, values, weighted);
+    if (!deleted_rows.empty())
     {
-        scores_all += scores[i];
+        graph.Add("mask", [&]
+                  { MaskRow(scores[0], 0); }, {total});
     }
-    return scores_all;
+
+    QueryExecutor()->Run(graph);
+    return scores[0];
 }
 
 pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQuery(uint32_t target_column, vector<helib::Ctxt> &d, uint32_t threshold)
 {
+    QueryView view(*this);
+
+    RequireUnpacked("SimilarityQuery");
+
     // Compute Normalized Score
     if (!with_similarity)
     {
@@ -577,35 +1856,27 @@ pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQuery(uint32_t target_column, v
         throw "Invalid setup";
     }
 
-    if (num_deletes > constants::ALPHA)
-    {
-        std::cout << "Too many deletes have been performed. Cannot run similarity query" << std::endl;
-        std::cout << "The data owner needs to refresh the ciphertexts" << std::endl;
-        throw "Too many deletes";
-    }
+    vector<vector<helib::Ctxt>> normalized_scores = vector<vector<helib::Ctxt>>(num_compressed_rows);
 
-    vector<vector<helib::Ctxt>> normalized_scores = vector<vector<helib::Ctxt>>();
-
-    for (uint32_t j = 0; j < num_compressed_rows; j++)
+    for (size_t i = 0; i < d.size(); i++)
     {
-        vector<helib::Ctxt> temp = vector<helib::Ctxt>();
-        for (size_t i = 0; i < d.size(); i++)
+        ColumnStore::ColumnRef column = view[i];
+        for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            helib::Ctxt clone = encrypted_db[i][j];
+            helib::Ctxt clone = column[j];
             clone -= d[i];
             clone.square();
             
             clone = clone.cleanUp();
 
-            temp.push_back(clone);
+            normalized_scores[j].push_back(clone);
         }
-        normalized_scores.push_back(temp);
     }
     vector<helib::Ctxt> scores = vector<helib::Ctxt>();
 
     for (uint32_t j = 0; j < num_compressed_rows; j++)
     {
-        scores.push_back(AddManySafe(normalized_scores[j], meta.data->publicKey));
+        scores.push_back(SumMany(normalized_scores[j], meta.data->publicKey));
     }
     if (constants::DEBUG)
     {
@@ -639,10 +1910,12 @@ pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQuery(uint32_t target_column, v
         }
     }
 
+    ColumnStore::ColumnRef target = view[target_column];
+
     vector<helib::Ctxt> inverse_target_column = vector<helib::Ctxt>();
     for (uint32_t j = 0; j < num_compressed_rows; j++)
     {
-        helib::Ctxt inv = encrypted_db[target_column][j];
+        helib::Ctxt inv = target[j];
         AddOneMod2(inv);
         inverse_target_column.push_back(inv);
     }
@@ -655,13 +1928,13 @@ pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQuery(uint32_t target_column, v
         inverse_target_column[j].multiplyBy(predicate[j]);
         inverse_target_column[j] = inverse_target_column[j].cleanUp();
 
-        predicate[j].multiplyBy(encrypted_db[target_column][j]);
+        predicate[j].multiplyBy(target[j]);
         predicate[j] = predicate[j].cleanUp();
 
     }
 
-    helib::Ctxt count_with = AddManySafe(predicate, meta.data->publicKey);
-    helib::Ctxt count_without = AddManySafe(inverse_target_column, meta.data->publicKey);
+    helib::Ctxt count_with = SumMany(predicate, meta.data->publicKey);
+    helib::Ctxt count_without = SumMany(inverse_target_column, meta.data->publicKey);
 
     count_with = SquashCtxtLogTime(count_with);
     count_without = SquashCtxtLogTime(count_without);
@@ -669,67 +1942,45 @@ pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQuery(uint32_t target_column, v
     return pair(count_with, count_without);
 }
 
-void process_iteration_similarity(std::vector<std::vector<helib::Ctxt>> &encrypted_db,
-                                  std::vector<helib::Ctxt> &d,
-                                  std::vector<helib::Ctxt> &scores,
-                                  size_t start_idx,
-                                  size_t end_idx,
-                                  std::mutex &scores_mutex)
+pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQueryP(uint32_t target_column, std::vector<helib::Ctxt> &d, uint32_t threshold, uint32_t num_tasks)
 {
+    QueryView view(*this);
 
-    helib::Ctxt score = encrypted_db[start_idx][0];
-    score -= d[start_idx];
-    score.square();
-    score.cleanUp();
-    for (size_t i = start_idx; i < end_idx; i++)
-    {
-        helib::Ctxt clone = encrypted_db[i][0];
-        clone -= d[i];
-        clone.square();
-        clone.cleanUp();
-        score += clone;
-    }
-
-    std::lock_guard<std::mutex> lock(scores_mutex);
-    scores.push_back(score);
-}
+    RequireUnpacked("SimilarityQueryP");
 
-pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQueryP(uint32_t target_column, std::vector<helib::Ctxt> &d, uint32_t threshold, uint32_t num_threads)
-{
     if (!with_similarity)
     {
         std::cout << "Server not setup to run similarity queries" << std::endl;
         throw "Invalid setup";
     }
-
-    uint32_t t = num_threads;
-    uint32_t num_snps = d.size();
-
-    size_t chunk_size = num_snps / t;
-
-    vector<helib::Ctxt> scores = vector<helib::Ctxt>();
-    scores.reserve(t);
-
-    std::mutex scores_mutex;
-
-    std::vector<std::thread> threads;
-    for (size_t i = 0; i < t; i++)
+    if (d.empty())
     {
-
-        size_t start_idx = i * chunk_size;
-        size_t end_idx = (i == t - 1) ? num_snps : (i + 1) * chunk_size;
-
-        threads.emplace_back(process_iteration_similarity, std::ref(encrypted_db),
-                             std::ref(d), std::ref(scores),
-                             start_idx, end_idx, std::ref(scores_mutex));
+        throw invalid_argument("ERROR: similarity query needs at least one SNP");
     }
 
-    for (auto &thread : threads)
+    const ColumnStore::Snapshot &db = view.Columns();
+    size_t chunks = max<size_t>(1, min<size_t>(num_tasks, d.size()));
+
+    TaskGraph graph;
+    vector<helib::Ctxt> scores(chunks, helib::Ctxt(meta.data->publicKey));
+    vector<helib::Ctxt *> values;
+    vector<TaskGraph::Node> distances;
+    for (size_t c = 0; c < chunks; c++)
     {
-        thread.join();
+        values.push_back(&scores[c]);
+        distances.push_back(graph.Add("distance", [&, c]
+                                      {
+            auto [start_idx, end_idx] = chunk_bounds(d.size(), chunks, c);
+            for (size_t i = start_idx; i < end_idx; i++)
+            {
+                helib::Ctxt clone = db[i][0];
+                clone -= d[i];
+                clone.square();
+                clone.cleanUp();
+                scores[c] += clone;
+            } }));
     }
-
-    helib::Ctxt scores_all = AddManySafe(scores, meta.data->publicKey);
+    TaskGraph::Node total = AddSumTree(graph, values, distances);
 
     helib::Ptxt<helib::BGV> ptxt_threshold(meta.data->context);
     for (uint32_t i = 0; i < num_slots; i++)
@@ -738,23 +1989,35 @@ pair<helib::Ctxt, helib::Ctxt> Server::SimilarityQueryP(uint32_t target_column,
     }
 
     helib::Ctxt predicate(meta.data->publicKey);
-        
-    comparator->compare(predicate, scores_all, ptxt_threshold);
-
-    helib::Ctxt inverse_predicate = predicate;
-    AddOneMod2(inverse_predicate);
-
-    predicate *= encrypted_db[target_column][0];
-    inverse_predicate *= encrypted_db[target_column][0];
-
-    helib::Ctxt count_with = SquashCtxtLogTime(predicate);
-    helib::Ctxt count_without = SquashCtxtLogTime(inverse_predicate);
-
+    helib::Ctxt inverse_predicate(meta.data->publicKey);
+    TaskGraph::Node compared = graph.Add("compare", [&]
+                                         {
+        comparator->compare(predicate, scores[0], ptxt_threshold);
+        inverse_predicate = predicate;
+        AddOneMod2(inverse_predicate); }, {total});
+
+    ColumnStore::ColumnRef target = view[target_column];
+    helib::Ctxt count_with(meta.data->publicKey);
+    helib::Ctxt count_without(meta.data->publicKey);
+    graph.Add("squash", [&]
+              {
+        MaskRow(predicate, 0);
+        predicate *= target[0];
+        count_with = SquashCtxtLogTime(predicate); }, {compared});
+    graph.Add("squash", [&]
+              {
+        MaskRow(inverse_predicate, 0);
+        inverse_predicate *= target[0];
+        count_without = SquashCtxtLogTime(inverse_predicate); }, {compared});
+
+    QueryExecutor()->Run(graph);
     return pair(count_with, count_without);
 }
 
 helib::Ctxt Server::CountingRangeQuery(uint32_t  lower, uint32_t  upper)
 {
+    QueryView view(*this);
+
     helib::Ptxt<helib::BGV> ptxt_lower(meta.data->context);
     helib::Ptxt<helib::BGV> ptxt_upper(meta.data->context);
 
@@ -782,13 +2045,15 @@ helib::Ctxt Server::CountingRangeQuery(uint32_t  lower, uint32_t  upper)
         predicates.push_back(upper_predicate);
     }
 
-    helib::Ctxt result = AddManySafe(predicates, meta.data->publicKey);
+    helib::Ctxt result = SumMany(predicates, meta.data->publicKey);
     result = SquashCtxtLogTime(result);
     return result;
 }
 
 pair<helib::Ctxt, helib::Ctxt> Server::MAFRangeQuery(uint32_t  snp, uint32_t  lower, uint32_t  upper)
 {
+    QueryView view(*this);
+
     helib::Ptxt<helib::BGV> ptxt_lower(meta.data->context);
     helib::Ptxt<helib::BGV> ptxt_upper(meta.data->context);
 
@@ -816,20 +2081,29 @@ pair<helib::Ctxt, helib::Ctxt> Server::MAFRangeQuery(uint32_t  snp, uint32_t  lo
         predicates.push_back(upper_predicate);
     }
 
-    helib::Ctxt result = AddManySafe(predicates, meta.data->publicKey);
-    result = SquashCtxtLogTime(result);
-
     vector<helib::Ctxt> indv_MAF = vector<helib::Ctxt>();
+    ColumnStore::ColumnRef snp_column = view[PackedColumn(snp)];
+
+    NTL::ZZX genotype;
+    if (snps_per_slot > 1)
+    {
+        genotype = PackedPolynomial([&](uint32_t v)
+                                    { return (long)packed_digit(v, snp % snps_per_slot); });
+    }
 
     for (uint32_t i = 0; i < num_compressed_rows; i++)
     {
-        helib::Ctxt clone = encrypted_db[snp][i];
+        helib::Ctxt clone = snps_per_slot > 1 ? PackedEval(genotype, snp_column[i]) : snp_column[i];
         clone *= predicates[i];
         clone.cleanUp();
         indv_MAF.push_back(clone);
     }
 
-    helib::Ctxt freq = AddManySafe(indv_MAF, meta.data->publicKey);
+    // Summed in place, so only once the products above are done with them
+    helib::Ctxt result = SumMany(predicates, meta.data->publicKey);
+    result = SquashCtxtLogTime(result);
+
+    helib::Ctxt freq = SumMany(indv_MAF, meta.data->publicKey);
     freq = SquashCtxtLogTime(freq);
     return pair(freq, result);
 }
@@ -845,53 +2119,6 @@ void Server::AddOneMod2(helib::Ctxt &a)
     a.addConstant(NTL::ZZX(1));
 }
 
-helib::Ctxt MultiplyMany(vector<helib::Ctxt> &v)
-{
-    uint32_t num_entries = v.size();
-    uint32_t depth = ceil(log2(num_entries));
-
-    for (uint32_t d = 0; d < depth; d++)
-    {
-        uint32_t jump_factor = pow(2, d);
-        uint32_t skip_factor = 2 * jump_factor;
-
-        for (uint32_t i = 0; i < num_entries; i += skip_factor)
-        {
-            v[i].multiplyBy(v[i + jump_factor]);
-        }
-    }
-    return v[0];
-}
-
-helib::Ctxt AddMany(vector<helib::Ctxt> &v)
-{
-    uint32_t num_entries = v.size();
-    uint32_t depth = ceil(log2(num_entries));
-
-    for (uint32_t d = 0; d < depth; d++)
-    {
-        uint32_t jump_factor = pow(2, d);
-        uint32_t skip_factor = 2 * jump_factor;
-
-        for (uint32_t i = 0; i < num_entries; i += skip_factor)
-        {
-            v[i] += v[i + jump_factor];
-        }
-    }
-    return v[0];
-}
-
-helib::Ctxt AddManySafe(vector<helib::Ctxt> &v, const helib::PubKey &pk)
-{
-    helib::Ctxt result(pk);
-
-    for (uint32_t i = 0; i < v.size(); i++)
-    {
-        result += v[i];
-    }
-    return result;
-}
-
 helib::Ctxt Server::SquashCtxt(helib::Ctxt &ciphertext, uint32_t num_data_elements)
 {
     const helib::EncryptedArray &ea = meta.data->context.getEA();
@@ -908,73 +2135,20 @@ helib::Ctxt Server::SquashCtxt(helib::Ctxt &ciphertext, uint32_t num_data_elemen
 
 helib::Ctxt Server::SquashCtxtLogTimePower2(helib::Ctxt &ciphertext)
 {
-    const helib::EncryptedArray &ea = meta.data->context.getEA();
-
-    uint32_t depth = floor(log2(num_slots));
-
-    for (int d = depth - 1; d >= 0; d--)
-    {
-        int32_t shift = 1 << d;
-        helib::Ctxt clone = ciphertext;
-        ea.rotate(clone, (-shift));
-        ciphertext += clone;
-        cout << "Step " << d << " capacity:" << ciphertext.capacity() << endl;
-    }
-
-    return ciphertext;
+    return SquashCtxtLogTime(ciphertext);
 }
 
 helib::Ctxt Server::SquashCtxtLogTime(helib::Ctxt &ciphertext)
 {
-    const helib::EncryptedArray &ea = meta.data->context.getEA();
-
-    uint32_t depth = floor(log2(num_slots));
-
-    helib::Ptxt<helib::BGV> mask(meta.data->context);
-    helib::Ptxt<helib::BGV> inverse_mask(meta.data->context);
-
-    uint32_t largest_power_of_two_less_than_or_equal_two_slotsize = 1 << depth;
-    for (uint32_t i = 0; i < num_slots; i++)
-    {
-        if (i < largest_power_of_two_less_than_or_equal_two_slotsize)
-        {
-            mask[i] = 1;
-            inverse_mask[i] = 0;
-        }
-        else
-        {
-            mask[i] = 0;
-            inverse_mask[i] = 1;
-        }
-    }
-    helib::Ctxt far_end = ciphertext;
-    far_end.multByConstant(inverse_mask);
-
-    ea.rotate(far_end, -largest_power_of_two_less_than_or_equal_two_slotsize);
-
-    ciphertext.multByConstant(mask);
-    ciphertext += far_end;
-
-    for (int d = depth - 1; d >= 0; d--)
-    {
-        int32_t shift = 1 << d;
-        helib::Ctxt clone = ciphertext;
-        ea.rotate(clone, (-shift));
-        ciphertext += clone;
-    }
-
+    SumSlots(meta.data->context.getEA(), ciphertext);
     return ciphertext;
 }
 
 helib::Ctxt Server::SquashCtxtWithMask(helib::Ctxt &ciphertext, uint32_t index)
 {
-    ciphertext = SquashCtxtLogTime(ciphertext);
+    // Every slot holds the total, so it only has to be masked to the one asked for
+    SumSlots(meta.data->context.getEA(), ciphertext);
 
-    const helib::EncryptedArray &ea = meta.data->context.getEA();
-    if (index != 0)
-    {
-        ea.rotate(ciphertext, index);
-    }
     helib::Ptxt<helib::BGV> mask(meta.data->context);
     mask[index] = 1;
     ciphertext.multByConstant(mask);
@@ -984,42 +2158,43 @@ helib::Ctxt Server::SquashCtxtWithMask(helib::Ctxt &ciphertext, uint32_t index)
 
 void Server::CtxtExpand(helib::Ctxt &ciphertext)
 {
-    const helib::EncryptedArray &ea = meta.data->context.getEA();
-
-    uint32_t depth = floor(log2(num_slots));
-
-    helib::Ptxt<helib::BGV> mask(meta.data->context);
+    // The other slots are zero, so the total of every slot is slot 0 and ends up in each of them
+    SumSlots(meta.data->context.getEA(), ciphertext);
+}
 
-    uint32_t largest_power_of_two_less_than_or_equal_two_slotsize = 1 << depth;
-    for (uint32_t i = 0; i < num_slots - largest_power_of_two_less_than_or_equal_two_slotsize; i++)
-    {
-        mask[i] = 1;
-    }
-    for (uint32_t d = 0; d < depth; d++)
+void Server::MaskWithNumRows(vector<helib::Ctxt> &ciphertexts)
+{
+    for (uint32_t j = 0; j < ciphertexts.size(); j++)
     {
-        uint32_t shift = 1 << d;
-        helib::Ctxt clone = ciphertext;
-        ea.rotate(clone, (shift));
-        ciphertext += clone;
+        MaskRow(ciphertexts[j], j);
     }
-
-    helib::Ctxt clone = ciphertext;
-    clone.multByConstant(mask);
-    ea.rotate(clone, largest_power_of_two_less_than_or_equal_two_slotsize);
-    ciphertext += clone;
 }
 
-void Server::MaskWithNumRows(vector<helib::Ctxt> &ciphertexts)
+void Server::MaskRow(helib::Ctxt &ciphertext, uint32_t compressed_row)
 {
+    uint32_t first = compressed_row * num_slots;
+    uint32_t end = min(first + num_slots, num_rows);
+    auto deleted = deleted_rows.lower_bound(first);
+
+    // A full compressed row without deletes has no slots to mask
+    if (end - first == num_slots && (deleted == deleted_rows.end() || *deleted >= end))
+    {
+        return;
+    }
+
     helib::Ptxt<helib::BGV> mask(meta.data->context);
-    for (size_t i = 0; i < num_rows % num_slots; i++)
+    for (uint32_t i = 0; i < end - first; i++)
     {
         mask[i] = 1;
     }
-    ciphertexts.back().multByConstant(mask);
+    for (; deleted != deleted_rows.end() && *deleted < end; deleted++)
+    {
+        mask[*deleted - first] = 0;
+    }
+    ciphertext.multByConstant(mask);
 }
 
-helib::Ctxt Server::EQTest(unsigned long a, helib::Ctxt &b)
+helib::Ctxt Server::EQTest(unsigned long a, const helib::Ctxt &b)
 {
     helib::Ctxt clone = b;
     helib::Ctxt result = b;
@@ -1080,25 +2255,53 @@ helib::Ctxt Server::EQTest(unsigned long a, helib::Ctxt &b)
 
 vector<vector<helib::Ctxt>> Server::filter(vector<pair<uint32_t, uint32_t>> &query)
 {
-    vector<vector<helib::Ctxt>> feature_cols;
+    QueryView view(*this);
 
-    for (uint32_t j = 0; j < num_compressed_rows; j++)
+    vector<vector<helib::Ctxt>> feature_cols = vector<vector<helib::Ctxt>>(num_compressed_rows);
+
+    vector<uint32_t> plan;
+    for (pair<uint32_t, uint32_t> i : query)
+    {
+        plan.push_back(PackedColumn(i.first));
+    }
+    ColumnPrefetcher columns(view.Columns(), plan, prefetch_depth);
+
+    for (size_t k = 0; k < query.size(); k++)
     {
-        vector<helib::Ctxt> indv_vector;
-        for (pair<uint32_t, uint32_t> i : query)
+        pair<uint32_t, uint32_t> i = query[k];
+        ColumnStore::ColumnRef column = columns.Get(k);
+
+        NTL::ZZX indicator;
+        if (snps_per_slot > 1)
+        {
+            if (i.second > 2)
+            {
+                throw invalid_argument("ERROR: invalid value for EQTest");
+            }
+            indicator = PackedPolynomial([&](uint32_t v)
+                                         { return (long)(packed_digit(v, i.first % snps_per_slot) == i.second); });
+        }
+
+        for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
-            indv_vector.push_back(EQTest(i.second, encrypted_db[i.first][j]));
+            if (snps_per_slot > 1)
+            {
+                feature_cols[j].push_back(PackedEval(indicator, column[j]));
+            }
+            else
+            {
+                feature_cols[j].push_back(EQTest(i.second, column[j]));
+            }
 
             if (constants::DEBUG == 3)
             {
                 cout << "checking equality to " << i.second << endl;
                 cout << "original:";
-                print_vector(Decrypt(encrypted_db[i.first][j]));
+                print_vector(Decrypt(column[j]));
                 cout << "result  :";
-                print_vector(Decrypt(EQTest(i.second, encrypted_db[i.first][j])));
+                print_vector(Decrypt(feature_cols[j].back()));
             }
         }
-        feature_cols.push_back(indv_vector);
     }
     return feature_cols;
 }
@@ -1201,7 +2404,9 @@ helib::Ctxt Server::EncryptSK(vector<unsigned long> a)
 
 helib::Ctxt Server::GetAnyElement()
 {
-    return encrypted_db[0][0];
+    QueryView view(*this);
+
+    return view[0][0];
 }
 
 void Server::PrintContext()
@@ -1217,6 +2422,39 @@ void Server::PrintContext()
 
 void Server::PrintEncryptedDB(bool with_headers)
 {
+    QueryView view(*this);
+
+    vector<ColumnStore::ColumnRef> cols;
+    for (uint32_t i = 0; i < NumStoredColumns(); i++)
+    {
+        cols.push_back(view[i]);
+    }
+
+    // Decrypts compressed row j of every SNP, taking the SNPs of a packed column out of its digits
+    auto decrypt_row = [&](uint32_t j)
+    {
+        vector<vector<long>> packed = vector<vector<long>>();
+        for (uint32_t i = 0; i < cols.size(); i++)
+        {
+            packed.push_back(Decrypt(cols[i][j]));
+        }
+
+        vector<vector<long>> temp_storage = vector<vector<long>>();
+        for (uint32_t i = 0; i < num_cols; i++)
+        {
+            vector<long> values = packed[PackedColumn(i)];
+            if (snps_per_slot > 1)
+            {
+                for (long &value : values)
+                {
+                    value = packed_digit(value, i % snps_per_slot);
+                }
+            }
+            temp_storage.push_back(values);
+        }
+        return temp_storage;
+    };
+
     if (with_headers)
     {
         vector<uint32_t> string_length_count = vector<uint32_t>();
@@ -1232,11 +2470,7 @@ void Server::PrintEncryptedDB(bool with_headers)
         for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
 
-            vector<vector<long>> temp_storage = vector<vector<long>>();
-            for (uint32_t i = 0; i < num_cols; i++)
-            {
-                temp_storage.push_back(Decrypt(encrypted_db[i][j]));
-            }
+            vector<vector<long>> temp_storage = decrypt_row(j);
             for (uint32_t jj = 0; jj < min(num_slots, num_rows - (j * num_slots)); jj++)
             {
 
@@ -1272,11 +2506,7 @@ void Server::PrintEncryptedDB(bool with_headers)
         for (uint32_t j = 0; j < num_compressed_rows; j++)
         {
 
-            vector<vector<long>> temp_storage = vector<vector<long>>();
-            for (uint32_t i = 0; i < num_cols; i++)
-            {
-                temp_storage.push_back(Decrypt(encrypted_db[i][j]));
-            }
+            vector<vector<long>> temp_storage = decrypt_row(j);
             for (uint32_t jj = 0; jj < min(num_slots, num_rows - (j * num_slots)); jj++)
             {
 
@@ -1405,6 +2635,18 @@ uint32_t Server::StorageOfOneElement()
     return estimateCtxtSize(meta.data->context, 0);
 }
 
+ColumnMemory Server::StorageOfColumn(uint32_t col)
+{
+    unique_lock<recursive_mutex> view = LockView();
+
+    if (!db_set)
+    {
+        throw invalid_argument("ERROR: DB needs to be set to get storage cost");
+    }
+
+    return encrypted_db.Memory(col);
+}
+
 template <typename T, typename Allocator>
 void print_vector(const vector<T, Allocator> &vect, int num_entries)
 {
@@ -1415,3 +2657,11 @@ void print_vector(const vector<T, Allocator> &vect, int num_entries)
     }
     cout << endl;
 }
+
+void PrintCompactionStats(const CompactionStats &stats)
+{
+    cout << "Compaction " << (stats.published ? "published" : "discarded, the DB changed meanwhile") << ": "
+         << stats.live_rows << " live rows, " << stats.removed_rows << " deleted rows removed, "
+         << stats.compressed_rows_before << " -> " << stats.compressed_rows_after << " compressed rows, "
+         << stats.reclaimed_ciphertexts << " ciphertexts reclaimed in " << stats.seconds << " s" << endl;
+}
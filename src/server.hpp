@@ -3,11 +3,31 @@
 #include <iostream>
 #include <helib/helib.h>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 #include "globals.hpp"
 #include "comparator.hpp"
 #include "tools.hpp"
+#include "db_file.hpp"
+#include "column_store.hpp"
+#include "vcf_ingest.hpp"
+#include "plink_file.hpp"
+#include "thread_pool.hpp"
+#include "executor.hpp"
+#include "product_tree.hpp"
+#include "sum_tree.hpp"
+#include "slot_sum.hpp"
+#include "zero_pool.hpp"
+#include "delta_buffer.hpp"
+#include "noise_monitor.hpp"
+#include "wal.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include <thread>
 #include <utility>
 
@@ -18,50 +38,173 @@
 using namespace std;
 
 
+// Outcome of one compaction; published is false when the DB changed while it ran and the result was dropped
+struct CompactionStats
+{
+    uint32_t live_rows = 0;
+    uint32_t removed_rows = 0;
+    uint32_t compressed_rows_before = 0;
+    uint32_t compressed_rows_after = 0;
+    uint64_t reclaimed_ciphertexts = 0;
+    double seconds = 0;
+    bool published = false;
+};
+
 class Server{
 public:
     
     //Setup
-    Server(const Params& _params, bool _using_disk);
+    Server(const Params& _params, bool _with_similarity);
+    Server(string key_file, bool _with_similarity);
+    ~Server();
     
     void GenData(uint32_t  _num_rows, uint32_t  _num_cols);  
     void GenContinuousData(uint32_t _num_rows, uint32_t _low, uint32_t _high);
     void GenDataDummy(uint32_t  _num_rows, uint32_t  _num_cols);    
     void SetData(vector<vector<uint32_t >> &db);    
-    void SetData(string vcf_file);
+    // Streams the VCF file through the ingest pipeline, one column per variant line
+    IngestStats SetData(string vcf_file);
+    // Loads the PLINK fileset bfile_prefix.bed/.bim/.fam, taking the column headers from the .bim file
+    IngestStats SetDataPLINK(string bfile_prefix);
 
     void SetColumnHeaders(vector<string> &headers);
+
+    //Appending patients
+    // Adds the rows of db, laid out as in SetData, after the last row. The free slots of the last compressed row
+    // are filled first, with one encryption per column, before new compressed rows are allocated. The row count
+    // changes only once every ciphertext is encrypted, so queries never see part of a batch.
+    void AppendRows(vector<vector<uint32_t>> &db);
+    // Appends the samples of a VCF file holding the same variants as the DB, matched to the columns by ID
+    IngestStats AppendVCF(string vcf_file);
+
+    //Packed layout
+    // Stores snps_per_slot genotypes per slot as base-3 digits, dividing the number of stored columns by the same
+    // factor. Queries extract the digits with a polynomial of degree 3^snps_per_slot - 1. Has to be set before the data.
+    void SetPacking(uint32_t snps_per_slot);
+
+    //Bulk encryption
+    // Number of threads SetData, SetDataPLINK and GenData encrypt with, 0 for one per core. Cores left over
+    // per thread are given to NTL's internal threads.
+    void SetEncryptionThreads(uint32_t num_threads);
+
+    // Parallel queries (the *QueryP methods) run as task graphs on one executor shared by the whole process.
+    // Sets its number of threads, 0 for one per core, and how many ready tasks may wait for a thread. As the
+    // executor is process-wide, this resizes it for every Server and Squid of the process, not just this one.
+    void SetQueryThreads(uint32_t num_threads, size_t max_queued = QUERY_EXECUTOR_MAX_QUEUED);
+    ExecutorStats GetExecutorStats();
+
+    //Update path
+    // Keeps up to capacity encryptions of zero generated ahead by num_threads background threads, so updates only
+    // add their plaintext delta to one of them. A capacity of 0 goes back to encrypting every update.
+    void SetZeroPool(uint32_t capacity, uint32_t num_threads = 1);
+    ZeroPoolStats GetZeroPoolStats();
+    // Collects edits in a plaintext delta per ciphertext and folds each touched ciphertext in with a single
+    // encryption, every merge_interval_ms on a background thread and before any query reads the database.
+    // 0 merges what is pending and goes back to applying every edit as it comes. A buffered edit is returned from
+    // before it is logged, so with a WAL open it is durable only once a later SyncWAL returns.
+    void SetUpdateBuffering(uint32_t merge_interval_ms);
+    // Folds the pending edits into the database now
+    void MergeDeltas();
+    DeltaBufferStats GetDeltaBufferStats();
+
+    //Persistence
+    void SaveKeys(string key_file);
+    // A seeded database stores only the b part of each ciphertext plus a seed for its a part
+    void SaveDB(string db_file, bool seeded = false);
+    DBLoadStats LoadDB(string db_file);
+    // Serves the columns straight out of a shared read-only mapping of db_file instead of loading them
+    DBLoadStats MapDB(string db_file);
+    // Encrypts a VCF file straight into db_file, holding only the lines and ciphertexts in flight rather than
+    // the whole database. The file is then served with LoadDB or MapDB.
+    IngestStats IngestVCF(string vcf_file, string db_file, uint32_t num_threads = thread::hardware_concurrency());
+
+    //Durability
+    // Logs every change to the DB to wal_file as the encrypted delta it applied, and writes checkpoint_file, the DB file
+    // the log is replayed onto. A change returns once its record is synced; records are synced in groups every
+    // group_commit_ms, or right away with 0, and changes made at the same time share a sync. Once the log grows
+    // past checkpoint_bytes, or anything replaces the whole DB, the next change writes a new checkpoint and empties
+    // the log. Buffered edits give that up: they are logged when they are merged, and are durable once SyncWAL
+    // returns.
+    void EnableWAL(string wal_file, string checkpoint_file, uint32_t group_commit_ms = 10, uint64_t checkpoint_bytes = 1ull << 30);
+    // Loads checkpoint_file, replays the records of wal_file written after it up to the first one torn by a crash,
+    // and goes on logging to wal_file
+    WALReplayStats Recover(string wal_file, string checkpoint_file, uint32_t group_commit_ms = 10, uint64_t checkpoint_bytes = 1ull << 30);
+    void Checkpoint();
+    // Syncs and closes the log, leaving it and the checkpoint on disk
+    void DisableWAL();
+    // Merges buffered edits and waits until every change is on disk
+    void SyncWAL();
+    WALStats GetWALStats();
+
+    //Column cache
+    // Keeps at most memory_budget bytes of columns in memory and spills the least recently used ones to spill_file
+    void SetMemoryBudget(uint64_t memory_budget, string spill_file);
+    // Keeps only the hot_columns most recently used columns as DoubleCRTs and the rest deflated in memory
+    void SetCompression(uint32_t hot_columns);
+    ColumnCacheStats GetCacheStats();
+    // Number of columns filter and PRSQuery load ahead of the one being computed on, 0 loads them synchronously
+    void SetPrefetchDepth(uint32_t depth);
     
     //Modify Operations
+    // Adds value to the cell, which is all an update can do to a ciphertext. In a packed DB the cell is one base-3
+    // digit of its slot, so value has to be 0, 1 or 2 and the caller has to keep the digit it adds to within 0..2:
+    // a larger sum carries into the next SNP's digit, which the server cannot see under the encryption.
     void UpdateOneValue(uint32_t  row, uint32_t  col, uint32_t  value);
     void UpdateOneRow(uint32_t  row, vector<uint32_t > &vals);
-    void InsertOneRow(vector<uint32_t > &vals);
+    // Reuses the slot of a deleted row if there is one and appends otherwise. Returns the row written.
+    uint32_t InsertOneRow(vector<uint32_t > &vals);
+    // Marks the row deleted in the validity mask every query applies, leaving the stored ciphertexts untouched.
+    // The two older names are kept as aliases.
+    void DeleteRow(uint32_t row);
     void DeleteRowAddition(uint32_t  row);
     void DeleteRowMultiplication(uint32_t  row);
+
+    //Noise
+    // Queues stored ciphertexts left with less than min_bit_capacity bits of capacity by updates, or by the time
+    // this is called, for a background refresh: the secret key holder decrypts and re-encrypts a copy, which is
+    // swapped in between queries. 0 turns refreshing off.
+    void SetRefreshThreshold(long min_bit_capacity);
+    RefreshStats GetRefreshStats();
+    // Capacity left in the ciphertexts of stored column col
+    NoiseHistogram GetNoiseHistogram(uint32_t col);
+
+    //Compaction
+    // Re-packs the live rows of a snapshot into as few compressed rows as they need on a background thread,
+    // decrypting and re-encrypting them with the owner's keys, and swaps the result in once done. Deleted
+    // rows are dropped and the rows after them move up.
+    void StartCompaction();
+    CompactionStats WaitForCompaction();
+    CompactionStats Compact();
     
     //Querries
     helib::Ctxt CountQuery(bool conjunctive, vector<pair<uint32_t , uint32_t >>& query);
-    helib::Ctxt CountQueryP(vector<pair<uint32_t, uint32_t>> &query, uint32_t num_threads);
+    helib::Ctxt CountQueryP(vector<pair<uint32_t, uint32_t>> &query);
     helib::Ctxt MAFQuery(uint32_t  snp, bool conjunctive, vector<pair<uint32_t , uint32_t >> &query);
-    helib::Ctxt MAFQueryP(uint32_t  snp, vector<pair<uint32_t, uint32_t>> &query, uint32_t num_threads);
+    helib::Ctxt MAFQueryP(uint32_t  snp, vector<pair<uint32_t, uint32_t>> &query);
 
     helib::Ctxt CountingRangeQuery(uint32_t  lower, uint32_t  upper);
     pair<helib::Ctxt, helib::Ctxt> MAFRangeQuery(uint32_t  snp, uint32_t  lower, uint32_t  upper);
 
     vector<helib::Ctxt> PRSQuery(vector<pair<uint32_t , int32_t >>& prs_params);
-    helib::Ctxt PRSQueryP(vector<pair<uint32_t, int32_t>> &prs_params, uint32_t num_threads);
+    // num_tasks is the number of tasks the SNPs are split into
+    helib::Ctxt PRSQueryP(vector<pair<uint32_t, int32_t>> &prs_params, uint32_t num_tasks);
     pair<helib::Ctxt, helib::Ctxt> SimilarityQuery(uint32_t  target_column, vector<helib::Ctxt>& d, uint32_t  threshold);
-    pair<helib::Ctxt, helib::Ctxt> SimilarityQueryP(uint32_t  target_column, vector<helib::Ctxt>& d, uint32_t  num_threshold, uint32_t  threads);
+    pair<helib::Ctxt, helib::Ctxt> SimilarityQueryP(uint32_t  target_column, vector<helib::Ctxt>& d, uint32_t  num_threshold, uint32_t  num_tasks);
 
     void AddOneMod2(helib::Ctxt& a);
     helib::Ctxt SquashCtxt(helib::Ctxt& ciphertext, uint32_t  num_data_entries = 10);
+    // Sums every slot of ciphertext into each of its slots, one dimension of the slot hypercube at a time
     helib::Ctxt SquashCtxtLogTime(helib::Ctxt& ciphertext);
     helib::Ctxt SquashCtxtLogTimePower2(helib::Ctxt& ciphertext);
 
+    // Leaves the total of every slot in slot index and zeroes the others
     helib::Ctxt SquashCtxtWithMask(helib::Ctxt& ciphertext, uint32_t  index);
+    // Zeroes the slots of deleted rows and of those past the last row in one ciphertext per compressed row
     void MaskWithNumRows(vector<helib::Ctxt>& ciphertexts);
-    helib::Ctxt EQTest(unsigned long a, helib::Ctxt& b);
+    void MaskRow(helib::Ctxt& ciphertext, uint32_t compressed_row);
+    helib::Ctxt EQTest(unsigned long a, const helib::Ctxt& b);
     vector<vector<helib::Ctxt>> filter(vector<pair<uint32_t , uint32_t >>& query);
+    // Copies slot 0 to every slot of a ciphertext whose other slots are zero
     void CtxtExpand(helib::Ctxt &ciphertext);
     
     //Encrypt / Decrypt Methods
@@ -71,6 +214,8 @@ public:
     helib::Ctxt Encrypt(vector<unsigned long> a);
     helib::Ctxt EncryptSK(unsigned long a);
     helib::Ctxt EncryptSK(vector<unsigned long> a);
+    // The stored ciphertext of row 0 and column 0, which in a packed DB holds the first snps_per_slot SNPs
+    // as the base-3 digits of each slot
     helib::Ctxt GetAnyElement();
     
     void PrintContext();
@@ -80,10 +225,95 @@ public:
     uint32_t GetCols();
     vector<string> GetHeaders();
     Meta& GetMeta(){return meta;}
+    // Bits of capacity a multiplication takes, as product trees are planned with
+    long GetProductBits(){return product_bits;}
 
     uint32_t  StorageOfOneElement();
+    ColumnMemory StorageOfColumn(uint32_t col);
     
 private:
+    void Setup(bool _with_similarity);
+
+    uint32_t NumStoredColumns() { return (num_cols + snps_per_slot - 1) / snps_per_slot; }
+    uint32_t PackedColumn(uint32_t col) { return col / snps_per_slot; }
+    void RequireUnpacked(string query);
+    // Interpolates the polynomial taking every packed value v in [0, 3^snps_per_slot) to f(v) mod p
+    NTL::ZZX PackedPolynomial(const function<long(uint32_t)> &f);
+    // Encrypts compressed rows [first_row, end_row) of num_columns columns on the encryption pool. fill(col, row, slots)
+    // sets the slots of one ciphertext, which start out zeroed.
+    vector<vector<helib::Ctxt>> EncryptColumns(uint32_t num_columns, uint32_t first_row, uint32_t end_row,
+                                               const function<void(uint32_t, uint32_t, vector<unsigned long> &)> &fill);
+    helib::Ctxt PackedEval(const NTL::ZZX &poly, const helib::Ctxt &packed);
+    // Ciphertexts of a filter added to a task graph, which have to outlive the graph's run
+    struct FilterTasks
+    {
+        vector<ColumnStore::ColumnRef> columns;
+        vector<vector<helib::Ctxt>> equalities; // the predicate of compressed row r ends up in equalities[r][0]
+        vector<TaskGraph::Node> masked;         // task after which it is masked to the live rows
+    };
+    // Adds the conjunction of query on every compressed row to graph: an equality test per row and predicate,
+    // a product tree per row and a mask. The predicates are left unrelinearized unless relinearize.
+    void AddFilterTasks(TaskGraph &graph, const ColumnStore::Snapshot &db, vector<pair<uint32_t, uint32_t>> &query,
+                        FilterTasks &filter, bool relinearize = false);
+    // Folds the pending edits in and keeps the background merger off encrypted_db until the lock is released.
+    // Every method changing encrypted_db, or reading it outside a query, holds one.
+    unique_lock<recursive_mutex> LockView();
+    // LockView for changes to the shape of the DB (its rows, columns, deletes or the stored columns as a whole),
+    // which also waits for the queries in flight. New queries cannot start meanwhile, as they need db_mutex to.
+    unique_lock<recursive_mutex> LockShape();
+
+    // Pins what a query reads for as long as it runs. Only taking it holds db_mutex, so queries run alongside
+    // updates and each other: updates copy the columns a query can still see instead of changing them in place,
+    // and changes to the shape of the DB wait for it. A query run by another one, like filter, shares its view.
+    class QueryView
+    {
+    public:
+        explicit QueryView(Server &_server);
+        ~QueryView();
+
+        QueryView(const QueryView &) = delete;
+        QueryView &operator=(const QueryView &) = delete;
+
+        ColumnStore::ColumnRef operator[](uint32_t col) const { return (*columns)[col]; }
+        const ColumnStore::Snapshot &Columns() const { return *columns; }
+
+    private:
+        bool Nested() const { return outer && &outer->server == &server; }
+
+        Server &server;
+        QueryView *outer;
+        shared_ptr<const ColumnStore::Snapshot> columns;
+    };
+    static thread_local QueryView *current_query;
+    // Expects db_mutex to be held
+    void MergeDeltasLocked();
+    void RunMerger();
+    // Applies fn to one stored ciphertext and tells the noise monitor the capacity it is left with
+    void UpdateCell(uint32_t col, uint32_t row, const function<void(helib::Ctxt &)> &fn);
+    void RunRefresher();
+    // Called whenever the whole DB is replaced or its rows move, after which the log no longer applies to the checkpoint
+    void DataReplaced();
+    // Logs a change once it is applied, expecting db_mutex to be held, and returns its lsn, 0 if it was not logged.
+    // The encoded form is for changes whose ciphertexts are moved into the DB and so have to be encoded before.
+    uint64_t LogChange(WALRecordType type, uint32_t col, uint32_t row, const vector<const helib::Ctxt *> &ctxts);
+    uint64_t LogChange(const string &encoded);
+    // Releases lock and waits until the change logged as lsn is on disk. Waiting off the lock lets the changes
+    // made meanwhile join the same group commit.
+    void WaitLogged(unique_lock<recursive_mutex> &lock, uint64_t lsn);
+    void ApplyWALRecord(WALRecord &record);
+    // AppendRows for a caller holding LockShape, which waits for the returned lsn once it is done with the lock
+    uint64_t AppendRowsLocked(vector<vector<uint32_t>> &db);
+    // Adds num_new_rows rows given their ciphertexts as encrypted by AppendRows
+    void ApplyAppend(uint32_t num_new_rows, vector<vector<helib::Ctxt>> &columns);
+    // Clears the slot of deleted row row and adds one ciphertext per stored column
+    void ApplyReuse(uint32_t row, const vector<vector<helib::Ctxt>> &values);
+    // Creates the encryption pool on first use; holding on to the pointer keeps it alive across SetEncryptionThreads
+    shared_ptr<ThreadPool> EncryptionPool();
+    // Reads the snapshot one column at a time, so only the columns changed meanwhile are kept twice
+    void RunCompaction(uint64_t version, uint32_t snapshot_rows, uint32_t snapshot_compressed_rows,
+                       set<uint32_t> snapshot_deleted, shared_ptr<const ColumnStore::Snapshot> snapshot);
+    void StopMerger();
+
     Meta meta;
 
     unique_ptr<he_cmp::Comparator> comparator;
@@ -95,9 +325,42 @@ private:
     uint32_t  num_cols = 0;
     uint32_t  num_compressed_rows = 0;
     uint32_t  num_slots;
-    uint32_t  num_deletes = 0;
+    uint32_t  prefetch_depth = 2;
+    uint32_t  snps_per_slot = 1;
+    set<uint32_t> deleted_rows;
     
-    vector<vector<helib::Ctxt>> encrypted_db; 
+    shared_ptr<ThreadPool> encryption_pool;
+    shared_ptr<ZeroPool> zero_pool;
+
+    recursive_mutex db_mutex;
+    unique_ptr<DeltaBuffer> delta_buffer;
+    uint32_t merge_interval_ms = 0;
+    thread merger;
+    mutex merger_mutex;
+    condition_variable merger_cv;
+    bool merger_stop = false;
+    exception_ptr background_error; // first failure of a background merge or refresh, rethrown to the next caller
+    uint64_t db_version = 0;   // bumped by every change to encrypted_db, so a compaction can tell its snapshot is stale
+
+    mutex query_mutex;
+    condition_variable queries_cv;
+    uint32_t active_queries = 0;
+
+    NoiseMonitor noise_monitor;
+    thread refresher;
+
+    shared_ptr<WriteAheadLog> wal;  // shared with the changes waiting on it after they let go of db_mutex
+    string checkpoint_path;
+    uint64_t checkpoint_bytes = 0;
+    bool checkpoint_pending = false; // the DB was replaced since the last checkpoint
+    uint64_t loaded_wal_lsn = 0;     // last log record included in the last DB file loaded
+
+    thread compactor;
+    atomic<bool> compacting{false}; // compactor is still running, rather than done and waiting to be joined
+    CompactionStats compaction_stats;
+    exception_ptr compaction_error;
+
+    ColumnStore encrypted_db;
     vector<string> column_headers;
 
     vector<helib::Ctxt> continuous_db;
@@ -107,4 +370,8 @@ private:
     uint32_t  neg_one_over_two;
 
     uint32_t  plaintext_modulus;
-};
\ No newline at end of file
+    // Capacity one multiplication takes, measured once on fresh ciphertexts
+    long product_bits;
+};
+
+void PrintCompactionStats(const CompactionStats &stats);
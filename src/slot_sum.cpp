@@ -0,0 +1,173 @@
+#include "slot_sum.hpp"
+
+#include <helib/matmul.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// Splits n into factors, multiplying its prime factors together as long as they stay within max_radix
+static vector<long> radices(long n, long max_radix)
+{
+    vector<long> primes;
+    for (long f = 2; f * f <= n; f++)
+    {
+        for (; n % f == 0; n /= f)
+        {
+            primes.push_back(f);
+        }
+    }
+    if (n > 1)
+    {
+        primes.push_back(n);
+    }
+
+    vector<long> factors;
+    long radix = 1;
+    for (long prime : primes)
+    {
+        if (radix > 1 && radix * prime > max_radix)
+        {
+            factors.push_back(radix);
+            radix = 1;
+        }
+        radix *= prime;
+    }
+    if (radix > 1)
+    {
+        factors.push_back(radix);
+    }
+    return factors;
+}
+
+// Key switches smartAutomorph makes to apply X -> X^k, one per key-switching matrix it chains to get there
+static uint32_t automorph_key_switches(const helib::PubKey &pk, long k)
+{
+    long m = pk.getContext().getM();
+    k %= m;
+    if (k < 0)
+    {
+        k += m;
+    }
+
+    uint32_t key_switches = 0;
+    while (k != 1)
+    {
+        long step = pk.getNextKSWmatrix(k, 0).fromKey.getPowerOfX();
+        k = NTL::MulMod(k, NTL::InvMod(step, m), m);
+        key_switches++;
+    }
+    return key_switches;
+}
+
+// Key switches rotate1D makes to rotate by amount along dim
+static uint32_t rotation_key_switches(const helib::EncryptedArray &ea, const helib::PubKey &pk, long dim, long amount)
+{
+    const helib::PAlgebra &zMStar = ea.getPAlgebra();
+    uint32_t key_switches = automorph_key_switches(pk, zMStar.genToPow(dim, amount));
+    if (!ea.nativeDimension(dim))
+    {
+        // Also rotated the other way round by amount - size, and the two blended with a mask
+        key_switches += automorph_key_switches(pk, zMStar.genToPow(dim, amount - ea.sizeOfDimension(dim)));
+    }
+    return key_switches;
+}
+
+// Sums the radix rotations of ctxt by multiples of stride along dim, which has a key-switching matrix for every
+// power of its generator. Each rotation is then one automorphism and one key switch off the decomposition of
+// ctxt they all share.
+static void sum_hoisted(const helib::EncryptedArray &ea, helib::Ctxt &ctxt, long dim, long stride, long radix,
+                        SlotSumStats &stats)
+{
+    const helib::PAlgebra &zMStar = ea.getPAlgebra();
+    helib::BasicAutomorphPrecon precon(ctxt);
+    for (long t = 1; t < radix; t++)
+    {
+        ctxt += *precon.automorph(zMStar.genToPow(dim, t * stride));
+    }
+    stats.rotations += radix - 1;
+    stats.key_switches += radix - 1;
+    stats.hoisted_steps++;
+}
+
+// Sums the radix rotations of ctxt by multiples of stride along dim by doubling the run summed so far, adding one
+// more rotation of the original for every set bit of radix (HElib's totalSums, along one dimension)
+static void sum_doubling(const helib::EncryptedArray &ea, helib::Ctxt &ctxt, long dim, long stride, long radix,
+                         SlotSumStats &stats)
+{
+    long top_bit = 1;
+    while (top_bit * 2 <= radix)
+    {
+        top_bit *= 2;
+    }
+
+    const helib::PubKey &pk = ctxt.getPubKey();
+    helib::Ctxt original = ctxt;
+    long summed = 1;
+    for (long bit = top_bit / 2; bit > 0; bit /= 2)
+    {
+        helib::Ctxt shifted = ctxt;
+        ea.rotate1D(shifted, dim, summed * stride);
+        ctxt += shifted;
+        stats.key_switches += rotation_key_switches(ea, pk, dim, summed * stride);
+        summed *= 2;
+        stats.rotations++;
+
+        if (radix & bit)
+        {
+            shifted = original;
+            ea.rotate1D(shifted, dim, summed * stride);
+            ctxt += shifted;
+            stats.key_switches += rotation_key_switches(ea, pk, dim, summed * stride);
+            summed++;
+            stats.rotations++;
+        }
+    }
+}
+
+void SumSlots(const helib::EncryptedArray &ea, helib::Ctxt &ctxt, long max_radix, SlotSumStats *stats)
+{
+    auto start = chrono::steady_clock::now();
+    SlotSumStats counts;
+
+    for (long dim = 0; dim < ea.dimension(); dim++)
+    {
+        long size = ea.sizeOfDimension(dim);
+        // A bad dimension rotates with two automorphisms and a mask, which do not hoist. Without a matrix for
+        // every power of the generator, as addSome1DMatrices leaves large dimensions, each hoisted rotation would
+        // chain several key switches and cost more than doubling does.
+        bool hoist = max_radix > 1 && ea.nativeDimension(dim) &&
+                     ctxt.getPubKey().getKSStrategy(dim) == HELIB_KSS_FULL;
+
+        long stride = 1;
+        for (long radix : radices(size, hoist ? max_radix : size))
+        {
+            if (hoist && radix <= max_radix)
+            {
+                sum_hoisted(ea, ctxt, dim, stride, radix, counts);
+            }
+            else
+            {
+                uint32_t before = counts.rotations;
+                sum_doubling(ea, ctxt, dim, stride, radix, counts);
+                counts.plain_rotations += counts.rotations - before;
+            }
+            stride *= radix;
+        }
+    }
+
+    if (stats != nullptr)
+    {
+        counts.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        *stats = counts;
+    }
+}
+
+void PrintSlotSumStats(const SlotSumStats &stats)
+{
+    cout << "Slot sum: " << stats.rotations << " rotations, " << stats.hoisted_steps << " hoisted steps, "
+         << stats.plain_rotations << " plain rotations, " << stats.key_switches << " key switches, " << stats.seconds
+         << " s" << endl;
+}
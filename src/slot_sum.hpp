@@ -0,0 +1,45 @@
+/*
+Summation over the slots of a ciphertext
+
+The slots of a BGV ciphertext form a hypercube, one dimension per generator of Z_m^* / <p>. A rotation along a
+single dimension is one automorphism (two and a mask in a "bad" dimension), while a rotation of the slots as one
+linear array combines rotations along every dimension. Summing every slot therefore sums along one dimension at a
+time: once every line along the first dimension holds its total in each of its slots, summing those along the
+second dimension and so on leaves the grand total in every slot. A dimension's size need not be a power of two, so
+no slots have to be masked off and folded back first.
+
+A dimension of size n is summed in steps of small radix r, each adding r - 1 rotations of the same ciphertext by
+multiples of a stride, so every slot goes from holding the total of stride neighbours to that of stride * r. The
+rotations of one step share the costly part of their key switches: the ciphertext is broken into digits once
+(hoisted) and each rotation only permutes those digits and multiplies them into its key-switching matrix. That
+takes a matrix for every power of the dimension's generator (HELIB_KSS_FULL), which addSome1DMatrices only sets up
+for small dimensions; elsewhere a rotation chains several key switches, hoisted or not. Those dimensions, bad
+dimensions and prime factors of n larger than the radix are summed by repeated doubling with plain rotations.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+
+#include <cstdint>
+
+using namespace std;
+
+// Largest radix a hoisted step sums, which trades key-switching decompositions against rotations
+const long SLOT_SUM_MAX_RADIX = 4;
+
+struct SlotSumStats
+{
+    uint32_t rotations = 0;      // rotations along one dimension, hoisted or not
+    uint32_t hoisted_steps = 0;  // steps whose rotations shared one decomposition
+    uint32_t plain_rotations = 0; // rotations with a key switch of their own
+    uint32_t key_switches = 0;    // all of them, counting every matrix a plain rotation chains
+    double seconds = 0;
+};
+
+// Leaves the total of every slot of ctxt in each of its slots. A max_radix of 1 turns hoisting off and sums by
+// doubling alone.
+void SumSlots(const helib::EncryptedArray &ea, helib::Ctxt &ctxt, long max_radix = SLOT_SUM_MAX_RADIX,
+              SlotSumStats *stats = nullptr);
+
+void PrintSlotSumStats(const SlotSumStats &stats);
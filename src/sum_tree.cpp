@@ -0,0 +1,56 @@
+#include "sum_tree.hpp"
+
+using namespace std;
+
+helib::Ctxt SumMany(vector<helib::Ctxt> &values, const helib::PubKey &pk)
+{
+    if (values.empty())
+    {
+        return helib::Ctxt(pk);
+    }
+
+    auto sum_run = [&values](size_t first, size_t end)
+    {
+        for (size_t i = first + 1; i < end; i++)
+        {
+            values[first] += values[i];
+        }
+    };
+
+    // A single run is not worth a trip through the executor
+    if (values.size() <= SUM_TREE_CHUNK)
+    {
+        sum_run(0, values.size());
+        return move(values[0]);
+    }
+
+    TaskGraph graph;
+    vector<helib::Ctxt *> run_sums;
+    vector<TaskGraph::Node> ready;
+    for (size_t first = 0; first < values.size(); first += SUM_TREE_CHUNK)
+    {
+        size_t end = min(first + SUM_TREE_CHUNK, values.size());
+        run_sums.push_back(&values[first]);
+        ready.push_back(graph.Add("sum", [&sum_run, first, end]
+                                  { sum_run(first, end); }));
+    }
+    AddSumTree(graph, run_sums, ready);
+
+    QueryExecutor()->Run(graph);
+    return move(values[0]);
+}
+
+TaskGraph::Node AddSumTree(TaskGraph &graph, const vector<helib::Ctxt *> &values, vector<TaskGraph::Node> ready)
+{
+    for (size_t stride = 1; stride < values.size(); stride *= 2)
+    {
+        for (size_t i = 0; i + stride < values.size(); i += 2 * stride)
+        {
+            helib::Ctxt *a = values[i];
+            const helib::Ctxt *b = values[i + stride];
+            ready[i] = graph.Add("reduce", [a, b]
+                                 { *a += *b; }, {ready[i], ready[i + stride]});
+        }
+    }
+    return ready[0];
+}
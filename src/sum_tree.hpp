@@ -0,0 +1,30 @@
+/*
+Parallel summation of ciphertexts
+
+Aggregates over compressed rows (the predicates of a count, the products of an MAF, the scores of a similarity
+query) used to be summed one ciphertext after another into an empty one, a serial tail after the parallel work
+producing them. SumMany splits the ciphertexts into runs of SUM_TREE_CHUNK neighbours, sums each run into its first
+ciphertext as one task, and adds the run sums pairwise in a tree, all on the query executor. The sum is built in
+place in the ciphertexts passed in, which is what lets it avoid copying them.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+
+#include <vector>
+
+#include "executor.hpp"
+
+using namespace std;
+
+// Ciphertexts one task sums before the run sums are added pairwise
+const size_t SUM_TREE_CHUNK = 8;
+
+// Sums values, which it consumes, and returns the sum; an empty ciphertext under pk when there are none
+helib::Ctxt SumMany(vector<helib::Ctxt> &values, const helib::PubKey &pk);
+
+// Adds a tree of "reduce" tasks summing *values[i] pairwise into *values[0], for any number of values. ready[i] is
+// the task after which *values[i] is set; returns the task after which *values[0] holds the sum. Subtrees do not
+// wait for each other, so one whose inputs are ready early is summed while the rest are still being computed.
+TaskGraph::Node AddSumTree(TaskGraph &graph, const vector<helib::Ctxt *> &values, vector<TaskGraph::Node> ready);
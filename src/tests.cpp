@@ -3,8 +3,10 @@
 #include <vector>
 #include <fstream>
 #include <random>
+#include <sstream>
 
 #include "server.hpp"
+#include "bgzf.hpp"
 #include "globals.hpp"
 #include "tools.hpp"
 
@@ -301,6 +303,946 @@ TEST_F(SQUiDTest, CountAndKeySwitch)
     }
 }
 
+TEST_F(SQUiDTest, SaveAndLoadDB)
+{
+    SQUiDTest::serverInstance->SaveKeys("test_keys.bin");
+    SQUiDTest::serverInstance->SaveDB("test_db.bin");
+
+    Server loaded("test_keys.bin", false);
+    DBLoadStats stats = loaded.LoadDB("test_db.bin");
+    PrintDBLoadStats(stats);
+
+    ASSERT_EQ(loaded.GetCols(), SQUiDTest::serverInstance->GetCols());
+    ASSERT_EQ(loaded.GetCompressedRows(), SQUiDTest::serverInstance->GetCompressedRows());
+    ASSERT_EQ(stats.num_ciphertexts, num_cols * loaded.GetCompressedRows());
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = loaded.Decrypt(loaded.PRSQuery(query)[0]);
+
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]), result[i]);
+    }
+
+    std::remove("test_keys.bin");
+    std::remove("test_db.bin");
+}
+
+TEST_F(SQUiDTest, MapDB)
+{
+    SQUiDTest::serverInstance->SaveKeys("test_keys.bin");
+    SQUiDTest::serverInstance->SaveDB("test_db.bin");
+
+    Server mapped("test_keys.bin", false);
+    mapped.MapDB("test_db.bin");
+
+    ASSERT_EQ(mapped.GetCols(), SQUiDTest::serverInstance->GetCols());
+    ASSERT_EQ(mapped.GetCompressedRows(), SQUiDTest::serverInstance->GetCompressedRows());
+
+    vector<pair<uint32_t, uint32_t>> query;
+    query = vector<pair<uint32_t, uint32_t>>{pair(0, 1), pair(1, 0)};
+    auto result = mapped.Decrypt(mapped.CountQuery(true, query));
+    auto expected = SQUiDTest::serverInstance->Decrypt(SQUiDTest::serverInstance->CountQuery(true, query));
+    ASSERT_EQ(result[0], expected[0]);
+
+    ASSERT_THROW(mapped.UpdateOneValue(0, 0, 1), invalid_argument);
+
+    std::remove("test_keys.bin");
+    std::remove("test_db.bin");
+}
+
+TEST_F(SQUiDTest, ColumnCacheSpillsToDisk)
+{
+    SQUiDTest::serverInstance->SaveKeys("test_keys.bin");
+
+    // A one byte budget leaves room for the column in use only, so every other column is spilled
+    Server cached("test_keys.bin", false);
+    cached.SetMemoryBudget(1, "test_spill.bin");
+    cached.SetData(*fake_db);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = cached.Decrypt(cached.PRSQuery(query)[0]);
+
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]), result[i]);
+    }
+
+    ColumnCacheStats stats = cached.GetCacheStats();
+    PrintColumnCacheStats(stats);
+    ASSERT_GE(stats.misses, num_cols - 1);
+    ASSERT_GE(stats.evictions, num_cols - 1);
+    ASSERT_GT(stats.spilled_bytes, 0);
+
+    std::remove("test_keys.bin");
+}
+
+TEST_F(SQUiDTest, CompressedColdColumns)
+{
+    Server compressed(constants::P131, false);
+    compressed.SetCompression(1);
+    compressed.SetData(*fake_db);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = compressed.Decrypt(compressed.PRSQuery(query)[0]);
+
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]), result[i]);
+    }
+
+    ColumnCacheStats stats = compressed.GetCacheStats();
+    PrintColumnCacheStats(stats);
+    ASSERT_EQ(stats.compressed_columns, num_cols);
+
+    // Only the last column queried stays hot, the others are held compressed
+    ColumnMemory cold = compressed.StorageOfColumn(0);
+    ColumnMemory hot = compressed.StorageOfColumn(num_cols - 1);
+    cout << "Cold column: " << cold.resident_bytes << " B of " << cold.full_bytes << " B" << endl;
+    ASSERT_FALSE(cold.hot);
+    ASSERT_TRUE(hot.hot);
+    ASSERT_EQ(cold.resident_bytes, cold.compressed_bytes);
+}
+
+TEST_F(SQUiDTest, SeededDBFile)
+{
+    SQUiDTest::serverInstance->SaveKeys("test_keys.bin");
+    SQUiDTest::serverInstance->SaveDB("test_db.bin");
+    SQUiDTest::serverInstance->SaveDB("test_seeded_db.bin", true);
+
+    uint64_t full_size = std::ifstream("test_db.bin", std::ios::binary | std::ios::ate).tellg();
+    uint64_t seeded_size = std::ifstream("test_seeded_db.bin", std::ios::binary | std::ios::ate).tellg();
+    cout << "Database file: " << full_size << " B, seeded: " << seeded_size << " B" << endl;
+    ASSERT_LT(seeded_size, full_size * 6 / 10);
+
+    Server loaded("test_keys.bin", false);
+    loaded.LoadDB("test_seeded_db.bin");
+    Server mapped("test_keys.bin", false);
+    mapped.MapDB("test_seeded_db.bin");
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto loaded_result = loaded.Decrypt(loaded.PRSQuery(query)[0]);
+    auto mapped_result = mapped.Decrypt(mapped.PRSQuery(query)[0]);
+
+    for (int i = 0; i < num_rows; i++)
+    {
+        long expected = (long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]);
+        ASSERT_EQ(expected, loaded_result[i]);
+        ASSERT_EQ(expected, mapped_result[i]);
+    }
+
+    std::remove("test_keys.bin");
+    std::remove("test_db.bin");
+    std::remove("test_seeded_db.bin");
+}
+
+TEST_F(SQUiDTest, PackedDB)
+{
+    Server packed(constants::P131, false);
+    packed.SetPacking(2);
+    packed.SetData(*fake_db);
+    ASSERT_EQ(packed.GetCols(), num_cols);
+    ASSERT_THROW(packed.SetPacking(3), invalid_argument);
+
+    vector<pair<uint32_t, int>> prs_query;
+    prs_query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 2), pair(2, 3)};
+    auto prs = packed.Decrypt(packed.PRSQuery(prs_query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + 2 * (*fake_db)[1][i] + 3 * (*fake_db)[2][i]), prs[i]);
+    }
+
+    vector<pair<uint32_t, uint32_t>> query;
+    query = vector<pair<uint32_t, uint32_t>>{pair(0, 1), pair(1, 0)};
+    auto count = packed.Decrypt(packed.CountQuery(true, query));
+    auto maf = packed.Decrypt(packed.MAFQuery(2, true, query));
+    auto expected_count = SQUiDTest::serverInstance->Decrypt(SQUiDTest::serverInstance->CountQuery(true, query));
+    auto expected_maf = SQUiDTest::serverInstance->Decrypt(SQUiDTest::serverInstance->MAFQuery(2, true, query));
+    ASSERT_EQ(count[0], expected_count[0]);
+    ASSERT_EQ(maf[0], expected_maf[0]);
+    ASSERT_EQ(maf[1], expected_maf[1]);
+
+    // A genotype above 2 would carry into the digit of the next SNP
+    ASSERT_THROW(packed.UpdateOneValue(0, 0, 3), invalid_argument);
+
+    // The layout travels with the database file
+    packed.SaveKeys("test_keys.bin");
+    packed.SaveDB("test_packed_db.bin");
+    Server loaded("test_keys.bin", false);
+    loaded.LoadDB("test_packed_db.bin");
+    ASSERT_EQ(loaded.GetCols(), num_cols);
+    auto loaded_prs = loaded.Decrypt(loaded.PRSQuery(prs_query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ(prs[i], loaded_prs[i]);
+    }
+
+    std::remove("test_keys.bin");
+    std::remove("test_packed_db.bin");
+}
+
+TEST_F(SQUiDTest, IngestVCF)
+{
+    const char *genotypes[] = {"0|0", "0/1", "1|0", "1/1:35", "./."};
+
+    std::ofstream vcf("test.vcf");
+    vcf << "##fileformat=VCFv4.1" << endl;
+    vcf << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for (int j = 0; j < num_rows; j++)
+    {
+        vcf << "\tS" << j;
+    }
+    vcf << endl;
+    for (int i = 0; i < num_cols; i++)
+    {
+        vcf << "22\t" << 1000 + i << "\trs" << i << "\tG\tA\t100\tPASS\t.\tGT";
+        for (int j = 0; j < num_rows; j++)
+        {
+            vcf << "\t" << genotypes[(i + j) % 5];
+        }
+        vcf << endl;
+    }
+    vcf.close();
+
+    ASSERT_EQ(DecodeGenotype("1|1:0.98"), 2u);
+    ASSERT_EQ(DecodeGenotype("./1"), 1u);
+    ASSERT_THROW(DecodeGenotype("x/1"), invalid_argument);
+
+    Server ingested(constants::P131, false);
+    IngestStats stats = ingested.SetData("test.vcf");
+    PrintIngestStats(stats);
+    ASSERT_EQ(stats.variants, num_cols);
+    ASSERT_EQ(stats.samples, num_rows);
+    ASSERT_EQ(ingested.GetHeaders()[num_cols - 1], "rs" + to_string(num_cols - 1));
+
+    // Streaming into a database file gives the same columns
+    ingested.SaveKeys("test_keys.bin");
+    ingested.IngestVCF("test.vcf", "test_db.bin", 3);
+    Server mapped("test_keys.bin", false);
+    mapped.MapDB("test_db.bin");
+
+    long expected_genotypes[] = {0, 1, 1, 2, 0};
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = ingested.Decrypt(ingested.PRSQuery(query)[0]);
+    auto mapped_result = mapped.Decrypt(mapped.PRSQuery(query)[0]);
+    for (int j = 0; j < num_rows; j++)
+    {
+        long expected = 0;
+        for (int i = 0; i < num_cols; i++)
+        {
+            expected += expected_genotypes[(i + j) % 5];
+        }
+        ASSERT_EQ(expected, result[j]);
+        ASSERT_EQ(expected, mapped_result[j]);
+    }
+
+    std::remove("test.vcf");
+    std::remove("test_keys.bin");
+    std::remove("test_db.bin");
+}
+
+TEST_F(SQUiDTest, IngestBGZF)
+{
+    std::ostringstream vcf;
+    vcf << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for (int j = 0; j < num_rows; j++)
+    {
+        vcf << "\tS" << j;
+    }
+    vcf << endl;
+    for (int i = 0; i < num_cols; i++)
+    {
+        vcf << "22\t" << 1000 + i << "\trs" << i << "\tG\tA\t100\tPASS\t.\tGT";
+        for (int j = 0; j < num_rows; j++)
+        {
+            vcf << "\t" << ((*fake_db)[i][j] ? "0|1" : "0|0");
+        }
+        vcf << endl;
+    }
+
+    // Small blocks so lines span several blocks
+    BGZFWriter writer("test.vcf.gz", 100);
+    writer.Write(vcf.str());
+    writer.Close();
+    ASSERT_TRUE(IsBGZF("test.vcf.gz"));
+
+    Server ingested(constants::P131, false);
+    IngestStats stats = ingested.SetData("test.vcf.gz");
+    ASSERT_EQ(stats.variants, num_cols);
+    ASSERT_EQ(stats.samples, num_rows);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = ingested.Decrypt(ingested.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]), result[i]);
+    }
+
+    std::remove("test.vcf.gz");
+}
+
+TEST_F(SQUiDTest, IngestPLINK)
+{
+    // 2-bit codes of 0, 1 and 2 A1 alleles
+    const unsigned char codes[] = {3, 2, 0};
+
+    std::ofstream fam("test.fam");
+    for (int j = 0; j < num_rows; j++)
+    {
+        fam << "F" << j << " S" << j << " 0 0 0 -9" << endl;
+    }
+    fam.close();
+
+    std::ofstream bim("test.bim");
+    std::ofstream bed("test.bed", std::ios::binary);
+    bed.put(0x6c).put(0x1b).put(0x01);
+    for (int i = 0; i < num_cols; i++)
+    {
+        bim << "22\trs" << i << "\t0\t" << 1000 + i << "\tA\tG" << endl;
+        for (int j = 0; j < num_rows; j += 4)
+        {
+            unsigned char byte = 0;
+            for (int k = 0; k < 4 && j + k < num_rows; k++)
+            {
+                byte |= codes[(*fake_db)[i][j + k]] << (2 * k);
+            }
+            bed.put(byte);
+        }
+    }
+    bim.close();
+    bed.close();
+
+    Server ingested(constants::P131, false);
+    IngestStats stats = ingested.SetDataPLINK("test");
+    PrintIngestStats(stats);
+    ASSERT_EQ(ingested.GetCols(), num_cols);
+    ASSERT_EQ(ingested.GetHeaders()[1], "rs1");
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = ingested.Decrypt(ingested.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]), result[i]);
+    }
+
+    std::remove("test.fam");
+    std::remove("test.bim");
+    std::remove("test.bed");
+}
+
+TEST_F(SQUiDTest, BulkEncryption)
+{
+    Server bulk(constants::P131, false);
+    bulk.SetEncryptionThreads(3);
+    bulk.SetData(*fake_db);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = bulk.Decrypt(bulk.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i]), result[i]);
+    }
+
+    ThreadPool pool(2);
+    ASSERT_THROW(pool.ParallelFor(8, [](size_t i)
+                                  { if (i == 5) throw invalid_argument("ERROR: test"); }),
+                 invalid_argument);
+}
+
+TEST_F(SQUiDTest, ZeroPoolUpdates)
+{
+    Server pooled(constants::P131, false);
+    pooled.SetData(*fake_db);
+    pooled.SetZeroPool(2, 1);
+
+    // More updates than the pool holds, so some of them fall back to encrypting on the spot
+    for (int i = 0; i < 6; i++)
+    {
+        pooled.UpdateOneValue(i, 0, 1);
+    }
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1)};
+    auto result = pooled.Decrypt(pooled.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (i < 6 ? 1 : 0)), result[i]);
+    }
+
+    ZeroPoolStats stats = pooled.GetZeroPoolStats();
+    ASSERT_EQ(stats.capacity, 2u);
+    ASSERT_LE(stats.depth, stats.capacity);
+    ASSERT_EQ(stats.hits + stats.misses, 6u);
+    // Every hit took an encryption of zero the refill threads made
+    ASSERT_GE(stats.generated, stats.hits + stats.depth);
+    ASSERT_GT(stats.latency_p50, 0);
+    ASSERT_LE(stats.latency_p50, stats.latency_p95);
+    ASSERT_LE(stats.latency_p95, stats.latency_p99);
+
+    pooled.SetZeroPool(0);
+    ASSERT_EQ(pooled.GetZeroPoolStats().capacity, 0u);
+}
+
+TEST_F(SQUiDTest, BufferedUpdates)
+{
+    Server buffered(constants::P131, false);
+    buffered.SetData(*fake_db);
+    // Long enough that only the query merges
+    buffered.SetUpdateBuffering(60000);
+
+    vector<uint32_t> vals = vector<uint32_t>{1, 1, 1};
+    for (uint32_t row = 0; row < 5; row++)
+    {
+        buffered.UpdateOneRow(row, vals);
+    }
+    buffered.UpdateOneValue(0, 0, 1);
+
+    // All the edits fall in compressed row 0, so one ciphertext per column is pending
+    DeltaBufferStats stats = buffered.GetDeltaBufferStats();
+    ASSERT_EQ(stats.pending_ciphertexts, 3u);
+    ASSERT_EQ(stats.pending_cells, 16u);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = buffered.Decrypt(buffered.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        long expected = (*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i] + (i < 5 ? 3 : 0) + (i == 0 ? 1 : 0);
+        ASSERT_EQ(expected, result[i]);
+    }
+
+    stats = buffered.GetDeltaBufferStats();
+    ASSERT_EQ(stats.pending_ciphertexts, 0u);
+    ASSERT_EQ(stats.merged_ciphertexts, 3u);
+    ASSERT_EQ(stats.merged_cells, 16u);
+
+    ASSERT_THROW(buffered.UpdateOneValue(0, 3, 1), out_of_range);
+    buffered.SetUpdateBuffering(0);
+}
+
+TEST_F(SQUiDTest, AppendRows)
+{
+    Server growing(constants::P131, false);
+    growing.SetData(*fake_db);
+    uint32_t slots = growing.GetSlotSize();
+
+    // Fills the rest of the last compressed row and spills into a new one
+    vector<vector<uint32_t>> batch = vector<vector<uint32_t>>(num_cols, vector<uint32_t>(slots));
+    for (int i = 0; i < num_cols; i++)
+    {
+        for (uint32_t j = 0; j < slots; j++)
+        {
+            batch[i][j] = (i + j) % 3;
+        }
+    }
+    growing.AppendRows(batch);
+    ASSERT_EQ(growing.GetCompressedRows(), (num_rows + slots + slots - 1) / slots);
+
+    vector<uint32_t> patient = vector<uint32_t>{1, 2, 1};
+    growing.InsertOneRow(patient);
+
+    std::ofstream vcf("test_append.vcf");
+    vcf << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tS0\tS1" << endl;
+    for (int i = num_cols - 1; i >= 0; i--)
+    {
+        vcf << "22\t" << 1000 + i << "\tsnp" << i << "\tG\tA\t100\tPASS\t.\tGT\t0|0\t1|1" << endl;
+    }
+    vcf.close();
+
+    vector<string> headers = vector<string>{"snp0", "snp1", "snp2"};
+    growing.SetColumnHeaders(headers);
+    IngestStats stats = growing.AppendVCF("test_append.vcf");
+    ASSERT_EQ(stats.samples, 2u);
+
+    vector<uint32_t> expected;
+    for (int j = 0; j < num_rows; j++)
+    {
+        expected.push_back((*fake_db)[0][j] + (*fake_db)[1][j] + (*fake_db)[2][j]);
+    }
+    for (uint32_t j = 0; j < slots; j++)
+    {
+        expected.push_back(batch[0][j] + batch[1][j] + batch[2][j]);
+    }
+    expected.push_back(4);
+    expected.push_back(0);
+    expected.push_back(6);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    vector<helib::Ctxt> result = growing.PRSQuery(query);
+    ASSERT_EQ(result.size(), (expected.size() + slots - 1) / slots);
+    for (uint32_t r = 0; r < result.size(); r++)
+    {
+        vector<long> decrypted = growing.Decrypt(result[r]);
+        for (uint32_t k = 0; k < slots; k++)
+        {
+            uint32_t j = r * slots + k;
+            ASSERT_EQ(j < expected.size() ? (long)expected[j] : 0, decrypted[k]);
+        }
+    }
+
+    ASSERT_THROW(growing.UpdateOneValue(expected.size(), 0, 1), out_of_range);
+    std::remove("test_append.vcf");
+}
+
+TEST_F(SQUiDTest, DeleteRowsWithValidityMask)
+{
+    Server deleting(constants::P131, false);
+    deleting.SetData(*fake_db);
+    deleting.DeleteRow(3);
+    deleting.DeleteRowMultiplication(7);
+    deleting.DeleteRowAddition(50);
+
+    vector<pair<uint32_t, uint32_t>> query;
+    query = vector<pair<uint32_t, uint32_t>>{pair(0, 0), pair(1, 1)};
+
+    int true_count = 0;
+    for (int i = 0; i < num_rows; i++)
+    {
+        if (i != 3 && i != 7 && i != 50 && (*fake_db)[0][i] == 0 && (*fake_db)[1][i] == 1)
+        {
+            true_count++;
+        }
+    }
+    ASSERT_EQ(true_count, deleting.Decrypt(deleting.CountQuery(1, query))[0]);
+
+    // Deletes survive a round trip through the database file
+    deleting.SaveKeys("test_keys.bin");
+    deleting.SaveDB("test_db.bin");
+    Server loaded("test_keys.bin", false);
+    loaded.LoadDB("test_db.bin");
+    ASSERT_EQ(true_count, loaded.Decrypt(loaded.CountQuery(1, query))[0]);
+
+    vector<pair<uint32_t, int>> prs_query;
+    prs_query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = loaded.Decrypt(loaded.PRSQuery(prs_query)[0]);
+    ASSERT_EQ(result[3], 0);
+    ASSERT_EQ(result[7], 0);
+    ASSERT_EQ(result[50], 0);
+
+    ASSERT_THROW(deleting.DeleteRow(num_rows), out_of_range);
+
+    std::remove("test_keys.bin");
+    std::remove("test_db.bin");
+}
+
+TEST_F(SQUiDTest, CompactDeletedRows)
+{
+    Server compacting(constants::P131, false);
+    compacting.SetData(*fake_db);
+    uint32_t slots = compacting.GetSlotSize();
+
+    // A second compressed row whose rows are all deleted again, plus one row of the first
+    vector<vector<uint32_t>> batch = vector<vector<uint32_t>>(num_cols, vector<uint32_t>(slots, 1));
+    compacting.AppendRows(batch);
+    for (uint32_t row = num_rows; row < num_rows + slots; row++)
+    {
+        compacting.DeleteRow(row);
+    }
+    compacting.DeleteRow(5);
+
+    compacting.StartCompaction();
+    CompactionStats stats = compacting.WaitForCompaction();
+    PrintCompactionStats(stats);
+    ASSERT_TRUE(stats.published);
+    ASSERT_EQ(stats.live_rows, (uint32_t)num_rows - 1);
+    ASSERT_EQ(stats.removed_rows, slots + 1);
+    ASSERT_EQ(stats.reclaimed_ciphertexts, (uint64_t)num_cols * (stats.compressed_rows_before - stats.compressed_rows_after));
+    ASSERT_EQ(compacting.GetCompressedRows(), stats.compressed_rows_after);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = compacting.Decrypt(compacting.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows - 1; i++)
+    {
+        int j = i < 5 ? i : i + 1;
+        ASSERT_EQ((long)((*fake_db)[0][j] + (*fake_db)[1][j] + (*fake_db)[2][j]), result[i]);
+    }
+
+    // The slot of a deleted row is handed to the next insert
+    compacting.DeleteRow(10);
+    vector<uint32_t> patient = vector<uint32_t>{1, 1, 1};
+    ASSERT_EQ(compacting.InsertOneRow(patient), 10u);
+    result = compacting.Decrypt(compacting.PRSQuery(query)[0]);
+    ASSERT_EQ(result[10], 3);
+}
+
+TEST_F(SQUiDTest, NoiseRefresh)
+{
+    Server refreshing(constants::P131, false);
+    refreshing.SetData(*fake_db);
+
+    NoiseHistogram before = refreshing.GetNoiseHistogram(0);
+    ASSERT_GT(before.max_bits, 0);
+
+    // Above the capacity of any ciphertext, so every stored ciphertext is queued and then every updated one
+    refreshing.SetRefreshThreshold(1 << 20);
+    auto wait_for = [&](uint64_t refreshed)
+    {
+        for (int i = 0; i < 600 && refreshing.GetRefreshStats().refreshed + refreshing.GetRefreshStats().stale < refreshed; i++)
+        {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    };
+    wait_for(num_cols * refreshing.GetCompressedRows());
+    refreshing.UpdateOneValue(0, 0, 1);
+    wait_for(num_cols * refreshing.GetCompressedRows() + 1);
+
+    RefreshStats stats = refreshing.GetRefreshStats();
+    ASSERT_EQ(stats.queued, num_cols * refreshing.GetCompressedRows() + 1);
+    ASSERT_EQ(stats.pending, 0u);
+    refreshing.SetRefreshThreshold(0);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    auto result = refreshing.Decrypt(refreshing.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (*fake_db)[2][i] + (i == 0 ? 1 : 0)), result[i]);
+    }
+}
+
+TEST_F(SQUiDTest, WALRecovery)
+{
+    Server logging(constants::P131, false);
+    logging.SetData(*fake_db);
+    logging.SaveKeys("test_keys.bin");
+    // Every change below waits for its group commit, so it is on disk when it returns
+    logging.EnableWAL("test_wal.log", "test_checkpoint.bin", 1);
+
+    vector<uint32_t> patient = vector<uint32_t>{1, 1, 1};
+    logging.UpdateOneValue(0, 0, 1);
+    logging.DeleteRow(5);
+    logging.Checkpoint();
+    ASSERT_EQ(logging.InsertOneRow(patient), 5u);
+    logging.DeleteRow(7);
+    vector<vector<uint32_t>> appended = vector<vector<uint32_t>>(num_cols, vector<uint32_t>(2, 1));
+    logging.AppendRows(appended);
+
+    WALStats stats = logging.GetWALStats();
+    PrintWALStats(stats);
+    ASSERT_EQ(stats.last_lsn, 5u);
+    ASSERT_EQ(stats.durable_lsn, 5u);
+
+    // A record torn by a crash
+    {
+        ofstream wal("test_wal.log", ios::binary | ios::app);
+        wal << "torn";
+    }
+
+    Server recovered("test_keys.bin", false);
+    WALReplayStats replay = recovered.Recover("test_wal.log", "test_checkpoint.bin", 0);
+    PrintWALReplayStats(replay);
+    ASSERT_EQ(replay.replayed, 3u);
+    ASSERT_EQ(replay.last_lsn, 5u);
+    ASSERT_TRUE(replay.torn);
+
+    vector<uint32_t> expected;
+    for (int j = 0; j < num_rows; j++)
+    {
+        expected.push_back((*fake_db)[0][j] + (*fake_db)[1][j] + (*fake_db)[2][j]);
+    }
+    expected[0]++;
+    expected[5] = 3;
+    expected[7] = 0;
+    expected.push_back(3);
+    expected.push_back(3);
+
+    uint32_t slots = recovered.GetSlotSize();
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1), pair(2, 1)};
+    vector<helib::Ctxt> result = recovered.PRSQuery(query);
+    ASSERT_EQ(result.size(), (expected.size() + slots - 1) / slots);
+    for (uint32_t r = 0; r < result.size(); r++)
+    {
+        vector<long> decrypted = recovered.Decrypt(result[r]);
+        for (uint32_t k = 0; k < slots; k++)
+        {
+            uint32_t j = r * slots + k;
+            ASSERT_EQ(j < expected.size() ? (long)expected[j] : 0, decrypted[k]);
+        }
+    }
+
+    // Logging goes on after the last record replayed
+    recovered.DeleteRow(0);
+    ASSERT_EQ(recovered.GetWALStats().last_lsn, 6u);
+
+    std::remove("test_keys.bin");
+    std::remove("test_wal.log");
+    std::remove("test_checkpoint.bin");
+}
+
+TEST_F(SQUiDTest, SnapshotIsolation)
+{
+    Server versioned(constants::P131, false);
+    versioned.SetData(*fake_db);
+
+    // A snapshot keeps reading the version it was taken at while an update goes into a copy
+    ColumnStore store;
+    vector<ColumnStore::Column> columns = vector<ColumnStore::Column>(1);
+    columns[0].push_back(versioned.Encrypt(1));
+    store.Assign(move(columns));
+    {
+        shared_ptr<const ColumnStore::Snapshot> snapshot = store.TakeSnapshot();
+        helib::Ctxt delta = versioned.Encrypt(1);
+        store.Update(0, 0, [&](helib::Ctxt &stored)
+                     { stored += delta; });
+        store.Update(0, 0, [&](helib::Ctxt &stored)
+                     { stored += delta; });
+        ASSERT_EQ(versioned.Decrypt((*snapshot)[0][0])[0], 1);
+        ASSERT_EQ(versioned.Decrypt(store[0][0])[0], 3);
+        ASSERT_EQ(store.CacheStats().copied_versions, 1u);
+        ASSERT_EQ(store.CacheStats().retained_versions, 1u);
+    }
+    ASSERT_EQ(store.CacheStats().retained_versions, 0u);
+
+    // Updates applied in row order while queries run, so every query sees them up to some row and none after it
+    thread updater([&]
+                   {
+        for (uint32_t row = 0; row < 10; row++)
+        {
+            versioned.UpdateOneValue(row, 0, 1);
+        } });
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1)};
+    for (int q = 0; q < 3; q++)
+    {
+        auto result = versioned.Decrypt(versioned.PRSQuery(query)[0]);
+        int applied = 0;
+        while (applied < 10 && result[applied] == (long)(*fake_db)[0][applied] + 1)
+        {
+            applied++;
+        }
+        for (int i = applied; i < num_rows; i++)
+        {
+            ASSERT_EQ((long)(*fake_db)[0][i], result[i]);
+        }
+    }
+    updater.join();
+
+    auto result = versioned.Decrypt(versioned.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (i < 10 ? 1 : 0)), result[i]);
+    }
+}
+
+TEST_F(SQUiDTest, ParallelQueriesAcrossRows)
+{
+    Server spread(constants::P131, false);
+    uint32_t slots = spread.GetSlotSize();
+
+    // Three compressed rows, the last partly filled, with few enough matches to count below p
+    uint32_t rows = 2 * slots + 7;
+    vector<vector<uint32_t>> data = vector<vector<uint32_t>>(4, vector<uint32_t>(rows));
+    for (uint32_t j = 0; j < rows; j++)
+    {
+        data[0][j] = j % 2;
+        data[1][j] = (j / 2) % 2;
+        data[2][j] = j % slots < 5 ? 1 : 0;
+        data[3][j] = j % 3;
+    }
+    spread.SetData(data);
+
+    vector<pair<uint32_t, uint32_t>> query = vector<pair<uint32_t, uint32_t>>{pair(0, 1), pair(1, 0), pair(2, 1)};
+    long true_count = 0;
+    long true_freq = 0;
+    for (uint32_t j = 0; j < rows; j++)
+    {
+        if (data[0][j] == 1 && data[1][j] == 0 && data[2][j] == 1)
+        {
+            true_count++;
+            true_freq += data[3][j];
+        }
+    }
+
+    // One thread and a queue of one run nearly every task inline on the thread readying it
+    for (auto [threads, max_queued] : vector<pair<uint32_t, size_t>>{{1, 1}, {2, QUERY_EXECUTOR_MAX_QUEUED}, {8, QUERY_EXECUTOR_MAX_QUEUED}})
+    {
+        spread.SetQueryThreads(threads, max_queued);
+
+        ASSERT_EQ(true_count, spread.Decrypt(spread.CountQueryP(query))[0]);
+
+        vector<long> maf = spread.Decrypt(spread.MAFQueryP(3, query));
+        ASSERT_EQ(true_freq, maf[0]);
+        ASSERT_EQ(2 * true_count, maf[1]);
+    }
+
+    // Each equality test and mask of both queries ran as a task of its own on the last executor
+    ExecutorStats stats = spread.GetExecutorStats();
+    ASSERT_EQ(stats.threads, 8u);
+    ASSERT_EQ(stats.graphs, 2u);
+    ASSERT_EQ(stats.timings["eqtest"].count, 2 * 3 * query.size());
+    ASSERT_EQ(stats.timings["mask"].count, 2 * 3u);
+    spread.SetQueryThreads(0);
+}
+
+TEST_F(SQUiDTest, ProductTreeAnyArity)
+{
+    // Operands of equal capacity make a balanced tree, one with less capacity left is multiplied in last
+    ProductTreePlan plan = PlanProductTree(vector<long>(5, 100), 10);
+    ASSERT_EQ(plan.steps.size(), 4u);
+    ASSERT_EQ(plan.depth, 3u);
+    plan = PlanProductTree(vector<long>{100, 40, 100, 100}, 10);
+    ASSERT_EQ(plan.steps.back().into, 0u);
+    ASSERT_EQ(plan.steps.back().from, 1u);
+
+    Server *server = SQUiDTest::serverInstance.get();
+    uint32_t slots = server->GetSlotSize();
+    for (uint32_t operands : {1u, 2u, 3u, 5u, 7u, 8u})
+    {
+        vector<helib::Ctxt> values;
+        vector<long> expected(slots, 1);
+        for (uint32_t k = 0; k < operands; k++)
+        {
+            vector<unsigned long> bits(slots);
+            for (uint32_t i = 0; i < slots; i++)
+            {
+                bits[i] = (i >> k) % 2 == 0 || i % 3 == 0 ? 1 : 0;
+                expected[i] *= bits[i];
+            }
+            values.push_back(server->Encrypt(bits));
+        }
+
+        for (bool lazy : {true, false})
+        {
+            vector<helib::Ctxt> operand_copies = values;
+            ProductTreeStats stats;
+            helib::Ctxt product = MultiplyTree(operand_copies, server->GetProductBits(), lazy, &stats);
+            ASSERT_EQ(server->Decrypt(product), expected);
+            ASSERT_EQ(stats.depth, (uint32_t)ceil(log2(operands)));
+            ASSERT_EQ(stats.multiplications, operands - 1);
+            // Lazily, neither the operands nor the product itself need relinearizing
+            ASSERT_EQ(stats.key_switches, lazy ? max(operands, 2u) - 2 : operands - 1);
+        }
+    }
+}
+
+TEST_F(SQUiDTest, SumManyAnyLength)
+{
+    Server *server = SQUiDTest::serverInstance.get();
+    const helib::PubKey &pk = server->GetMeta().data->publicKey;
+
+    vector<helib::Ctxt> none;
+    ASSERT_TRUE(SumMany(none, pk).isEmpty());
+
+    // Lengths around the run size, and enough runs for an uneven tree
+    for (uint32_t length : {1u, 7u, 8u, 9u, 17u, 100u})
+    {
+        vector<helib::Ctxt> values;
+        long expected = 0;
+        for (uint32_t i = 0; i < length; i++)
+        {
+            values.push_back(server->Encrypt(i % 2));
+            expected += i % 2;
+        }
+        QueryExecutor()->ResetStats();
+        ASSERT_EQ(server->Decrypt(SumMany(values, pk))[0], expected);
+
+        // One task per run and one per pairwise addition of the run sums, unless a single run is summed directly
+        ExecutorStats stats = QueryExecutor()->Stats();
+        uint64_t runs = (length + SUM_TREE_CHUNK - 1) / SUM_TREE_CHUNK;
+        ASSERT_EQ(stats.graphs, runs > 1 ? 1u : 0u);
+        ASSERT_EQ(stats.timings["sum"].count, runs > 1 ? runs : 0);
+        ASSERT_EQ(stats.timings["reduce"].count, runs > 1 ? runs - 1 : 0);
+    }
+}
+
+TEST_F(SQUiDTest, SumSlotsAlongHypercube)
+{
+    Server *server = SQUiDTest::serverInstance.get();
+    const helib::EncryptedArray &ea = server->GetMeta().data->context.getEA();
+    uint32_t slots = server->GetSlotSize();
+    long p = server->GetMeta().data->context.getP();
+
+    vector<unsigned long> values(slots);
+    long total = 0;
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        values[i] = i % 3;
+        total = (total + i % 3) % p;
+    }
+
+    // Only native dimensions with a key-switching matrix for every power of their generator are hoisted
+    const helib::PubKey &pk = server->GetMeta().data->publicKey;
+    bool hoistable = false;
+    for (long dim = 0; dim < ea.dimension(); dim++)
+    {
+        hoistable = hoistable || (ea.nativeDimension(dim) && pk.getKSStrategy(dim) == HELIB_KSS_FULL);
+    }
+
+    // Without hoisting, and with radices that split the dimensions differently
+    for (long max_radix : {1L, 2L, 4L, 8L})
+    {
+        helib::Ctxt ctxt = server->Encrypt(values);
+        SlotSumStats stats;
+        SumSlots(ea, ctxt, max_radix, &stats);
+        ASSERT_EQ(server->Decrypt(ctxt), vector<long>(slots, total));
+        ASSERT_EQ(stats.hoisted_steps > 0, max_radix > 1 && hoistable);
+        // A hoisted rotation is one key switch and a plain one at least one
+        ASSERT_GE(stats.key_switches, stats.rotations);
+        ASSERT_EQ(stats.plain_rotations == stats.rotations, stats.hoisted_steps == 0);
+    }
+
+    helib::Ctxt single = server->Encrypt(vector<unsigned long>{7});
+    server->CtxtExpand(single);
+    ASSERT_EQ(server->Decrypt(single), vector<long>(slots, 7));
+
+    helib::Ctxt masked = server->Encrypt(values);
+    vector<long> expected(slots, 0);
+    expected[1] = total;
+    ASSERT_EQ(server->Decrypt(server->SquashCtxtWithMask(masked, 1)), expected);
+}
+
+TEST_F(SQUiDTest, CompressionTurnedOff)
+{
+    Server server(constants::P131, false);
+    server.SetCompression(1);
+    server.SetData(*fake_db);
+    server.SetCompression(0);
+
+    // The cold columns were only held deflated, so turning compression off has to keep them in memory
+    ColumnCacheStats stats = server.GetCacheStats();
+    ASSERT_EQ(stats.compressed_columns, 0u);
+    server.UpdateOneValue(0, 0, 1);
+
+    vector<pair<uint32_t, int>> query;
+    query = vector<pair<uint32_t, int>>{pair(0, 1), pair(1, 1)};
+    auto result = server.Decrypt(server.PRSQuery(query)[0]);
+    for (int i = 0; i < num_rows; i++)
+    {
+        ASSERT_EQ((long)((*fake_db)[0][i] + (*fake_db)[1][i] + (i == 0 ? 1 : 0)), result[i]);
+    }
+}
+
+TEST_F(SQUiDTest, PackedMAFRangeQuery)
+{
+    Server packed(constants::P131, true);
+    packed.SetPacking(2);
+    // Every value is within the range, so each row counts
+    packed.GenContinuousData(num_rows, 1, 50);
+    packed.SetData(*fake_db);
+
+    auto [freq, count] = packed.MAFRangeQuery(1, 1, 60);
+    long expected = 0;
+    for (int i = 0; i < num_rows; i++)
+    {
+        expected += (*fake_db)[1][i];
+    }
+    ASSERT_EQ(packed.Decrypt(freq)[0], expected % 131);
+    // The padding slots past the last row hold continuous values too
+    long slots = packed.GetSlotSize();
+    ASSERT_EQ(packed.Decrypt(count)[0], (num_rows + slots - 1) / slots * slots % 131);
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,105 @@
+#include "thread_pool.hpp"
+
+using namespace std;
+
+ThreadPool::ThreadPool(uint32_t num_threads, function<void()> init_worker)
+{
+    for (uint32_t t = 0; t < max<uint32_t>(num_threads, 1); t++)
+    {
+        workers.emplace_back(&ThreadPool::Work, this, init_worker);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        stop = true;
+    }
+    job_cv.notify_all();
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const function<void(size_t)> &fn)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    lock_guard<mutex> call_lock(call_mutex);
+
+    shared_ptr<Job> current = make_shared<Job>();
+    current->fn = &fn;
+    current->count = count;
+
+    unique_lock<mutex> lock(pool_mutex);
+    job = current;
+    generation++;
+    job_cv.notify_all();
+
+    done_cv.wait(lock, [&]
+                 { return current->done == count; });
+    job = nullptr;
+
+    if (current->error)
+    {
+        rethrow_exception(current->error);
+    }
+}
+
+void ThreadPool::Work(const function<void()> &init_worker)
+{
+    if (init_worker)
+    {
+        init_worker();
+    }
+
+    uint64_t seen = 0;
+    while (true)
+    {
+        shared_ptr<Job> current;
+        {
+            unique_lock<mutex> lock(pool_mutex);
+            job_cv.wait(lock, [&]
+                        { return stop || (job && generation != seen); });
+            if (stop)
+            {
+                return;
+            }
+            seen = generation;
+            current = job;
+        }
+        RunJob(*current);
+    }
+}
+
+void ThreadPool::RunJob(Job &current)
+{
+    // Indices are claimed one at a time; workers arriving after the last one is claimed simply go back to waiting
+    for (size_t i = current.next++; i < current.count; i = current.next++)
+    {
+        exception_ptr error;
+        try
+        {
+            (*current.fn)(i);
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+
+        lock_guard<mutex> lock(pool_mutex);
+        if (error && !current.error)
+        {
+            current.error = error;
+        }
+        if (++current.done == current.count)
+        {
+            done_cv.notify_all();
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+Fixed pool of worker threads
+
+ParallelFor hands the indices of a loop to the workers one at a time, so uneven iterations balance out
+across the pool, and returns once every iteration has run. The threads are kept between calls, so a pool
+can be reused for every bulk operation of a server without paying for thread start-up each time.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class ThreadPool
+{
+public:
+    // init_worker runs once on every worker thread before it takes any work
+    explicit ThreadPool(uint32_t num_threads, function<void()> init_worker = nullptr);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    uint32_t Size() const { return workers.size(); }
+
+    // Runs fn(i) for every i in [0, count) and waits for all of them. The first exception thrown is rethrown here.
+    void ParallelFor(size_t count, const function<void(size_t)> &fn);
+
+private:
+    struct Job
+    {
+        const function<void(size_t)> *fn;
+        size_t count;
+        atomic<size_t> next{0};
+        size_t done = 0;
+        exception_ptr error;
+    };
+
+    void Work(const function<void()> &init_worker);
+    void RunJob(Job &job);
+
+    vector<thread> workers;
+
+    mutex pool_mutex;
+    mutex call_mutex; // one ParallelFor at a time
+    condition_variable job_cv;
+    condition_variable done_cv;
+    shared_ptr<Job> job;
+    uint64_t generation = 0;
+    bool stop = false;
+};
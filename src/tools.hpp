@@ -78,6 +78,20 @@ struct Params
              other.ords,
              other.mvec)
   {}
+  // Only m, p, r and qbits are persisted; gens, ords and mvec are recovered from the context itself
+  void writeTo(std::ostream& str) const
+  {
+    const long fields[4] = {m, p, r, qbits};
+    str.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+  }
+  static Params readFrom(std::istream& str)
+  {
+    long fields[4];
+    str.read(reinterpret_cast<char*>(fields), sizeof(fields));
+    if (!str)
+      throw std::invalid_argument("ERROR: key file is truncated");
+    return Params(fields[0], fields[1], fields[2], fields[3]);
+  }
   bool operator!=(Params& other) const { return !(*this == other); }
   bool operator==(Params& other) const
   {
@@ -115,6 +129,23 @@ struct ContextAndKeys
       ea(context.getEA())
   {
   }
+
+  // Reads back what writeTo stored, so a restarted server keeps the keys its database was encrypted under
+  ContextAndKeys(std::istream& str) :
+      params(Params::readFrom(str)),
+      context(helib::Context::readFrom(str)),
+      secretKey(helib::SecKey::readFrom(str, context)),
+      publicKey(secretKey),
+      ea(context.getEA())
+  {
+  }
+
+  void writeTo(std::ostream& str) const
+  {
+    params.writeTo(str);
+    context.writeTo(str);
+    secretKey.writeTo(str);
+  }
 };
 
 struct Meta
@@ -125,4 +156,9 @@ struct Meta
     data = std::make_unique<ContextAndKeys>(params);
     return *this;
   }
+  Meta& operator()(std::istream& str)
+  {
+    data = std::make_unique<ContextAndKeys>(str);
+    return *this;
+  }
 };
\ No newline at end of file
@@ -0,0 +1,532 @@
+#include "vcf_ingest.hpp"
+#include "bgzf.hpp"
+#include "bounded_queue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+// Fixed fields in front of the samples: CHROM POS ID REF ALT QUAL FILTER INFO FORMAT
+const size_t VCF_ID_FIELD = 2;
+const size_t VCF_FIRST_SAMPLE_FIELD = 9;
+
+// Size of the read buffer of the reader stage
+const size_t VCF_READ_BUFFER = 1 << 20;
+
+// Items each queue holds per worker thread
+const size_t VCF_QUEUE_DEPTH = 4;
+
+struct RawLine
+{
+    uint64_t seq;
+    unique_ptr<string> text; // on the heap so the fields of the tokenized line stay valid while it moves
+};
+
+struct TokenizedLine
+{
+    uint64_t seq;
+    unique_ptr<string> text;
+    vector<string_view> fields;
+};
+
+struct EncryptJob
+{
+    uint32_t col;
+    uint32_t row;
+    uint32_t num_rows;
+    vector<string> ids; // only set on row 0
+    vector<unsigned long> slots;
+};
+
+struct EncryptedRow
+{
+    uint32_t col;
+    uint32_t row;
+    uint32_t num_rows;
+    vector<string> ids;
+    helib::Ctxt ctxt;
+};
+
+// Reads the lines of a plain or bgzip-compressed VCF file
+class VCFLineReader
+{
+public:
+    VCFLineReader(const string &path, uint32_t num_threads)
+    {
+        if (IsBGZF(path))
+        {
+            bgzf = make_unique<BGZFReader>(path, num_threads);
+            return;
+        }
+
+        buffer = vector<char>(VCF_READ_BUFFER);
+        file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        file.open(path);
+        if (!file.is_open())
+        {
+            throw invalid_argument("ERROR: cannot open VCF file: " + path);
+        }
+    }
+
+    bool GetLine(string &line)
+    {
+        if (bgzf)
+        {
+            return bgzf->GetLine(line);
+        }
+        return (bool)getline(file, line);
+    }
+
+private:
+    unique_ptr<BGZFReader> bgzf;
+    vector<char> buffer;
+    ifstream file;
+};
+
+static bool is_variant_line(const string &line)
+{
+    return !line.empty() && line[0] != '#';
+}
+
+uint64_t PeakRSSBytes()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return stoull(line.substr(6)) * 1024;
+        }
+    }
+    return 0;
+}
+
+VCFSummary ScanVCF(const string &path, uint32_t num_threads)
+{
+    VCFLineReader file(path, num_threads);
+
+    VCFSummary summary;
+    vector<string_view> fields;
+    string line;
+    while (file.GetLine(line))
+    {
+        if (!is_variant_line(line))
+        {
+            continue;
+        }
+        SplitVCFLine(line, fields);
+        if (fields.size() <= VCF_FIRST_SAMPLE_FIELD)
+        {
+            throw invalid_argument("ERROR: VCF variant " + to_string(summary.ids.size()) + " has no samples");
+        }
+        if (summary.ids.empty())
+        {
+            summary.num_samples = fields.size() - VCF_FIRST_SAMPLE_FIELD;
+        }
+        summary.ids.push_back(string(fields[VCF_ID_FIELD]));
+    }
+    return summary;
+}
+
+VCFGenotypes ReadVCFGenotypes(const string &path, uint32_t num_threads)
+{
+    VCFLineReader file(path, num_threads);
+
+    VCFGenotypes vcf;
+    vector<string_view> fields;
+    string line;
+    while (file.GetLine(line))
+    {
+        if (!is_variant_line(line))
+        {
+            continue;
+        }
+        SplitVCFLine(line, fields);
+        if (fields.size() <= VCF_FIRST_SAMPLE_FIELD)
+        {
+            throw invalid_argument("ERROR: VCF variant " + to_string(vcf.ids.size()) + " has no samples");
+        }
+        if (vcf.ids.empty())
+        {
+            vcf.num_samples = fields.size() - VCF_FIRST_SAMPLE_FIELD;
+        }
+        if (fields.size() - VCF_FIRST_SAMPLE_FIELD != vcf.num_samples)
+        {
+            throw invalid_argument("ERROR: VCF variant " + string(fields[VCF_ID_FIELD]) + " has " +
+                                   to_string(fields.size() - VCF_FIRST_SAMPLE_FIELD) + " samples instead of " +
+                                   to_string(vcf.num_samples));
+        }
+
+        vector<uint32_t> genotypes = vector<uint32_t>(vcf.num_samples);
+        for (uint32_t k = 0; k < vcf.num_samples; k++)
+        {
+            genotypes[k] = DecodeGenotype(fields[VCF_FIRST_SAMPLE_FIELD + k]);
+        }
+        vcf.ids.push_back(string(fields[VCF_ID_FIELD]));
+        vcf.genotypes.push_back(move(genotypes));
+    }
+    return vcf;
+}
+
+void SplitVCFLine(string_view line, vector<string_view> &fields)
+{
+    fields.clear();
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.remove_suffix(1);
+    }
+
+    const char *start = line.data();
+    const char *end = line.data() + line.size();
+    while (true)
+    {
+        const char *tab = static_cast<const char *>(memchr(start, '\t', end - start));
+        if (tab == nullptr)
+        {
+            fields.emplace_back(start, end - start);
+            return;
+        }
+        fields.emplace_back(start, tab - start);
+        start = tab + 1;
+    }
+}
+
+uint32_t DecodeGenotype(string_view field)
+{
+    // Only the GT sub-field counts, e.g. "0|1" out of "0|1:12:0.98"
+    string_view gt = field.substr(0, field.find(':'));
+
+    uint32_t genotype = 0;
+    size_t start = 0;
+    while (start <= gt.size())
+    {
+        size_t separator = gt.find_first_of("/|", start);
+        string_view allele = gt.substr(start, separator == string_view::npos ? string_view::npos : separator - start);
+        if (allele.empty() || (allele != "." && allele.find_first_not_of("0123456789") != string_view::npos))
+        {
+            throw invalid_argument("ERROR: malformed VCF genotype " + string(field));
+        }
+        if (allele != "." && allele.find_first_not_of('0') != string_view::npos)
+        {
+            genotype += 1;
+        }
+        if (separator == string_view::npos)
+        {
+            break;
+        }
+        start = separator + 1;
+    }
+
+    if (genotype > 2)
+    {
+        throw invalid_argument("ERROR: only haploid and diploid VCF genotypes are supported: " + string(field));
+    }
+    return genotype;
+}
+
+VCFIngest::VCFIngest(const helib::PubKey &_pk, uint32_t _num_slots, uint32_t _snps_per_slot, uint32_t _num_threads)
+    : pk(_pk), num_slots(_num_slots), snps_per_slot(_snps_per_slot), num_threads(_num_threads == 0 ? 1 : _num_threads)
+{
+}
+
+IngestStats VCFIngest::Run(const string &path, const Sink &sink)
+{
+    auto start = chrono::steady_clock::now();
+
+    // Tokenizing and inflating are cheap next to encryption, so they get a quarter of the threads each
+    uint32_t num_tokenizers = max<uint32_t>(1, num_threads / 4);
+    VCFLineReader file(path, num_tokenizers);
+
+    uint32_t num_encryptors = num_threads;
+
+    BoundedQueue<RawLine> raw_lines(VCF_QUEUE_DEPTH * num_tokenizers);
+    BoundedQueue<TokenizedLine> tokenized_lines(VCF_QUEUE_DEPTH * num_tokenizers);
+    BoundedQueue<EncryptJob> jobs(VCF_QUEUE_DEPTH * num_encryptors);
+    BoundedQueue<EncryptedRow> encrypted_rows(VCF_QUEUE_DEPTH * num_encryptors);
+
+    mutex error_mutex;
+    exception_ptr error;
+    auto fail = [&](exception_ptr e)
+    {
+        {
+            lock_guard<mutex> lock(error_mutex);
+            if (!error)
+            {
+                error = e;
+            }
+        }
+        raw_lines.Close();
+        tokenized_lines.Close();
+        jobs.Close();
+        encrypted_rows.Close();
+    };
+
+    IngestStats stats;
+    uint32_t num_samples = 0; // set by the decoder from the first variant
+
+    vector<thread> threads;
+
+    threads.emplace_back([&]
+                         {
+        try
+        {
+            string line;
+            uint64_t seq = 0;
+            while (file.GetLine(line))
+            {
+                if (is_variant_line(line) && !raw_lines.Push(RawLine{seq++, make_unique<string>(move(line))}))
+                {
+                    return;
+                }
+            }
+            raw_lines.Close();
+        }
+        catch (...)
+        {
+            fail(current_exception());
+        } });
+
+    atomic<uint32_t> tokenizers_left(num_tokenizers);
+    for (uint32_t t = 0; t < num_tokenizers; t++)
+    {
+        threads.emplace_back([&]
+                             {
+            try
+            {
+                while (optional<RawLine> line = raw_lines.Pop())
+                {
+                    TokenizedLine tokenized{line->seq, move(line->text), {}};
+                    SplitVCFLine(*tokenized.text, tokenized.fields);
+                    if (!tokenized_lines.Push(move(tokenized)))
+                    {
+                        return;
+                    }
+                }
+                if (--tokenizers_left == 0)
+                {
+                    tokenized_lines.Close();
+                }
+            }
+            catch (...)
+            {
+                fail(current_exception());
+            } });
+    }
+
+    // Puts the lines back in file order and packs snps_per_slot of them into each stored column
+    threads.emplace_back([&]
+                         {
+        try
+        {
+            map<uint64_t, TokenizedLine> pending;
+            uint64_t next_seq = 0;
+
+            uint32_t num_rows = 0;
+            uint32_t col = 0;
+            uint32_t digit = 0;
+            unsigned long digit_weight = 1;
+            vector<string> ids;
+            vector<unsigned long> packed;
+
+            auto emit_row = [&](uint32_t row)
+            {
+                uint32_t first = row * num_slots;
+                uint32_t last = min(num_samples, first + num_slots);
+                EncryptJob job{col, row, num_rows, row == 0 ? ids : vector<string>(),
+                               vector<unsigned long>(packed.begin() + first, packed.begin() + last)};
+                return jobs.Push(move(job));
+            };
+
+            while (optional<TokenizedLine> next = tokenized_lines.Pop())
+            {
+                pending.emplace(next->seq, move(*next));
+                for (auto it = pending.find(next_seq); it != pending.end(); it = pending.find(next_seq))
+                {
+                    const vector<string_view> &fields = it->second.fields;
+                    if (fields.size() <= VCF_FIRST_SAMPLE_FIELD)
+                    {
+                        throw invalid_argument("ERROR: VCF variant " + to_string(next_seq) + " has no samples");
+                    }
+                    if (num_samples == 0)
+                    {
+                        num_samples = fields.size() - VCF_FIRST_SAMPLE_FIELD;
+                        num_rows = (num_samples + num_slots - 1) / num_slots;
+                        packed = vector<unsigned long>(num_samples, 0);
+                    }
+                    else if (fields.size() - VCF_FIRST_SAMPLE_FIELD != num_samples)
+                    {
+                        throw invalid_argument("ERROR: VCF variant " + to_string(next_seq) + " has " +
+                                               to_string(fields.size() - VCF_FIRST_SAMPLE_FIELD) + " samples instead of " +
+                                               to_string(num_samples));
+                    }
+
+                    ids.push_back(string(fields[VCF_ID_FIELD]));
+                    bool last_digit = digit + 1 == snps_per_slot;
+                    for (uint32_t row = 0; row < num_rows; row++)
+                    {
+                        uint32_t last = min(num_samples, (row + 1) * num_slots);
+                        for (uint32_t s = row * num_slots; s < last; s++)
+                        {
+                            packed[s] += DecodeGenotype(fields[VCF_FIRST_SAMPLE_FIELD + s]) * digit_weight;
+                        }
+                        // A chunk of the column is complete once its last SNP is decoded
+                        if (last_digit && !emit_row(row))
+                        {
+                            return;
+                        }
+                    }
+
+                    if (last_digit)
+                    {
+                        col++;
+                        digit = 0;
+                        digit_weight = 1;
+                        ids.clear();
+                        fill(packed.begin(), packed.end(), 0);
+                    }
+                    else
+                    {
+                        digit++;
+                        digit_weight *= 3;
+                    }
+
+                    pending.erase(it);
+                    next_seq++;
+                }
+            }
+
+            // The last stored column may hold fewer than snps_per_slot SNPs
+            if (digit > 0)
+            {
+                for (uint32_t row = 0; row < num_rows; row++)
+                {
+                    if (!emit_row(row))
+                    {
+                        return;
+                    }
+                }
+            }
+            jobs.Close();
+        }
+        catch (...)
+        {
+            fail(current_exception());
+        } });
+
+    atomic<uint32_t> encryptors_left(num_encryptors);
+    for (uint32_t t = 0; t < num_encryptors; t++)
+    {
+        threads.emplace_back([&]
+                             {
+            try
+            {
+                while (optional<EncryptJob> job = jobs.Pop())
+                {
+                    helib::Ptxt<helib::BGV> ptxt(pk.getContext());
+                    for (size_t i = 0; i < job->slots.size(); i++)
+                    {
+                        ptxt[i] = job->slots[i];
+                    }
+
+                    helib::Ctxt ctxt(pk);
+                    pk.Encrypt(ctxt, ptxt);
+
+                    if (!encrypted_rows.Push(EncryptedRow{job->col, job->row, job->num_rows, move(job->ids), move(ctxt)}))
+                    {
+                        return;
+                    }
+                }
+                if (--encryptors_left == 0)
+                {
+                    encrypted_rows.Close();
+                }
+            }
+            catch (...)
+            {
+                fail(current_exception());
+            } });
+    }
+
+    // Hands complete columns to the sink in order
+    struct PendingColumn
+    {
+        vector<string> ids;
+        vector<optional<helib::Ctxt>> rows;
+        uint32_t filled = 0;
+    };
+    map<uint32_t, PendingColumn> columns;
+    uint32_t next_col = 0;
+    try
+    {
+        while (optional<EncryptedRow> row = encrypted_rows.Pop())
+        {
+            PendingColumn &column = columns[row->col];
+            if (column.rows.empty())
+            {
+                column.rows.resize(row->num_rows);
+            }
+            if (row->row == 0)
+            {
+                column.ids = move(row->ids);
+            }
+            column.rows[row->row].emplace(move(row->ctxt));
+            column.filled++;
+
+            for (auto it = columns.find(next_col); it != columns.end() && it->second.filled == it->second.rows.size();
+                 it = columns.find(next_col))
+            {
+                vector<helib::Ctxt> ciphertexts;
+                ciphertexts.reserve(it->second.rows.size());
+                for (optional<helib::Ctxt> &ctxt : it->second.rows)
+                {
+                    ciphertexts.push_back(move(*ctxt));
+                }
+
+                stats.variants += it->second.ids.size();
+                stats.ciphertexts += ciphertexts.size();
+                sink(next_col, move(it->second.ids), move(ciphertexts));
+
+                columns.erase(it);
+                next_col++;
+            }
+        }
+    }
+    catch (...)
+    {
+        fail(current_exception());
+    }
+
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+
+    stats.samples = num_samples;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats.variants_per_second = stats.seconds > 0 ? stats.variants / stats.seconds : 0;
+    stats.peak_rss_bytes = PeakRSSBytes();
+    return stats;
+}
+
+void PrintIngestStats(const IngestStats &stats)
+{
+    cout << "Ingested " << stats.variants << " variants of " << stats.samples << " samples into "
+         << stats.ciphertexts << " ciphertexts in " << stats.seconds << " s ("
+         << stats.variants_per_second << " variants/s, peak RSS " << stats.peak_rss_bytes / (1 << 20) << " MB)" << endl;
+}
@@ -0,0 +1,82 @@
+/*
+Streaming VCF ingestion
+
+A plain or bgzip-compressed VCF file is encrypted through a pipeline of stages linked by bounded queues,
+so only the lines and ciphertexts in flight are held in memory however large the file is:
+
+    reader -> tokenizers (parallel) -> genotype decoder -> encryptors (parallel) -> sink
+
+Every variant line becomes one SNP column with one genotype per sample. The decoder hands the encryptors
+each chunk of num_slots samples of a column as soon as it is decoded, and the sink receives the encrypted
+columns in file order.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// Statistics of one ingest, counting each SNP as a variant
+struct IngestStats
+{
+    uint64_t variants = 0;
+    uint32_t samples = 0;
+    uint64_t ciphertexts = 0;
+    double seconds = 0;
+    double variants_per_second = 0;
+    uint64_t peak_rss_bytes = 0;
+};
+
+// Variant IDs and sample count of a VCF file, read without decoding any genotype
+struct VCFSummary
+{
+    vector<string> ids;
+    uint32_t num_samples = 0;
+};
+
+VCFSummary ScanVCF(const string &path, uint32_t num_threads = 1);
+
+// Every genotype of a VCF file, one vector of samples per variant
+struct VCFGenotypes
+{
+    vector<string> ids;
+    vector<vector<uint32_t>> genotypes;
+    uint32_t num_samples = 0;
+};
+
+// Decodes a whole VCF file into memory, meant for batches small enough to hold in the clear such as new samples
+VCFGenotypes ReadVCFGenotypes(const string &path, uint32_t num_threads = 1);
+
+// Splits a tab separated line into fields pointing into the line
+void SplitVCFLine(string_view line, vector<string_view> &fields);
+
+// Number of alternate alleles (0, 1 or 2) in the GT sub-field of one sample field, missing alleles counting as 0
+uint32_t DecodeGenotype(string_view field);
+
+class VCFIngest
+{
+public:
+    // Receives stored column col, holding the SNPs named by ids as digits of its slots (see Server::SetPacking),
+    // with one ciphertext per compressed row
+    using Sink = function<void(uint32_t col, vector<string> &&ids, vector<helib::Ctxt> &&ciphertexts)>;
+
+    VCFIngest(const helib::PubKey &_pk, uint32_t _num_slots, uint32_t _snps_per_slot, uint32_t _num_threads);
+
+    IngestStats Run(const string &path, const Sink &sink);
+
+private:
+    const helib::PubKey &pk;
+    uint32_t num_slots;
+    uint32_t snps_per_slot;
+    uint32_t num_threads;
+};
+
+// Peak resident set size of this process
+uint64_t PeakRSSBytes();
+
+void PrintIngestStats(const IngestStats &stats);
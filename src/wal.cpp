@@ -0,0 +1,444 @@
+#include "wal.hpp"
+#include "db_file.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <libgen.h>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+template <typename T>
+static void write_raw(ostream &str, const T &value)
+{
+    str.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static T read_raw(istream &str)
+{
+    T value;
+    str.read(reinterpret_cast<char *>(&value), sizeof(T));
+    if (!str)
+    {
+        throw invalid_argument("ERROR: write-ahead log record is truncated");
+    }
+    return value;
+}
+
+static uint32_t crc(const char *data, size_t length, uint32_t initial = 0)
+{
+    return crc32(initial, reinterpret_cast<const Bytef *>(data), length);
+}
+
+static void sync_fd(int fd, const string &path)
+{
+    if (fsync(fd) != 0)
+    {
+        throw runtime_error("ERROR: fsync failed for " + path);
+    }
+}
+
+WriteAheadLog::WriteAheadLog(const string &path, uint64_t _last_lsn, uint32_t _group_commit_ms)
+    : group_commit_ms(_group_commit_ms), last_lsn(_last_lsn)
+{
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        throw invalid_argument("ERROR: cannot open write-ahead log: " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw runtime_error("ERROR: cannot stat write-ahead log: " + path);
+    }
+    file_bytes = st.st_size;
+    stats.last_lsn = last_lsn;
+    stats.durable_lsn = last_lsn;
+
+    if (group_commit_ms > 0)
+    {
+        flusher = thread(&WriteAheadLog::RunFlusher, this);
+    }
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    {
+        lock_guard<mutex> lock(wal_mutex);
+        stop = true;
+    }
+    flush_cv.notify_all();
+    if (flusher.joinable())
+    {
+        flusher.join();
+    }
+    try
+    {
+        Flush();
+    }
+    catch (...)
+    {
+        // Nothing to report a failure to; the records lost are those a crash here would have lost
+    }
+    close(fd);
+}
+
+string WriteAheadLog::Encode(WALRecordType type, uint32_t col, uint32_t row, const vector<const helib::Ctxt *> &ctxts)
+{
+    ostringstream str;
+    write_raw(str, (uint8_t)type);
+    write_raw(str, col);
+    write_raw(str, row);
+    write_raw(str, (uint32_t)ctxts.size());
+    for (const helib::Ctxt *ctxt : ctxts)
+    {
+        ctxt->writeTo(str);
+    }
+    return str.str();
+}
+
+uint64_t WriteAheadLog::Append(const string &encoded)
+{
+    // The crc of the encoded part is taken off the lock and combined with that of the lsn once it is known
+    uint32_t encoded_crc = crc(encoded.data(), encoded.size());
+    uint64_t lsn;
+    {
+        lock_guard<mutex> lock(wal_mutex);
+        RethrowError();
+
+        lsn = ++last_lsn;
+        uint32_t length = sizeof(lsn) + encoded.size();
+        uint32_t record_crc = crc32_combine(crc(reinterpret_cast<const char *>(&lsn), sizeof(lsn)), encoded_crc, encoded.size());
+
+        pending.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        pending.append(reinterpret_cast<const char *>(&record_crc), sizeof(record_crc));
+        pending.append(reinterpret_cast<const char *>(&lsn), sizeof(lsn));
+        pending.append(encoded);
+        stats.records++;
+        pending_records++;
+
+        if (group_commit_ms > 0 && pending.size() >= WAL_GROUP_COMMIT_BYTES)
+        {
+            flush_cv.notify_one();
+        }
+    }
+    return lsn;
+}
+
+void WriteAheadLog::WaitDurable(uint64_t lsn)
+{
+    if (group_commit_ms == 0)
+    {
+        // The first waiter writes out every record queued so far, and those behind it on flush_mutex find theirs
+        // already synced
+        Flush();
+        return;
+    }
+
+    unique_lock<mutex> lock(wal_mutex);
+    durable_cv.wait(lock, [&]
+                    { return stats.durable_lsn >= lsn || error; });
+    if (stats.durable_lsn < lsn)
+    {
+        RethrowError();
+    }
+}
+
+void WriteAheadLog::Sync()
+{
+    {
+        lock_guard<mutex> lock(wal_mutex);
+        RethrowError();
+    }
+    Flush();
+}
+
+void WriteAheadLog::Truncate()
+{
+    Flush();
+
+    lock_guard<mutex> flush_lock(flush_mutex);
+    if (ftruncate(fd, 0) != 0)
+    {
+        throw runtime_error("ERROR: failed truncating write-ahead log");
+    }
+    sync_fd(fd, "write-ahead log");
+
+    lock_guard<mutex> lock(wal_mutex);
+    file_bytes = 0;
+    stats.checkpoints++;
+}
+
+void WriteAheadLog::Flush()
+{
+    lock_guard<mutex> flush_lock(flush_mutex);
+
+    string batch;
+    uint64_t lsn;
+    uint64_t batch_records;
+    uint64_t written_bytes;
+    {
+        lock_guard<mutex> lock(wal_mutex);
+        if (broken)
+        {
+            rethrow_exception(broken);
+        }
+        if (last_lsn == stats.durable_lsn)
+        {
+            return;
+        }
+        batch.swap(pending);
+        batch_records = pending_records;
+        pending_records = 0;
+        lsn = last_lsn;
+        written_bytes = file_bytes;
+    }
+
+    try
+    {
+        for (size_t done = 0; done < batch.size();)
+        {
+            ssize_t count = write(fd, batch.data() + done, batch.size() - done);
+            if (count < 0)
+            {
+                throw runtime_error("ERROR: failed writing write-ahead log");
+            }
+            done += count;
+        }
+        if (fdatasync(fd) != 0)
+        {
+            throw runtime_error("ERROR: fdatasync failed for write-ahead log");
+        }
+    }
+    catch (...)
+    {
+        // Whatever part of the batch reached the file is cut off and the batch goes back ahead of the records
+        // appended since, so the next flush writes it again in order. A batch written after a tail that could
+        // not be cut off would be lost to replay, which stops at the torn record, so the log is failed for good.
+        bool cut = ftruncate(fd, written_bytes) == 0;
+        {
+            lock_guard<mutex> lock(wal_mutex);
+            pending.insert(0, batch);
+            pending_records += batch_records;
+            if (!cut)
+            {
+                broken = make_exception_ptr(runtime_error("ERROR: failed cutting a torn batch off write-ahead log"));
+                error = broken;
+            }
+        }
+        durable_cv.notify_all();
+        throw;
+    }
+
+    {
+        lock_guard<mutex> lock(wal_mutex);
+        file_bytes += batch.size();
+        stats.syncs++;
+        stats.durable_lsn = lsn;
+        synced_records += batch_records;
+    }
+    durable_cv.notify_all();
+}
+
+void WriteAheadLog::RunFlusher()
+{
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(wal_mutex);
+            flush_cv.wait_for(lock, chrono::milliseconds(group_commit_ms), [&]
+                              { return stop || pending.size() >= WAL_GROUP_COMMIT_BYTES; });
+            if (stop)
+            {
+                return;
+            }
+        }
+
+        try
+        {
+            Flush();
+        }
+        catch (...)
+        {
+            {
+                lock_guard<mutex> lock(wal_mutex);
+                if (!error)
+                {
+                    error = current_exception();
+                }
+            }
+            durable_cv.notify_all();
+        }
+    }
+}
+
+void WriteAheadLog::RethrowError()
+{
+    if (broken)
+    {
+        rethrow_exception(broken);
+    }
+    if (error)
+    {
+        exception_ptr failure = error;
+        error = nullptr;
+        rethrow_exception(failure);
+    }
+}
+
+uint64_t WriteAheadLog::LastLSN()
+{
+    lock_guard<mutex> lock(wal_mutex);
+    return last_lsn;
+}
+
+uint64_t WriteAheadLog::Bytes()
+{
+    lock_guard<mutex> lock(wal_mutex);
+    return file_bytes + pending.size();
+}
+
+WALStats WriteAheadLog::Stats()
+{
+    lock_guard<mutex> lock(wal_mutex);
+    WALStats current = stats;
+    current.bytes = file_bytes + pending.size();
+    current.last_lsn = last_lsn;
+    current.records_per_sync = stats.syncs > 0 ? (double)synced_records / stats.syncs : 0;
+    return current;
+}
+
+WALReplayStats ReplayWAL(const string &path, const helib::PubKey &pk, uint64_t after_lsn,
+                         const function<void(WALRecord &)> &apply)
+{
+    auto start = chrono::steady_clock::now();
+
+    WALReplayStats stats;
+    stats.last_lsn = after_lsn;
+
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file.is_open())
+    {
+        // No log means nothing changed after the checkpoint
+        return stats;
+    }
+    uint64_t file_length = file.tellg();
+    file.seekg(0);
+
+    uint64_t offset = 0;
+    uint32_t header[2];
+    while (offset < file_length)
+    {
+        // A record cut short or failing its crc can only be the last one a crash interrupted
+        if (file_length - offset < sizeof(header) || !file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+            header[0] < sizeof(uint64_t) || header[0] > file_length - offset - sizeof(header))
+        {
+            stats.torn = true;
+            break;
+        }
+        string payload(header[0], '\0');
+        if (!file.read(&payload[0], payload.size()) || crc(payload.data(), payload.size()) != header[1])
+        {
+            stats.torn = true;
+            break;
+        }
+
+        MemoryStreamBuffer buffer(payload.data(), payload.size());
+        istream str(&buffer);
+
+        WALRecord record;
+        record.lsn = read_raw<uint64_t>(str);
+        offset += sizeof(header) + payload.size();
+
+        if (record.lsn <= after_lsn)
+        {
+            stats.skipped++;
+            continue;
+        }
+        // A failed write is retried whole, so records reach the file in order; a gap means one was lost
+        if (record.lsn != stats.last_lsn + 1)
+        {
+            throw runtime_error("ERROR: write-ahead log " + path + " jumps from record " + to_string(stats.last_lsn) +
+                                " to " + to_string(record.lsn));
+        }
+        record.type = (WALRecordType)read_raw<uint8_t>(str);
+        record.col = read_raw<uint32_t>(str);
+        record.row = read_raw<uint32_t>(str);
+        uint32_t num_ctxts = read_raw<uint32_t>(str);
+        record.ctxts.reserve(num_ctxts);
+        for (uint32_t i = 0; i < num_ctxts; i++)
+        {
+            record.ctxts.push_back(helib::Ctxt::readFrom(str, pk));
+        }
+
+        apply(record);
+        stats.replayed++;
+        stats.last_lsn = record.lsn;
+    }
+    file.close();
+
+    stats.bytes = offset;
+    if (stats.torn && truncate(path.c_str(), offset) != 0)
+    {
+        throw runtime_error("ERROR: failed cutting the torn tail off write-ahead log: " + path);
+    }
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+void PublishFile(const string &tmp_path, const string &path)
+{
+    int fd = open(tmp_path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw invalid_argument("ERROR: cannot open " + tmp_path);
+    }
+    try
+    {
+        sync_fd(fd, tmp_path);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        throw runtime_error("ERROR: cannot rename " + tmp_path + " to " + path);
+    }
+
+    // The rename itself is only durable once the directory holding it is synced
+    string dir_path = path;
+    int dir = open(dirname(&dir_path[0]), O_RDONLY | O_DIRECTORY);
+    if (dir >= 0)
+    {
+        fsync(dir);
+        close(dir);
+    }
+}
+
+void PrintWALStats(const WALStats &stats)
+{
+    cout << "Write-ahead log: " << stats.records << " records, " << stats.bytes << " bytes, " << stats.syncs << " syncs ("
+         << stats.records_per_sync << " records per sync), lsn " << stats.last_lsn << " (" << stats.durable_lsn
+         << " durable), " << stats.checkpoints << " checkpoints" << endl;
+}
+
+void PrintWALReplayStats(const WALReplayStats &stats)
+{
+    cout << "Replayed " << stats.replayed << " write-ahead log records (" << stats.skipped << " already checkpointed, "
+         << stats.bytes << " bytes) up to lsn " << stats.last_lsn << " in " << stats.seconds << " seconds"
+         << (stats.torn ? ", torn tail cut off" : "") << endl;
+}
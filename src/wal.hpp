@@ -0,0 +1,145 @@
+/*
+Write-ahead log of changes to the encrypted database
+
+Every change is logged as the encrypted delta it applied, so a crash loses nothing that was synced and recovery
+never has to encrypt anything again: it loads the last checkpoint, a database file recording the last log
+record it includes, and replays the records after it in order.
+
+Record layout (host byte order):
+    length    : uint32_t length of the payload
+    crc       : uint32_t zlib crc32 of the payload
+    payload   : lsn (uint64_t), type (uint8_t), col, row, num_ctxts (uint32_t each),
+                then one Ctxt::writeTo blob per ciphertext
+
+Records are appended to a buffer and written out and synced in groups, either every group_commit_ms by a
+background thread or by the first caller to wait with a group commit interval of 0, so changes made at the same
+time share one fsync. A change is only acknowledged once WaitDurable says its record is on disk. A batch that
+fails to be written out is cut off the file again and kept for the next attempt, so records always reach the
+file in order and without gaps. If it cannot be cut off, every later Append and wait throws. A crash can tear
+the last record written; replay stops at the first record that is incomplete or fails its crc and cuts the log
+there.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Buffered bytes past which the flusher is woken before the group commit interval is up
+const uint64_t WAL_GROUP_COMMIT_BYTES = 1 << 24;
+
+enum WALRecordType : uint8_t
+{
+    WAL_ADD = 1,    // ctxts[0] was added to stored column col, compressed row row
+    WAL_APPEND = 2, // row rows were appended; per stored column the ciphertext added to the partly filled
+                    // last compressed row, if there was one, followed by the new compressed rows
+    WAL_REUSE = 3,  // deleted row row was reused; per stored column the ciphertext added once its slot was masked
+    WAL_DELETE = 4, // row row was marked deleted
+};
+
+struct WALRecord
+{
+    uint64_t lsn = 0;
+    WALRecordType type = WAL_ADD;
+    uint32_t col = 0;
+    uint32_t row = 0;
+    vector<helib::Ctxt> ctxts;
+};
+
+struct WALStats
+{
+    uint64_t records = 0;     // appended since the log was opened
+    uint64_t bytes = 0;       // size of the log, including what is not written out yet
+    uint64_t syncs = 0;
+    uint64_t last_lsn = 0;
+    uint64_t durable_lsn = 0; // every record up to this one is on disk
+    uint64_t checkpoints = 0;
+    double records_per_sync = 0;
+};
+
+struct WALReplayStats
+{
+    uint64_t replayed = 0;
+    uint64_t skipped = 0;     // records already included in the checkpoint
+    uint64_t bytes = 0;       // valid bytes of the log
+    uint64_t last_lsn = 0;
+    bool torn = false;        // the log ended in an incomplete or corrupt record, which was cut off
+    double seconds = 0;
+};
+
+class WriteAheadLog
+{
+public:
+    // Opens path for appending records numbered after last_lsn. A group commit interval of 0 leaves syncing to
+    // the callers of WaitDurable instead of a background thread.
+    WriteAheadLog(const string &path, uint64_t last_lsn, uint32_t _group_commit_ms);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    // Serializes the ciphertexts of one record. Kept apart from Append so a caller can encode ciphertexts
+    // before handing them over and log the change once it is applied.
+    static string Encode(WALRecordType type, uint32_t col, uint32_t row, const vector<const helib::Ctxt *> &ctxts);
+
+    // Numbers an encoded record and queues it for the next group commit; returns its lsn
+    uint64_t Append(const string &encoded);
+    // Waits until the record lsn and every one before it are on disk. Rethrows a failed background flush.
+    void WaitDurable(uint64_t lsn);
+
+    // Waits until every record appended so far is on disk
+    void Sync();
+    // Empties the log once a checkpoint includes every record in it. Record numbers keep counting up.
+    void Truncate();
+
+    uint64_t LastLSN();
+    uint64_t Bytes();
+    WALStats Stats();
+
+private:
+    void Flush();
+    void RunFlusher();
+    void RethrowError();
+
+    int fd = -1;
+    uint32_t group_commit_ms;
+
+    mutex wal_mutex;
+    condition_variable flush_cv;
+    condition_variable durable_cv; // notified after every flush, whether it succeeded or not
+    string pending;           // records appended and not written out yet
+    uint64_t pending_records = 0;
+    uint64_t synced_records = 0;
+    uint64_t last_lsn;
+    uint64_t file_bytes = 0;
+    bool stop = false;
+    exception_ptr error;      // failure of a background flush, rethrown to the next caller
+    exception_ptr broken;     // failure that left a torn batch in the file, rethrown to every caller from then on
+
+    mutex flush_mutex;        // serializes writing out and syncing
+    WALStats stats;
+
+    thread flusher;
+};
+
+// Reads the records of path in order and hands those after after_lsn to apply. Stops at the first incomplete
+// or corrupt record and truncates the file there, so logging can resume after the last valid record. Throws if
+// the records after after_lsn are not numbered consecutively, as one of them went missing.
+WALReplayStats ReplayWAL(const string &path, const helib::PubKey &pk, uint64_t after_lsn,
+                         const function<void(WALRecord &)> &apply);
+
+// Syncs tmp_path and renames it over path, so a crash leaves either the old or the new file whole
+void PublishFile(const string &tmp_path, const string &path);
+
+void PrintWALStats(const WALStats &stats);
+void PrintWALReplayStats(const WALReplayStats &stats);
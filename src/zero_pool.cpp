@@ -0,0 +1,134 @@
+#include "zero_pool.hpp"
+
+#include <NTL/BasicThreadPool.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+ZeroPool::ZeroPool(const helib::PubKey &_public_key, uint32_t _capacity, uint32_t num_threads)
+    : public_key(_public_key), capacity(_capacity), latencies(ZERO_POOL_LATENCY_SAMPLES)
+{
+    for (uint32_t t = 0; t < max<uint32_t>(num_threads, 1); t++)
+    {
+        refillers.emplace_back(&ZeroPool::Refill, this);
+    }
+}
+
+ZeroPool::~ZeroPool()
+{
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        stop = true;
+    }
+    refill_cv.notify_all();
+    for (thread &refiller : refillers)
+    {
+        refiller.join();
+    }
+}
+
+helib::Ctxt ZeroPool::Take()
+{
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        if (!pool.empty())
+        {
+            helib::Ctxt zero = move(pool.front());
+            pool.pop_front();
+            hits++;
+            refill_cv.notify_one();
+            return zero;
+        }
+        misses++;
+    }
+    return EncryptZero();
+}
+
+void ZeroPool::RecordLatency(double seconds)
+{
+    lock_guard<mutex> lock(pool_mutex);
+    latencies[num_latencies % ZERO_POOL_LATENCY_SAMPLES] = seconds;
+    num_latencies++;
+}
+
+ZeroPoolStats ZeroPool::Stats()
+{
+    ZeroPoolStats stats;
+    vector<double> samples;
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        stats.capacity = capacity;
+        stats.depth = pool.size();
+        stats.generated = generated;
+        stats.hits = hits;
+        stats.misses = misses;
+        stats.refill_per_second = refill_seconds > 0 ? generated / refill_seconds : 0;
+        samples.assign(latencies.begin(), latencies.begin() + min<uint64_t>(num_latencies, ZERO_POOL_LATENCY_SAMPLES));
+    }
+
+    if (!samples.empty())
+    {
+        sort(samples.begin(), samples.end());
+        auto percentile = [&](double q)
+        { return samples[min<size_t>(samples.size() - 1, q * samples.size())]; };
+        stats.latency_p50 = percentile(0.50);
+        stats.latency_p95 = percentile(0.95);
+        stats.latency_p99 = percentile(0.99);
+    }
+    return stats;
+}
+
+void ZeroPool::Refill()
+{
+    // Refilling only uses cycles the request path leaves idle
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    NTL::SetNumThreads(1);
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(pool_mutex);
+            refill_cv.wait(lock, [&]
+                           { return stop || pool.size() < capacity; });
+            if (stop)
+            {
+                return;
+            }
+        }
+
+        auto start = chrono::steady_clock::now();
+        helib::Ctxt zero = EncryptZero();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        lock_guard<mutex> lock(pool_mutex);
+        generated++;
+        refill_seconds += seconds;
+        // Several refillers may have raced for the last free place
+        if (pool.size() < capacity)
+        {
+            pool.push_back(move(zero));
+        }
+    }
+}
+
+helib::Ctxt ZeroPool::EncryptZero() const
+{
+    helib::Ptxt<helib::BGV> zero(public_key.getContext());
+    helib::Ctxt ctxt(public_key);
+    public_key.Encrypt(ctxt, zero);
+    return ctxt;
+}
+
+void PrintZeroPoolStats(const ZeroPoolStats &stats)
+{
+    cout << "Zero pool: " << stats.depth << "/" << stats.capacity << " ready, " << stats.generated << " generated ("
+         << stats.refill_per_second << " /s per refill thread), " << stats.hits << " hits, " << stats.misses << " misses" << endl;
+    cout << "Update latency: p50 " << stats.latency_p50 * 1000 << " ms, p95 " << stats.latency_p95 * 1000
+         << " ms, p99 " << stats.latency_p99 * 1000 << " ms" << endl;
+}
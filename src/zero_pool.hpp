@@ -0,0 +1,84 @@
+/*
+Pool of pre-generated encryptions of zero
+
+A public-key encryption is by far the most expensive step of an update, while adding a plaintext to a fresh
+encryption of zero gives a ciphertext that is just as fresh. ZeroPool keeps up to capacity encryptions of zero
+ready, generated ahead of time by low-priority refill threads that sleep while the pool is full, so an update
+only encodes its delta and adds it to one of them. When a burst drains the pool, Take falls back to encrypting
+on the caller's thread.
+*/
+
+#pragma once
+
+#include <helib/helib.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Number of most recent update latencies the percentiles are taken over
+const uint32_t ZERO_POOL_LATENCY_SAMPLES = 4096;
+
+struct ZeroPoolStats
+{
+    uint64_t capacity = 0;
+    uint64_t depth = 0;     // encryptions of zero ready to be taken
+    uint64_t generated = 0; // encryptions of zero made by the refill threads
+    uint64_t hits = 0;      // takes served from the pool
+    uint64_t misses = 0;    // takes that found the pool empty and encrypted on the caller's thread
+
+    // Encryptions of zero per second of refill thread time
+    double refill_per_second = 0;
+
+    // Latency percentiles of the recorded updates, in seconds
+    double latency_p50 = 0;
+    double latency_p95 = 0;
+    double latency_p99 = 0;
+};
+
+class ZeroPool
+{
+public:
+    ZeroPool(const helib::PubKey &_public_key, uint32_t _capacity, uint32_t num_threads);
+    ~ZeroPool();
+
+    ZeroPool(const ZeroPool &) = delete;
+    ZeroPool &operator=(const ZeroPool &) = delete;
+
+    // A fresh encryption of zero, taken from the pool if one is ready
+    helib::Ctxt Take();
+
+    // Records the end-to-end latency of one update served with Take
+    void RecordLatency(double seconds);
+
+    ZeroPoolStats Stats();
+
+private:
+    void Refill();
+    helib::Ctxt EncryptZero() const;
+
+    const helib::PubKey &public_key;
+    uint32_t capacity;
+
+    mutex pool_mutex;
+    condition_variable refill_cv;
+    deque<helib::Ctxt> pool;
+    bool stop = false;
+
+    uint64_t generated = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    double refill_seconds = 0;
+
+    vector<double> latencies; // ring buffer of the last ZERO_POOL_LATENCY_SAMPLES latencies
+    uint64_t num_latencies = 0;
+
+    vector<thread> refillers;
+};
+
+void PrintZeroPoolStats(const ZeroPoolStats &stats);